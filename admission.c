@@ -0,0 +1,122 @@
+#include "admission.h"
+#include "protocol.h"
+#include "table.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// One connection waiting for a session
+typedef struct {
+    int fd;
+    struct sockaddr_in addr;
+    uint64_t since_ms;      // When it was queued
+    int reason;             // Result of its last claim (CLAIM_*)
+} Waiting;
+
+static Waiting *queue;      // In arrival order
+static int queue_len, queue_size;
+static uint64_t wait_ms;
+
+
+void admission_configure(int queue_size_, int wait_seconds) {
+    queue_size = queue_size_ > 0 ? queue_size_ : 0;
+    wait_ms = wait_seconds > 0 ? (uint64_t)wait_seconds * 1000 : 0;
+    queue_len = 0;
+    free(queue);
+    queue = queue_size ? calloc(queue_size, sizeof(*queue)) : NULL;
+    if (!queue) queue_size = 0;
+}
+
+// Sends a frame that doesn't belong to any session yet; best effort, the
+// socket is non-blocking and nothing else was sent on it
+static void send_frame(int fd, int type, int32_t status, const char *msg) {
+    FrameHeader h;
+    frame_pack(&h, type, 0, strlen(msg), status);
+    struct iovec iov[2] = { { &h, FRAME_HEADER_SIZE }, { (void *)msg, strlen(msg) } };
+    struct msghdr mh = { .msg_iov = iov, .msg_iovlen = 2 };
+    sendmsg(fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+// Turns a connection away with the reason its last claim failed
+static void reject(int fd, int reason, int waited) {
+    char msg[128];
+    if (reason == CLAIM_IP_LIMIT)
+        snprintf(msg, sizeof(msg), "Too many sessions from your address, try again later\n");
+    else if (waited)
+        snprintf(msg, sizeof(msg), "Server busy, no session became free in time\n");
+    else
+        snprintf(msg, sizeof(msg), "Server busy, try again later\n");
+
+    send_frame(fd, FRAME_CLOSE, 0, msg);
+    close(fd);
+    server_stats_reject(reason == CLAIM_IP_LIMIT);
+    log_write(LOG_LEVEL_WARN, "Connection turned away: %s", msg);
+}
+
+int admission_accept(int fd, const struct sockaddr_in *addr, pid_t pid, uint64_t *session_id) {
+    int index = client_slot_claim(fd, addr, pid, session_id);
+    if (index >= 0) return index;
+
+    if (queue_len >= queue_size) {
+        reject(fd, index, 0);
+        return -1;
+    }
+
+    Waiting *w = &queue[queue_len++];
+    w->fd = fd;
+    w->addr = *addr;
+    w->since_ms = stats_now_ms();
+    w->reason = index;
+    server_stats_waiting(1);
+
+    char msg[96];
+    snprintf(msg, sizeof(msg), "Server busy, waiting for a session (position %d)\n", queue_len);
+    send_frame(fd, FRAME_WAIT, queue_len, msg);
+    return -1;
+}
+
+// Takes entry i out of the queue
+static void dequeue(int i) {
+    memmove(&queue[i], &queue[i + 1], (queue_len - i - 1) * sizeof(*queue));
+    queue_len--;
+    server_stats_waiting(-1);
+}
+
+int admission_next(pid_t pid, int *fd, uint64_t *session_id) {
+    uint64_t now = stats_now_ms();
+
+    for (int i = 0; i < queue_len; ) {
+        Waiting *w = &queue[i];
+        if (wait_ms && now - w->since_ms >= wait_ms) {
+            int expired = w->fd, reason = w->reason;
+            dequeue(i);
+            reject(expired, reason, 1);
+            continue;
+        }
+
+        // A connection held back by its address doesn't block the others
+        int index = client_slot_claim(w->fd, &w->addr, pid, session_id);
+        if (index >= 0) {
+            *fd = w->fd;
+            dequeue(i);
+            return index;
+        }
+        w->reason = index;
+        if (index == CLAIM_FULL) break; // nobody fits before a session ends
+        i++;
+    }
+    return -1;
+}
+
+int admission_waiting(void) {
+    return queue_len;
+}
+
+void admission_forget(void) {
+    for (int i = 0; i < queue_len; i++) close(queue[i].fd);
+    queue_len = 0; // the owner still counts them as waiting
+}
@@ -0,0 +1,41 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <netinet/in.h> // For struct sockaddr_in
+#include <sys/types.h>  // For pid_t
+#include <stdint.h>
+
+// Admission control
+//
+// A new connection gets a session only while the server runs fewer than -m
+// sessions and its address has fewer than -I (see client_table_limits(), the
+// counters are shared by every process). Otherwise it waits in the queue of
+// the process that accepted it, up to -Q connections, and is told so with a
+// FRAME_WAIT. Queued connections are admitted in arrival order as sessions
+// end; one that can't be queued, or waited longer than the inactivity
+// timeout, gets a FRAME_CLOSE with the reason and is closed.
+
+#define ADMISSION_RETRY_MS 100  // How often the owner retries queued connections
+
+// Sets the queue length (0 = turn excess connections away at once) and how
+// long a connection may wait. Called in each accepting process.
+void admission_configure(int queue_size, int wait_seconds);
+
+// Admits a connection that was just accepted. Returns the slot index of its
+// session (with the id in *session_id), or -1 if the connection was queued
+// or turned away; it then belongs to the admission queue.
+int admission_accept(int fd, const struct sockaddr_in *addr, pid_t pid, uint64_t *session_id);
+
+// Admits the first queued connection that fits now and stores it in *fd.
+// Connections that waited too long are turned away on the way.
+// Returns its slot index, or -1 if none can be admitted.
+int admission_next(pid_t pid, int *fd, uint64_t *session_id);
+
+// Connections waiting in this process's queue
+int admission_waiting(void);
+
+// Closes the queued connections without a word; for children that inherited
+// the queue of the process that accepted them
+void admission_forget(void);
+
+#endif
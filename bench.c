@@ -0,0 +1,588 @@
+#define _GNU_SOURCE
+
+#include "bench.h"
+#include "client.h"
+#include "protocol.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#define MAX_EVENTS 64           // Events handled per epoll_wait() call
+#define DRAIN_TIMEOUT_MS 5000   // How long answers are awaited after the run
+#define RETRY_DELAY_NS 100000000ULL // Pause before reconnecting after an error
+
+// Log-linear latency histogram in microseconds: 32 buckets per power of two,
+// so any reported value is within ~3% of the true one
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_SIZE (37 * HIST_SUB)   // Up to 2^40 us
+
+typedef struct {
+    uint64_t counts[HIST_SIZE];
+    uint64_t total, sum, min, max;
+} Histogram;
+
+enum { B_CONNECTING, B_HELLO, B_IDLE, B_BUSY, B_RETRY };
+
+// One benchmark connection
+typedef struct {
+    int fd;
+    int state;
+    uint64_t started;       // Connect start, or when the current command was due
+    uint64_t next_due;      // When the next command should go out (B_IDLE/B_RETRY)
+    int sent;               // Commands sent on this connection
+    uint32_t request_id;
+    int closing;            // Server sent FRAME_CLOSE
+    char hdr[FRAME_HEADER_SIZE];
+    int hdr_len;            // Header bytes collected so far
+    uint32_t skip;          // Payload bytes still to skip
+} BenchSession;
+
+typedef struct {
+    Histogram connect, command;
+    uint64_t commands, failed, errors, bytes;
+    uint64_t rejected;      // Connections turned away by admission control (also errors)
+} BenchStats;
+
+static const char *default_mix[] = { "echo spaasm-bench", "help", "true" };
+
+static char **mix;
+static int mix_count, mix_next;
+
+// Idle sessions ordered by next_due
+static int *heap;
+static int heap_len;
+
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static int hist_index(uint64_t v) {
+    if (v < HIST_SUB) return (int)v;
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - HIST_SUB_BITS;
+    int idx = ((shift + 1) << HIST_SUB_BITS) + (int)((v >> shift) & (HIST_SUB - 1));
+    return idx < HIST_SIZE ? idx : HIST_SIZE - 1;
+}
+
+// Smallest value that falls into bucket idx
+static uint64_t hist_lower(int idx) {
+    if (idx < HIST_SUB) return idx;
+    int shift = (idx >> HIST_SUB_BITS) - 1;
+    return (uint64_t)((idx & (HIST_SUB - 1)) | HIST_SUB) << shift;
+}
+
+static void hist_record(Histogram *h, uint64_t us) {
+    h->counts[hist_index(us)]++;
+    if (h->total == 0 || us < h->min) h->min = us;
+    if (us > h->max) h->max = us;
+    h->total++;
+    h->sum += us;
+}
+
+// Value below which the fraction p of the samples lie (bucket upper bound)
+static uint64_t hist_percentile(const Histogram *h, double p) {
+    if (h->total == 0) return 0;
+    uint64_t rank = (uint64_t)(p * h->total + 0.999999);
+    if (rank == 0) rank = 1;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_SIZE; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t upper = i + 1 < HIST_SIZE ? hist_lower(i + 1) - 1 : h->max;
+            return upper < h->max ? upper : h->max;
+        }
+    }
+    return h->max;
+}
+
+
+static void heap_swap(int a, int b) {
+    int t = heap[a];
+    heap[a] = heap[b];
+    heap[b] = t;
+}
+
+static void heap_push(BenchSession *ss, int idx) {
+    int i = heap_len++;
+    heap[i] = idx;
+    while (i > 0 && ss[heap[(i - 1) / 2]].next_due > ss[heap[i]].next_due) {
+        heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static int heap_pop(BenchSession *ss) {
+    int top = heap[0];
+    heap[0] = heap[--heap_len];
+
+    int i = 0;
+    while (1) {
+        int l = 2 * i + 1, r = l + 1, m = i;
+        if (l < heap_len && ss[heap[l]].next_due < ss[heap[m]].next_due) m = l;
+        if (r < heap_len && ss[heap[r]].next_due < ss[heap[m]].next_due) m = r;
+        if (m == i) break;
+        heap_swap(i, m);
+        i = m;
+    }
+    return top;
+}
+
+
+// Loads the command mix, one command per line
+static int load_mix(const char *path) {
+    if (!path) {
+        mix = (char **)default_mix;
+        mix_count = sizeof(default_mix) / sizeof(default_mix[0]);
+        return 0;
+    }
+
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        perror("fopen mix");
+        return -1;
+    }
+
+    char line[PROTO_MAX_COMMAND];
+    while (fgets(line, sizeof(line), in)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0') continue;
+        char **p = realloc(mix, (mix_count + 1) * sizeof(*mix));
+        if (!p) break;
+        mix = p;
+        mix[mix_count++] = strdup(line);
+    }
+    fclose(in);
+
+    if (mix_count == 0) {
+        fprintf(stderr, "The command mix %s is empty\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+
+// Starts a new connection for a session
+static void bench_connect(int epoll_fd, BenchSession *ss, int idx, const BenchConfig *cfg, BenchStats *st) {
+    BenchSession *bs = &ss[idx];
+
+    bs->fd = client_connect(cfg->unix_path, cfg->port, SOCK_NONBLOCK);
+    bs->started = now_ns();
+    bs->sent = 0;
+    bs->closing = 0;
+    bs->hdr_len = 0;
+    bs->skip = 0;
+
+    if (bs->fd < 0) {
+        st->errors++;
+        bs->state = B_RETRY;
+        bs->next_due = bs->started + RETRY_DELAY_NS;
+        heap_push(ss, idx);
+        return;
+    }
+
+    bs->state = B_CONNECTING;
+    struct epoll_event ev = { .events = EPOLLOUT, .data.u32 = idx };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, bs->fd, &ev);
+}
+
+// Drops a connection; the session reconnects (after a pause if it failed)
+static void bench_disconnect(BenchSession *ss, int idx, int failed, BenchStats *st) {
+    BenchSession *bs = &ss[idx];
+
+    close(bs->fd); // also removes it from epoll
+    bs->fd = -1;
+    if (failed) st->errors++;
+
+    bs->state = B_RETRY;
+    bs->next_due = now_ns() + (failed ? RETRY_DELAY_NS : 0);
+    heap_push(ss, idx);
+}
+
+// Counts sessions still connecting or waiting for an answer
+static int bench_busy(const BenchSession *ss, int count) {
+    int busy = 0;
+    for (int i = 0; i < count; i++)
+        if (ss[i].state == B_CONNECTING || ss[i].state == B_HELLO || ss[i].state == B_BUSY) busy++;
+    return busy;
+}
+
+// Sends the next command of the mix
+static int bench_send(BenchSession *bs) {
+    const char *cmd = mix[mix_next];
+    mix_next = (mix_next + 1) % mix_count;
+
+    FrameHeader h;
+    frame_pack(&h, FRAME_COMMAND, ++bs->request_id, strlen(cmd), 0);
+    struct iovec iov[2] = {
+        { .iov_base = &h, .iov_len = sizeof(h) },
+        { .iov_base = (void *)cmd, .iov_len = strlen(cmd) },
+    };
+
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+
+    // Only one command is in flight, the socket buffer has room for it
+    ssize_t n = sendmsg(bs->fd, &msg, MSG_NOSIGNAL);
+    if (n != (ssize_t)(sizeof(h) + strlen(cmd))) return -1;
+
+    bs->state = B_BUSY;
+    bs->sent++;
+    return 0;
+}
+
+// Parses the server's frames. Returns -1 if the connection must be dropped.
+static int bench_input(BenchSession *bs, BenchStats *st, int *ended) {
+    char buf[65536];
+    ssize_t n = read(bs->fd, buf, sizeof(buf));
+    if (n == 0) return -1;
+    if (n < 0) return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+
+    ssize_t pos = 0;
+    while (pos < n) {
+        if (bs->skip > 0) {
+            uint32_t take = (uint32_t)(n - pos) < bs->skip ? (uint32_t)(n - pos) : bs->skip;
+            bs->skip -= take;
+            pos += take;
+            continue;
+        }
+
+        int take = FRAME_HEADER_SIZE - bs->hdr_len;
+        if (take > n - pos) take = n - pos;
+        memcpy(bs->hdr + bs->hdr_len, buf + pos, take);
+        bs->hdr_len += take;
+        pos += take;
+        if (bs->hdr_len < FRAME_HEADER_SIZE) break;
+        bs->hdr_len = 0;
+
+        FrameHeader h;
+        if (frame_unpack(bs->hdr, FRAME_HEADER_SIZE, &h) != 1) {
+            if (bs->state == B_HELLO)
+                fprintf(stderr, "The server does not speak the framed protocol\n");
+            return -1;
+        }
+        bs->skip = h.length;
+
+        uint64_t now = now_ns();
+        switch (h.type) {
+        case FRAME_HELLO:
+            hist_record(&st->connect, (now - bs->started) / 1000);
+            bs->state = B_IDLE;
+            *ended = 1;
+            break;
+        case FRAME_DATA:
+            st->bytes += h.length;
+            break;
+        case FRAME_END:
+            hist_record(&st->command, (now - bs->started) / 1000);
+            st->commands++;
+            if (h.status != 0) st->failed++;
+            bs->state = B_IDLE;
+            *ended = 1;
+            break;
+        case FRAME_CLOSE:
+            // Turned away before the session started: retry later
+            if (bs->state == B_HELLO) {
+                st->rejected++;
+                return -1;
+            }
+            // quit/abort in the mix: the answer ends the command and the connection
+            if (bs->state == B_BUSY) {
+                hist_record(&st->command, (now - bs->started) / 1000);
+                st->commands++;
+            }
+            bs->closing = 1;
+            *ended = 1;
+            break;
+        }
+    }
+    return 0;
+}
+
+
+static void print_latency(const char *name, const Histogram *h) {
+    printf("%-9s %8llu %9llu %9llu %9llu %9llu %9llu\n", name,
+           (unsigned long long)h->total,
+           (unsigned long long)hist_percentile(h, 0.50),
+           (unsigned long long)hist_percentile(h, 0.99),
+           (unsigned long long)hist_percentile(h, 0.999),
+           (unsigned long long)h->max,
+           (unsigned long long)(h->total ? h->sum / h->total : 0));
+}
+
+static void json_latency(FILE *out, const char *name, const Histogram *h, int last) {
+    fprintf(out, "  \"%s\": {\"count\": %llu, \"min\": %llu, \"mean\": %llu, "
+                 "\"p50\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu,\n",
+            name, (unsigned long long)h->total, (unsigned long long)h->min,
+            (unsigned long long)(h->total ? h->sum / h->total : 0),
+            (unsigned long long)hist_percentile(h, 0.50),
+            (unsigned long long)hist_percentile(h, 0.99),
+            (unsigned long long)hist_percentile(h, 0.999),
+            (unsigned long long)h->max);
+
+    // Non-empty buckets as [lowest value in us, samples]
+    fprintf(out, "    \"histogram\": [");
+    int first = 1;
+    for (int i = 0; i < HIST_SIZE; i++) {
+        if (!h->counts[i]) continue;
+        fprintf(out, "%s[%llu, %llu]", first ? "" : ", ",
+                (unsigned long long)hist_lower(i), (unsigned long long)h->counts[i]);
+        first = 0;
+    }
+    fprintf(out, "]}%s\n", last ? "" : ",");
+}
+
+// Writes the report as JSON for regression tracking. With a second run
+// over the Unix socket, its numbers are added with a "unix_" prefix.
+static int write_json(const char *path, const BenchConfig *cfg, const BenchStats *st, double elapsed,
+                      const BenchStats *ust, double uelapsed) {
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        perror("fopen json");
+        return -1;
+    }
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"sessions\": %d,\n  \"target_rate\": %.1f,\n  \"duration_s\": %.3f,\n",
+            cfg->sessions, cfg->rate, elapsed);
+    fprintf(out, "  \"transport\": \"%s\",\n", cfg->unix_path && !ust ? "unix" : "tcp");
+    fprintf(out, "  \"commands\": %llu,\n  \"failed\": %llu,\n  \"errors\": %llu,\n  \"rejected\": %llu,\n",
+            (unsigned long long)st->commands, (unsigned long long)st->failed,
+            (unsigned long long)st->errors, (unsigned long long)st->rejected);
+    fprintf(out, "  \"commands_per_s\": %.1f,\n  \"bytes_received\": %llu,\n",
+            elapsed > 0 ? st->commands / elapsed : 0.0, (unsigned long long)st->bytes);
+    json_latency(out, "connect_latency_us", &st->connect, 0);
+    json_latency(out, "command_latency_us", &st->command, !ust);
+    if (ust) {
+        fprintf(out, "  \"unix_commands_per_s\": %.1f,\n",
+                uelapsed > 0 ? ust->commands / uelapsed : 0.0);
+        json_latency(out, "unix_connect_latency_us", &ust->connect, 0);
+        json_latency(out, "unix_command_latency_us", &ust->command, 1);
+    }
+    fprintf(out, "}\n");
+
+    fclose(out);
+    return 0;
+}
+
+// Prints the results of one run
+static void print_report(const BenchConfig *cfg, const BenchStats *st, double elapsed) {
+    const char *transport = cfg->unix_path ? cfg->unix_path : "TCP";
+    if (cfg->rate > 0)
+        printf("Sessions: %d over %s, duration: %.2f s, target rate: %.0f commands/s\n",
+               cfg->sessions, transport, elapsed, cfg->rate);
+    else
+        printf("Sessions: %d over %s, duration: %.2f s, target rate: unlimited\n",
+               cfg->sessions, transport, elapsed);
+    printf("Commands: %llu (%.1f/s), failed: %llu, errors: %llu (rejected %llu), received: %.1f KB\n",
+           (unsigned long long)st->commands, elapsed > 0 ? st->commands / elapsed : 0.0,
+           (unsigned long long)st->failed, (unsigned long long)st->errors,
+           (unsigned long long)st->rejected, st->bytes / 1024.0);
+    printf("\nLatency (us)  count       p50       p99      p999       max      mean\n");
+    print_latency("connect", &st->connect);
+    print_latency("command", &st->command);
+}
+
+// Relative change from a to b in percent
+static double change(uint64_t a, uint64_t b) {
+    return a ? 100.0 * ((double)b - (double)a) / (double)a : 0.0;
+}
+
+// Compares the TCP run with the Unix socket run
+static void print_comparison(const BenchStats *tcp, double telapsed, const BenchStats *un, double uelapsed) {
+    double trate = telapsed > 0 ? tcp->commands / telapsed : 0.0;
+    double urate = uelapsed > 0 ? un->commands / uelapsed : 0.0;
+    uint64_t tmean = tcp->command.total ? tcp->command.sum / tcp->command.total : 0;
+    uint64_t umean = un->command.total ? un->command.sum / un->command.total : 0;
+
+    printf("\nUnix socket vs TCP  %9s %9s %9s\n", "TCP", "Unix", "change");
+    printf("command p50 (us)   %9llu %9llu %+8.1f%%\n",
+           (unsigned long long)hist_percentile(&tcp->command, 0.50),
+           (unsigned long long)hist_percentile(&un->command, 0.50),
+           change(hist_percentile(&tcp->command, 0.50), hist_percentile(&un->command, 0.50)));
+    printf("command p99 (us)   %9llu %9llu %+8.1f%%\n",
+           (unsigned long long)hist_percentile(&tcp->command, 0.99),
+           (unsigned long long)hist_percentile(&un->command, 0.99),
+           change(hist_percentile(&tcp->command, 0.99), hist_percentile(&un->command, 0.99)));
+    printf("command mean (us)  %9llu %9llu %+8.1f%%\n",
+           (unsigned long long)tmean, (unsigned long long)umean, change(tmean, umean));
+    printf("connect p50 (us)   %9llu %9llu %+8.1f%%\n",
+           (unsigned long long)hist_percentile(&tcp->connect, 0.50),
+           (unsigned long long)hist_percentile(&un->connect, 0.50),
+           change(hist_percentile(&tcp->connect, 0.50), hist_percentile(&un->connect, 0.50)));
+    printf("commands/s         %9.0f %9.0f %+8.1f%%\n", trate, urate,
+           trate > 0 ? 100.0 * (urate - trate) / trate : 0.0);
+}
+
+
+// Runs the load once over the transport cfg names and fills st.
+// Returns the run time in seconds, or -1 if it could not run.
+static double bench_run(const BenchConfig *cfg, BenchStats *st) {
+    BenchSession *ss = calloc(cfg->sessions, sizeof(*ss));
+    heap = calloc(cfg->sessions, sizeof(*heap));
+    heap_len = 0;
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (!ss || !heap || epoll_fd < 0) {
+        perror("bench setup");
+        return -1;
+    }
+
+    // Open loop: each session sends one command every `interval`, latency is
+    // measured from when the command was due, so a stalled server can't hide
+    // its queueing delay. Without a rate every session sends back to back.
+    uint64_t interval = cfg->rate > 0 ? (uint64_t)(cfg->sessions * 1e9 / cfg->rate) : 0;
+
+    uint64_t start = now_ns();
+    uint64_t end = start + (uint64_t)cfg->duration * 1000000000ULL;
+    for (int i = 0; i < cfg->sessions; i++) {
+        ss[i].fd = -1;
+        ss[i].next_due = start + (interval ? interval * i / cfg->sessions : 0);
+        bench_connect(epoll_fd, ss, i, cfg, st);
+    }
+
+    if (cfg->verbose) fprintf(stderr, "[DEBUG] Benchmark running with %d sessions\n", cfg->sessions);
+
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        uint64_t now = now_ns();
+        int sending = now < end;
+        if (!sending && (now >= end + DRAIN_TIMEOUT_MS * 1000000ULL ||
+                         bench_busy(ss, cfg->sessions) == 0))
+            break;
+
+        // Send every command that is due, reconnect sessions that are waiting
+        while (sending && heap_len > 0 && ss[heap[0]].next_due <= now) {
+            int idx = heap_pop(ss);
+            BenchSession *bs = &ss[idx];
+
+            if (bs->state == B_RETRY) {
+                bench_connect(epoll_fd, ss, idx, cfg, st);
+                continue;
+            }
+
+            bs->started = interval ? bs->next_due : now;
+            bs->next_due += interval;
+            if (bench_send(bs) < 0) bench_disconnect(ss, idx, 1, st);
+        }
+
+        int timeout = 100;
+        if (sending && heap_len > 0) {
+            uint64_t due = ss[heap[0]].next_due;
+            int ms = due > now ? (int)((due - now + 999999) / 1000000) : 0;
+            if (ms < timeout) timeout = ms;
+        }
+
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            int idx = events[i].data.u32;
+            BenchSession *bs = &ss[idx];
+            if (bs->fd < 0) continue;
+
+            if (bs->state == B_CONNECTING) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(bs->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err || client_send_hello(bs->fd, 0, 0) < 0) {
+                    bench_disconnect(ss, idx, 1, st);
+                    continue;
+                }
+                bs->state = B_HELLO;
+                struct epoll_event ev = { .events = EPOLLIN, .data.u32 = idx };
+                epoll_ctl(epoll_fd, EPOLL_CTL_MOD, bs->fd, &ev);
+                continue;
+            }
+
+            int ended = 0;
+            if (bench_input(bs, st, &ended) < 0) {
+                if (bs->state == B_HELLO && st->connect.total == 0 && st->rejected == 0) {
+                    sending = 0;
+                    end = now; // the server can't be benchmarked
+                }
+                bench_disconnect(ss, idx, 1, st);
+                continue;
+            }
+            if (!ended) continue;
+
+            // The session finished connecting or answering a command
+            if (bs->closing || (cfg->per_connection > 0 && bs->sent >= cfg->per_connection)) {
+                bench_disconnect(ss, idx, 0, st);
+                continue;
+            }
+            // Connecting late skips the missed slots instead of counting
+            // the connect time as command latency
+            if (!interval || (bs->sent == 0 && bs->next_due < now)) bs->next_due = now_ns();
+            heap_push(ss, idx);
+        }
+    }
+
+    double elapsed = (now_ns() - start) / 1e9;
+    if (elapsed > cfg->duration) elapsed = cfg->duration;
+
+    for (int i = 0; i < cfg->sessions; i++)
+        if (ss[i].fd >= 0) close(ss[i].fd);
+    close(epoll_fd);
+    free(ss);
+    free(heap);
+    heap = NULL;
+    return elapsed;
+}
+
+// Runs the load generator. Given both a port and a Unix socket it runs the
+// same load over each, one after the other, and compares the latencies.
+int run_bench(const BenchConfig *cfg) {
+    if (cfg->sessions <= 0 || cfg->duration <= 0) {
+        fprintf(stderr, "The benchmark needs at least one session and one second\n");
+        return 1;
+    }
+    if (load_mix(cfg->mix_file) < 0) return 1;
+
+    int compare = cfg->unix_path && cfg->port > 0;
+    BenchConfig tcp = *cfg;
+    if (compare) tcp.unix_path = NULL;
+
+    BenchStats *st = calloc(1, sizeof(*st));
+    BenchStats *ust = compare ? calloc(1, sizeof(*ust)) : NULL;
+    if (!st || (compare && !ust)) {
+        perror("bench setup");
+        return 1;
+    }
+
+    double elapsed = bench_run(&tcp, st);
+    if (elapsed < 0) return 1;
+    print_report(&tcp, st, elapsed);
+    int result = st->command.total == 0;
+
+    double uelapsed = 0;
+    if (compare) {
+        printf("\n");
+        uelapsed = bench_run(cfg, ust);
+        if (uelapsed < 0) return 1;
+        print_report(cfg, ust, uelapsed);
+        print_comparison(st, elapsed, ust, uelapsed);
+        if (ust->command.total == 0) result = 1;
+    }
+
+    if (cfg->json_file && write_json(cfg->json_file, &tcp, st, elapsed, ust, uelapsed) < 0) result = 1;
+
+    free(st);
+    free(ust);
+    return result;
+}
@@ -0,0 +1,23 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// Benchmark settings collected from the command line
+typedef struct {
+    int port;               // TCP port of the server, -1 = none
+    const char *unix_path;  // Unix socket of the server (-u), NULL = none; with a port both are compared
+    int verbose;            // Verbose (debug) output to stderr
+    int sessions;           // Concurrent sessions (-n)
+    double rate;            // Target commands per second over all sessions (-r), 0 = as fast as possible
+    int duration;           // Seconds to send commands for (-d)
+    int per_connection;     // Commands before a session reconnects (-k), 0 = never
+    const char *mix_file;   // Command mix, one command per line (-f), NULL = built-in mix
+    const char *json_file;  // JSON report (-j), NULL = none
+} BenchConfig;
+
+// Runs the load generator against a server speaking the framed protocol and
+// prints throughput and latency percentiles. With both a port and a Unix
+// socket it runs the load over each and prints the latency difference.
+// Returns 0, or 1 if the benchmark could not run.
+int run_bench(const BenchConfig *cfg);
+
+#endif
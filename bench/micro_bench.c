@@ -0,0 +1,300 @@
+#define _GNU_SOURCE
+
+#include "../shell.h"
+#include "../parser.h"
+#include "../prompt.h"
+#include "../table.h"
+#include "../output.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+// Measures the per-command paths of the server in one process: the
+// dispatch of internal commands, running a builtin, the parsing of command
+// lines, spawning a command and streaming its output to the client, and
+// printing the prompt.
+// Every case is run in several rounds and the median time per operation is
+// reported. With -b the medians are compared against a baseline file and the
+// program fails if any case got slower than the threshold allows; -w writes
+// the current medians as the new baseline.
+//
+// Times depend on the machine, so no baseline is kept in the repository:
+// if the -b file does not exist yet, this run records it and compares
+// nothing. Later runs on the same host are compared against it.
+
+#define ROUNDS 11               // Rounds per case, the median is reported
+#define MAX_CASES 32
+#define DEFAULT_THRESHOLD 25    // Percent slower than the baseline that counts as a regression
+
+typedef struct {
+    const char *name;
+    const char *arg;    // Command line, or the output size for the stream cases
+    int (*run)(const char *arg, int count);
+    int count;          // Operations per round
+    double bytes;       // Output per operation (stream cases), for MB/s
+} BenchCase;
+
+typedef struct {
+    char name[64];
+    double ns;          // Median nanoseconds per operation
+} BenchResult;
+
+static Session session;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// The session writes to one end of a socket pair; a child reads and drops
+// everything that arrives at the other, like a client that keeps up.
+// Returns the pid of the child, or -1.
+static pid_t session_open(void) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("socketpair");
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        static char buf[64 * 1024];
+        while (read(sv[1], buf, sizeof(buf)) > 0)
+            ;
+        _exit(0);
+    }
+
+    close(sv[1]);
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+    session.fd = sv[0];
+    session.index = -1;
+    session.lines = 1;
+    return pid;
+}
+
+// handle_command() on a line, as the session loop calls it (internal
+// commands, builtins, and programs for run_stream())
+static int run_dispatch(const char *cmd, int count) {
+    for (int i = 0; i < count; i++) {
+        handle_command(&session, cmd);
+        if (session.failed) return -1;
+    }
+    return 0;
+}
+
+// ;/# splitting and argv tokenization of a line
+static int run_parse(const char *line, int count) {
+    static char buffer[PARSE_ARENA_SIZE(4096)];
+    for (int i = 0; i < count; i++) {
+        Arena arena;
+        AstSequence seq;
+        arena_init(&arena, buffer, sizeof(buffer));
+        if (parse_command_line(line, &arena, &seq)) {
+            fprintf(stderr, "parse error in: %s\n", line);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// An external command whose output of arg bytes is spawned and streamed
+// through the pipeline path of handle_command()
+static int run_stream(const char *arg, int count) {
+    char cmd[128];
+    if (strcmp(arg, "0") == 0) snprintf(cmd, sizeof(cmd), "/bin/true");
+    else snprintf(cmd, sizeof(cmd), "head -c %s /dev/zero", arg);
+    return run_dispatch(cmd, count);
+}
+
+// print_prompt(), with stdout sent to /dev/null for the run
+static int run_prompt(const char *arg, int count) {
+    (void)arg;
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    if (saved < 0 || devnull < 0) {
+        perror("open");
+        return -1;
+    }
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+
+    for (int i = 0; i < count; i++) print_prompt();
+
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    return 0;
+}
+
+static const BenchCase cases[] = {
+    { "builtin/echo",         "echo hello",                      run_dispatch, 50000, 0 },
+    { "dispatch/help",        "help",                            run_dispatch, 50000, 0 },
+    { "dispatch/stat",        "stat",                            run_dispatch, 50000, 0 },
+    { "dispatch/jobs",        "jobs",                            run_dispatch, 50000, 0 },
+    { "parse/simple",         "ls -la /tmp",                     run_parse, 1000000, 0 },
+    { "parse/sequence",       "cd /tmp; ls -l; echo done # note", run_parse, 1000000, 0 },
+    { "parse/pipeline",       "cat log.txt | grep error | sort | uniq -c > out.txt", run_parse, 1000000, 0 },
+    { "parse/quoted",         "echo \"a b c\" 'd e' f\\ g; printf \"%s\\n\" x", run_parse, 1000000, 0 },
+    { "stream/0",             "0",                               run_stream, 200, 0 },
+    { "stream/64K",           "65536",                           run_stream, 200, 65536 },
+    { "stream/1M",            "1048576",                         run_stream, 100, 1048576 },
+    { "stream/16M",           "16777216",                        run_stream, 20, 16777216 },
+    { "prompt",               NULL,                              run_prompt, 50000, 0 },
+};
+
+#define CASE_COUNT ((int)(sizeof(cases) / sizeof(cases[0])))
+
+// Reads "name nanoseconds" lines, skipping # comments.
+// Returns the number of entries, or -1 if the file cannot be read.
+static int baseline_read(const char *path, BenchResult *out, int max) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror("fopen baseline");
+        return -1;
+    }
+
+    char line[256];
+    int n = 0;
+    while (n < max && fgets(line, sizeof(line), f)) {
+        if (line[0] == '#' || line[0] == '\n') continue;
+        if (sscanf(line, "%63s %lf", out[n].name, &out[n].ns) == 2) n++;
+    }
+    fclose(f);
+    return n;
+}
+
+static int baseline_write(const char *path, const BenchResult *results, int n) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror("fopen baseline");
+        return -1;
+    }
+    fprintf(f, "# Median nanoseconds per operation on the machine that wrote it (`make bench-baseline`)\n");
+    for (int i = 0; i < n; i++) fprintf(f, "%s %.0f\n", results[i].name, results[i].ns);
+    fclose(f);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *baseline = NULL;    // -b: compare against
+    const char *output = NULL;      // -w: write the new baseline
+    double threshold = DEFAULT_THRESHOLD;
+    const char *only = NULL;        // -f: run the cases whose name starts with this
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) baseline = argv[++i];
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) output = argv[++i];
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) threshold = atof(argv[++i]);
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) only = argv[++i];
+        else {
+            fprintf(stderr, "Use: %s [-b BASELINE] [-w BASELINE] [-t PERCENT] [-f PREFIX]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (baseline && access(baseline, F_OK) < 0 && errno == ENOENT) {
+        printf("No baseline in %s yet, this run records it\n", baseline);
+        output = baseline;
+        baseline = NULL;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    if (client_table_init() < 0) {
+        perror("client_table_init");
+        return 1;
+    }
+    output_configure(OUTPUT_STALL, OUTPUT_BUFFER_SIZE, OUTPUT_SLOW_SECONDS);
+    command_signals_setup();
+    pid_t drain = session_open();
+    if (drain < 0) return 1;
+
+    BenchResult results[MAX_CASES];
+    int n = 0;
+    printf("%-20s %14s %14s\n", "case", "ns/op", "");
+    for (int c = 0; c < CASE_COUNT; c++) {
+        const BenchCase *bc = &cases[c];
+        if (only && strncmp(bc->name, only, strlen(only)) != 0) continue;
+
+        // One unmeasured round warms up caches and the page cache
+        if (bc->run(bc->arg, bc->count / 10 + 1) < 0) {
+            fprintf(stderr, "%s failed\n", bc->name);
+            return 1;
+        }
+
+        double rounds[ROUNDS];
+        for (int r = 0; r < ROUNDS; r++) {
+            double start = now_seconds();
+            if (bc->run(bc->arg, bc->count) < 0) {
+                fprintf(stderr, "%s failed\n", bc->name);
+                return 1;
+            }
+            rounds[r] = (now_seconds() - start) * 1e9 / bc->count;
+        }
+        qsort(rounds, ROUNDS, sizeof(rounds[0]), compare_doubles);
+
+        snprintf(results[n].name, sizeof(results[n].name), "%s", bc->name);
+        results[n].ns = rounds[ROUNDS / 2];
+        if (bc->bytes > 0)
+            printf("%-20s %14.0f %10.1f MB/s\n", bc->name, results[n].ns,
+                   bc->bytes / results[n].ns * 1e9 / (1024 * 1024));
+        else
+            printf("%-20s %14.0f %10.0f op/s\n", bc->name, results[n].ns, 1e9 / results[n].ns);
+        n++;
+    }
+
+    close(session.fd);
+    waitpid(drain, NULL, 0);
+    session_output_free(&session);
+
+    if (output) {
+        if (baseline_write(output, results, n) < 0) return 1;
+        printf("Baseline written to %s\n", output);
+    }
+    if (!baseline) return 0;
+
+    BenchResult base[MAX_CASES];
+    int base_count = baseline_read(baseline, base, MAX_CASES);
+    if (base_count < 0) return 1;
+
+    int regressions = 0;
+    printf("\nAgainst %s (threshold %.0f%%):\n", baseline, threshold);
+    for (int i = 0; i < n; i++) {
+        int b = 0;
+        while (b < base_count && strcmp(base[b].name, results[i].name) != 0) b++;
+        if (b == base_count) {
+            printf("  %-20s not in baseline\n", results[i].name);
+            continue;
+        }
+
+        double change = (results[i].ns / base[b].ns - 1) * 100;
+        int slower = change > threshold;
+        printf("  %-20s %14.0f -> %-10.0f %+7.1f%%%s\n", results[i].name, base[b].ns,
+               results[i].ns, change, slower ? "  REGRESSION" : "");
+        regressions += slower;
+    }
+
+    if (regressions) {
+        printf("%d case(s) slower than the baseline allows\n", regressions);
+        return 1;
+    }
+    return 0;
+}
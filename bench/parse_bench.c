@@ -0,0 +1,97 @@
+#define _GNU_SOURCE
+
+#include "../parser.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Measures how many command lines per second the parser handles, next to
+// the strdup()/strtok() splitting the dispatcher used before it.
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Command lines of different shapes
+static const char *lines[] = {
+    "ls",
+    "ls -la /tmp",
+    "cat /var/log/syslog | grep error | sort | uniq -c | sort -rn | head -20",
+    "sort < input.txt > output.txt; wc -l output.txt; echo done # finished",
+    "echo 'quoted  text' \"with \\\"escapes\\\"\" and\\ more; grep -v '#' file | tr a-z A-Z >> log.txt",
+};
+
+// The old path: copy, strip the comment, strtok on ';', copy again and
+// split on spaces (without pipes, quotes or escapes)
+static int legacy_split(const char *cmd) {
+    char cmd_copy[1024];
+    strncpy(cmd_copy, cmd, sizeof(cmd_copy));
+    cmd_copy[sizeof(cmd_copy) - 1] = '\0';
+    strtok(cmd_copy, " ");
+
+    char *cleaned = strdup(cmd);
+    char *comment = strchr(cleaned, '#');
+    if (comment) *comment = '\0';
+
+    int words = 0;
+    char *token = strtok(cleaned, ";");
+    while (token != NULL) {
+        char *copy = strdup(token);
+        char *args[64];
+        char *save;
+        char *arg = strtok_r(copy, " ", &save);
+        int i = 0;
+        while (arg && i < 63) {
+            args[i++] = arg;
+            arg = strtok_r(NULL, " ", &save);
+        }
+        args[i] = NULL;
+        words += args[0] ? i : 0;
+        free(copy);
+        token = strtok(NULL, ";");
+    }
+    free(cleaned);
+    return words;
+}
+
+int main(int argc, char *argv[]) {
+    int count = 1000000; // Lines parsed per shape
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) count = atoi(argv[++i]);
+        else {
+            fprintf(stderr, "Use: %s [-n COUNT]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    static char buffer[PARSE_ARENA_SIZE(4096)];
+    volatile int sink = 0; // keeps the work from being optimized away
+
+    printf("%d lines per shape\n", count);
+    for (size_t l = 0; l < sizeof(lines) / sizeof(lines[0]); l++) {
+        double start = now_seconds();
+        for (int i = 0; i < count; i++) {
+            Arena arena;
+            AstSequence seq;
+            arena_init(&arena, buffer, sizeof(buffer));
+            if (parse_command_line(lines[l], &arena, &seq)) {
+                fprintf(stderr, "parse error in: %s\n", lines[l]);
+                return 1;
+            }
+            sink += seq.count;
+        }
+        double parsed = count / (now_seconds() - start);
+
+        start = now_seconds();
+        for (int i = 0; i < count; i++) sink += legacy_split(lines[l]);
+        double split = count / (now_seconds() - start);
+
+        printf("  %-40.40s parser %10.0f lines/s  strtok %10.0f lines/s  (x%.2f)\n",
+               lines[l], parsed, split, parsed / split);
+    }
+    return 0;
+}
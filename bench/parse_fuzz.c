@@ -0,0 +1,176 @@
+#define _GNU_SOURCE
+
+#include "../parser.h"
+#include "../protocol.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+// Fuzzes parse_command_line(). Every line is parsed twice: into an arena of
+// PARSE_ARENA_SIZE(len) bytes, which must never run out, and into an
+// undersized one, which may only fail with "command line too long" or give
+// the same answer. Both arenas are allocated at their exact size, so building
+// with -fsanitize=address catches any write past them. A parsed tree is
+// walked and checked: counts match the lists, every argv is NULL-terminated
+// and every string lies inside the arena.
+//
+// Built plainly it generates random lines itself (make fuzz); with
+// -DPARSE_FUZZ_LIBFUZZER it is a libFuzzer target instead (make
+// parse_fuzz_libfuzzer, needs clang). Either way a broken check aborts.
+
+#define ERR_TOO_LONG "Error: command line too long\n"
+
+// Pieces random lines are made of: the characters the grammar cares about
+// and a few whole tokens, so that deeper structures come up often
+static const char *const pieces[] = {
+    " ", " ", " ", "\t", ";", "&", "&&", "|", "<", ">", ">>", "#", "'", "\"", "\\",
+    "$", "`", "a", "b", "ls", "-la", "echo", "cat", "/tmp/x", "'a b'", "\"c \\\" d\"",
+    "\\ ", "x\\", ";;", "| grep", "> out", "< in", "# note", "sleep 1 &",
+};
+
+#define PIECE_COUNT (sizeof(pieces) / sizeof(pieces[0]))
+
+static void fail(const char *line, size_t arena_size, const char *what) {
+    fprintf(stderr, "parse_fuzz: %s\n  arena: %zu bytes\n  line: \"", what, arena_size);
+    for (const unsigned char *c = (const unsigned char *)line; *c; c++) {
+        if (*c == '"' || *c == '\\') fprintf(stderr, "\\%c", *c);
+        else if (*c < 0x20 || *c >= 0x7f) fprintf(stderr, "\\x%02x", *c);
+        else fputc(*c, stderr);
+    }
+    fprintf(stderr, "\"\n");
+    abort();
+}
+
+// Returns 1 if s is a string that starts and ends inside the used arena
+static int in_arena(const Arena *a, const char *s) {
+    if (s < a->base || s >= a->base + a->used) return 0;
+    return memchr(s, '\0', a->base + a->used - s) != NULL;
+}
+
+// Walks a parsed tree and aborts on the first broken invariant
+static void check_tree(const char *line, const Arena *a, const AstSequence *seq) {
+    int pipelines = 0;
+    for (const AstPipeline *pl = seq->pipelines; pl; pl = pl->next, pipelines++) {
+        if (pl->count < 1) fail(line, a->size, "pipeline without commands");
+        if (pl->input && !in_arena(a, pl->input)) fail(line, a->size, "input file outside the arena");
+        if (pl->output && !in_arena(a, pl->output)) fail(line, a->size, "output file outside the arena");
+        if (pl->append && !pl->output) fail(line, a->size, "'>>' without an output file");
+
+        int commands = 0;
+        for (const AstCommand *cmd = pl->commands; cmd; cmd = cmd->next, commands++) {
+            if (cmd->argc < 1) fail(line, a->size, "command without arguments");
+            if (cmd->argv[cmd->argc]) fail(line, a->size, "argv not NULL-terminated");
+            for (int i = 0; i < cmd->argc; i++)
+                if (!cmd->argv[i] || !in_arena(a, cmd->argv[i]))
+                    fail(line, a->size, "argument outside the arena");
+        }
+        if (commands != pl->count) fail(line, a->size, "pipeline count does not match its commands");
+    }
+    if (pipelines != seq->count) fail(line, a->size, "sequence count does not match its pipelines");
+}
+
+// Parses line into an arena of exactly size bytes, checks the tree
+// Returns the parser's answer.
+static const char *parse_checked(const char *line, size_t size) {
+    char *buf = malloc(size ? size : 1);
+    if (!buf) {
+        perror("malloc");
+        exit(1);
+    }
+
+    Arena arena;
+    AstSequence seq;
+    arena_init(&arena, buf, size);
+    const char *err = parse_command_line(line, &arena, &seq);
+    if (arena.used > size) fail(line, size, "arena used beyond its size");
+    if (err && (strncmp(err, "Error: ", 7) != 0 || err[strlen(err) - 1] != '\n'))
+        fail(line, size, "error message not in the client format");
+    if (!err) check_tree(line, &arena, &seq);
+
+    free(buf);
+    return err;
+}
+
+// Both parses of one line; fraction (0 to 255) picks the undersized arena
+static void check_line(const char *line, unsigned fraction) {
+    size_t full = PARSE_ARENA_SIZE(strlen(line));
+    const char *err = parse_checked(line, full);
+    if (err && strcmp(err, ERR_TOO_LONG) == 0) fail(line, full, "PARSE_ARENA_SIZE() was not enough");
+
+    const char *small = parse_checked(line, full * fraction / 256);
+    if (small != err && (!small || !err || strcmp(small, err) != 0) &&
+        !(small && strcmp(small, ERR_TOO_LONG) == 0))
+        fail(line, full * fraction / 256, "undersized arena changed the answer");
+}
+
+#ifdef PARSE_FUZZ_LIBFUZZER
+
+// The first byte picks the undersized arena, the rest is the line
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    static char line[PROTO_MAX_COMMAND + 1];
+    if (size < 1) return 0;
+
+    size_t len = size - 1 < PROTO_MAX_COMMAND ? size - 1 : PROTO_MAX_COMMAND;
+    memcpy(line, data + 1, len);
+    line[len] = '\0';
+    check_line(line, data[0]);
+    return 0;
+}
+
+#else
+
+// Fills line with up to max bytes: pieces, now and then a random byte
+static void random_line(char *line, size_t max) {
+    size_t target = random() % 4 == 0 ? random() % (max + 1) : random() % 64;
+    size_t len = 0;
+
+    while (len < target) {
+        if (random() % 16 == 0) {
+            line[len++] = 1 + random() % 255;
+            continue;
+        }
+        const char *piece = pieces[random() % PIECE_COUNT];
+        size_t n = strlen(piece);
+        if (len + n > target) break;
+        memcpy(line + len, piece, n);
+        len += n;
+    }
+    line[len] = '\0';
+}
+
+int main(int argc, char *argv[]) {
+    long count = 200000;                // Lines checked
+    unsigned seed = 1;
+    size_t max = PROTO_MAX_COMMAND;     // Longest line generated
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) count = atol(argv[++i]);
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) seed = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) max = strtoul(argv[++i], NULL, 10);
+        else {
+            fprintf(stderr, "Use: %s [-n COUNT] [-s SEED] [-l MAX_LENGTH]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (max > PROTO_MAX_COMMAND) max = PROTO_MAX_COMMAND;
+
+    static char line[PROTO_MAX_COMMAND + 1];
+    long parsed = 0;
+    srandom(seed);
+    for (long i = 0; i < count; i++) {
+        random_line(line, max);
+        check_line(line, random() % 256);
+        // Count the lines the parser accepted, to show the checks got deep
+        Arena arena;
+        AstSequence seq;
+        static char buf[PARSE_ARENA_SIZE(PROTO_MAX_COMMAND)];
+        arena_init(&arena, buf, sizeof(buf));
+        parsed += parse_command_line(line, &arena, &seq) == NULL;
+    }
+
+    printf("%ld lines checked (seed %u), %ld parsed, the rest rejected\n", count, seed, parsed);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,124 @@
+#define _GNU_SOURCE
+
+#include "../spawn.h"
+#include "../zygote.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+
+// Measures how many commands per second each launcher can start and how
+// long one launch takes. The process's RSS can be inflated with -m, or with
+// the state of -s sessions, to show how fork() degrades while the zygote,
+// forked before that state exists, does not.
+
+#define SESSION_STATE (80 * 1024)  // Input buffer plus a partly filled output queue
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Spawns `true` count times with stdout/stderr going to /dev/null.
+// Returns spawns per second; the latencies (spawn until exit, in
+// microseconds) are stored in lat sorted.
+static double run(SpawnMethod method, int count, int devnull, double *lat) {
+    char *argv[] = { "true", NULL };
+    SpawnFileActions fa;
+    spawn_actions_init(&fa);
+    spawn_add_dup2(&fa, devnull, STDOUT_FILENO);
+    spawn_add_dup2(&fa, devnull, STDERR_FILENO);
+
+    spawn_method = method;
+    double start = now_seconds();
+    for (int i = 0; i < count; i++) {
+        double t = now_seconds();
+        pid_t pid = spawn_command(argv, &fa);
+        if (pid < 0) {
+            perror("spawn_command");
+            exit(1);
+        }
+        int status;
+        spawn_wait(pid, &status);
+        lat[i] = (now_seconds() - t) * 1e6;
+    }
+    double rate = count / (now_seconds() - start);
+    qsort(lat, count, sizeof(double), compare_doubles);
+    return rate;
+}
+
+// Allocates and touches size bytes that stay for the rest of the run
+static int ballast(size_t size) {
+    char *p = malloc(size);
+    if (!p) {
+        perror("malloc");
+        return -1;
+    }
+    memset(p, 1, size); // touch every page
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int count = 2000;   // Spawns per launcher
+    int rss_mb = 0;     // Extra resident memory to simulate a busy session
+    int sessions = 1;   // Sessions whose state the process holds (like the reactor)
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) count = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) rss_mb = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) sessions = atoi(argv[++i]);
+        else {
+            fprintf(stderr, "Use: %s [-n COUNT] [-m RSS_MB] [-s SESSIONS]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (count < 1) count = 1;
+
+    // Started first, like the server does with -Z
+    if (zygote_start() < 0) {
+        perror("zygote");
+        return 1;
+    }
+
+    // Every session's buffers are allocated on their own, as the server does
+    for (int i = 0; i < sessions; i++)
+        if (ballast(SESSION_STATE) < 0) return 1;
+    if (rss_mb > 0 && ballast((size_t)rss_mb << 20) < 0) return 1;
+
+    int devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    double *lat = malloc(count * sizeof(double));
+    if (!lat) {
+        perror("malloc");
+        return 1;
+    }
+
+    const struct { SpawnMethod method; const char *name; } launchers[] = {
+        { SPAWN_FORK,   "fork+execvp" },
+        { SPAWN_VFORK,  "clone(CLONE_VM)" },
+        { SPAWN_POSIX,  "posix_spawnp" },
+        { SPAWN_ZYGOTE, "zygote" },
+    };
+
+    printf("%d spawns per launcher, %d sessions (%.1f MB of session state), %d MB extra RSS\n",
+           count, sessions, sessions * (double)SESSION_STATE / (1 << 20), rss_mb);
+    double base = 0;
+    for (int i = 0; i < 4; i++) {
+        double rate = run(launchers[i].method, count, devnull, lat);
+        if (i == 0) base = rate;
+        printf("  %-16s %10.0f spawns/s  p50 %7.1f us  p99 %7.1f us  (x%.2f)\n", launchers[i].name,
+               rate, lat[count / 2], lat[count * 99 / 100], rate / base);
+    }
+
+    free(lat);
+    close(devnull);
+    return 0;
+}
@@ -0,0 +1,186 @@
+#define _GNU_SOURCE
+
+#include "cache.h"
+#include "table.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CACHE_MAX_NAMES 32  // Programs on the allowlist
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+// One cached output in shared memory
+typedef struct {
+    uint32_t seq;           // Odd while a writer changes the entry
+    pid_t writer;           // Process holding it odd, to recover from its death
+    uint64_t hash;
+    uint64_t fingerprint;
+    uint64_t stored_ms;     // When the output was stored, 0 = empty
+    size_t key_len;
+    size_t len;
+    char key[CACHE_MAX_KEY];
+    char data[CACHE_MAX_OUTPUT];
+} CacheEntry;
+
+static CacheEntry *entries;
+static uint64_t ttl_ms;
+
+// Allowlist, copied into every process by fork()
+static char *allowed[CACHE_MAX_NAMES];
+static int allowed_count;
+
+
+int cache_init(const char *names, int ttl_seconds) {
+    entries = mmap(NULL, CACHE_ENTRIES * sizeof(CacheEntry), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (entries == MAP_FAILED) {
+        entries = NULL;
+        return -1;
+    }
+    ttl_ms = (uint64_t)(ttl_seconds > 0 ? ttl_seconds : CACHE_DEFAULT_TTL) * 1000;
+
+    char *list = strdup(names);
+    char *save;
+    for (char *name = strtok_r(list, ",", &save); name && allowed_count < CACHE_MAX_NAMES;
+         name = strtok_r(NULL, ",", &save))
+        allowed[allowed_count++] = name;
+    return 0;
+}
+
+int cache_enabled(void) {
+    return entries != NULL;
+}
+
+// FNV-1a, continued from h
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+// Adds the identity and state of one file to h; a missing file counts as zeros
+static uint64_t hash_file(uint64_t h, int dir, const char *path) {
+    struct stat st;
+    uint64_t v[5] = { 0 };
+    if (fstatat(dir, path, &st, 0) == 0) {
+        v[0] = st.st_dev;
+        v[1] = st.st_ino;
+        v[2] = st.st_size;
+        v[3] = st.st_mtim.tv_sec;
+        v[4] = st.st_mtim.tv_nsec;
+    }
+    return hash_bytes(h, v, sizeof(v));
+}
+
+// Sums up the files named by the arguments; it changes when one of them is
+// modified, replaced, created or removed. Relative names are looked up in dir.
+// A command that names no file (`ls`, `ls -a`) works on dir itself, so then
+// dir is what is summed up.
+static uint64_t files_fingerprint(int dir, char *const argv[]) {
+    uint64_t h = FNV_OFFSET;
+    int files = 0;
+    for (int i = 1; argv[i]; i++) {
+        if (argv[i][0] == '-') continue; // an option, the key has it
+        h = hash_file(h, dir, argv[i]);
+        files++;
+    }
+    if (!files) h = hash_file(h, dir, ".");
+    return h;
+}
+
+int cache_key(const char *cwd, char *const argv[], CacheKey *key) {
+    if (!entries) return 0;
+
+    int found = 0;
+    for (int i = 0; i < allowed_count && !found; i++)
+        found = strcmp(argv[0], allowed[i]) == 0;
+    if (!found) return 0;
+
+    // Relative paths depend on the working directory
+    if (cwd) snprintf(key->key, sizeof(key->key), "%s", cwd);
+    else if (!getcwd(key->key, sizeof(key->key))) return 0;
+    size_t len = strlen(key->key) + 1;
+    for (int i = 0; argv[i]; i++) {
+        size_t n = strlen(argv[i]) + 1;
+        if (len + n > sizeof(key->key)) return 0;
+        memcpy(key->key + len, argv[i], n);
+        len += n;
+    }
+
+    key->len = len;
+    key->hash = hash_bytes(FNV_OFFSET, key->key, len);
+    int dir = AT_FDCWD;
+    if (cwd && (dir = open(cwd, O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0) return 0;
+    key->fingerprint = files_fingerprint(dir, argv);
+    if (dir != AT_FDCWD) close(dir);
+    return 1;
+}
+
+int cache_lookup(const CacheKey *key, char *buf, size_t *len) {
+    CacheEntry *e = &entries[key->hash % CACHE_ENTRIES];
+
+    uint32_t seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) return 0;
+
+    uint64_t stored = __atomic_load_n(&e->stored_ms, __ATOMIC_RELAXED);
+    size_t n = __atomic_load_n(&e->len, __ATOMIC_RELAXED);
+    if (stored == 0 || stats_now_ms() - stored >= ttl_ms || n > CACHE_MAX_OUTPUT ||
+        __atomic_load_n(&e->hash, __ATOMIC_RELAXED) != key->hash ||
+        __atomic_load_n(&e->fingerprint, __ATOMIC_RELAXED) != key->fingerprint ||
+        __atomic_load_n(&e->key_len, __ATOMIC_RELAXED) != key->len ||
+        memcmp(e->key, key->key, key->len) != 0)
+        return 0;
+
+    memcpy(buf, e->data, n);
+
+    // Nothing we copied may have come from a writer
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq) return 0;
+
+    *len = n;
+    return 1;
+}
+
+void cache_store(const CacheKey *key, const char *data, size_t len) {
+    if (len > CACHE_MAX_OUTPUT) return;
+    CacheEntry *e = &entries[key->hash % CACHE_ENTRIES];
+
+    uint32_t seq = __atomic_load_n(&e->seq, __ATOMIC_RELAXED);
+    if (seq & 1) {
+        // Someone is storing; take over only from a writer that was killed
+        pid_t owner = __atomic_load_n(&e->writer, __ATOMIC_RELAXED);
+        if (owner <= 0 || kill(owner, 0) == 0 || errno != ESRCH) return;
+    }
+    uint32_t locked = (seq & 1) ? seq + 2 : seq + 1;
+    if (!__atomic_compare_exchange_n(&e->seq, &seq, locked, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return; // another writer won; its output is just as good
+    __atomic_store_n(&e->writer, getpid(), __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    e->hash = key->hash;
+    e->fingerprint = key->fingerprint;
+    e->key_len = key->len;
+    memcpy(e->key, key->key, key->len);
+    e->len = len;
+    memcpy(e->data, data, len);
+    e->stored_ms = stats_now_ms();
+
+    __atomic_store_n(&e->seq, locked + 1, __ATOMIC_RELEASE);
+}
+
+int cache_used(void) {
+    int used = 0;
+    for (int i = 0; entries && i < CACHE_ENTRIES; i++)
+        if (__atomic_load_n(&entries[i].stored_ms, __ATOMIC_RELAXED) != 0) used++;
+    return used;
+}
@@ -0,0 +1,63 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h> // For size_t
+#include <stdint.h>
+
+// Output cache for read-only commands
+//
+// Opt-in (-C): only programs on the allowlist are cached, and only when the
+// line is that one command with no redirection. The output lives in shared
+// memory mapped before the server forks, so every session process, reactor
+// runner and worker sees the same entries.
+//
+// An entry is keyed by the working directory and the parsed argv. It is used
+// only while it is younger than the TTL and every argument that names a file
+// still has the same inode, size and mtime; a command that names no file is
+// checked against the working directory the same way. Files the program
+// reads without naming them (a directory's subdirectories, /etc files) are
+// not checked, so the TTL bounds how stale their output can get. Only
+// outputs of commands that exited with 0 and fit in CACHE_MAX_OUTPUT are
+// stored.
+//
+// Entries are direct-mapped by hash and guarded by a sequence counter like
+// the client table. A reader that overlaps a writer just counts a miss.
+
+#define CACHE_ENTRIES 256               // Outputs kept at once
+#define CACHE_MAX_OUTPUT (64 * 1024)    // Larger outputs are not cached
+#define CACHE_MAX_KEY 1024              // Longer keys (cwd + argv) are not cached
+#define CACHE_DEFAULT_TTL 5             // Seconds an entry stays valid unless -a is given
+
+// Maps the cache. names is a comma-separated list of programs, e.g.
+// "cat,ls,df". Must be called before any process is forked.
+// Returns 0, or -1 if the memory cannot be mapped.
+int cache_init(const char *names, int ttl_seconds);
+
+// Returns 1 if the server was started with a cache
+int cache_enabled(void);
+
+// Identifies one cacheable command: where it runs, its arguments and the
+// state of the files they name, taken before the command starts
+typedef struct {
+    uint64_t hash;
+    uint64_t fingerprint;
+    size_t len;
+    char key[CACHE_MAX_KEY];
+} CacheKey;
+
+// Fills key for argv run in cwd (NULL = our working directory). Returns 0
+// if the command is not cached (cache off, program not on the allowlist,
+// key too long).
+int cache_key(const char *cwd, char *const argv[], CacheKey *key);
+
+// Looks the key up. On a hit the output is copied to buf (CACHE_MAX_OUTPUT
+// bytes), its length stored in *len and 1 returned; 0 means a miss.
+int cache_lookup(const CacheKey *key, char *buf, size_t *len);
+
+// Stores an output, replacing whatever shared its entry
+void cache_store(const CacheKey *key, const char *data, size_t len);
+
+// Number of entries holding an output
+int cache_used(void);
+
+#endif
@@ -0,0 +1,322 @@
+#include "channel.h"
+#include "shell.h"
+#include "jobs.h"
+#include "relay.h"
+#include "output.h"
+#include "protocol.h"
+#include "table.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+// One open channel, as seen by the owner of the session
+typedef struct {
+    int id;             // Channel number, 0 = free slot
+    Relay relay;        // Channel process and its socket pair
+    long long window;   // DATA payload the client still takes
+    int closing;        // Its CHANNEL_CLOSE was sent already
+    const char *reason; // Why it closes, reported once it did
+    char *out;          // Commands the channel didn't take yet
+    size_t out_pos, out_len, out_cap;
+} Channel;
+
+typedef struct ChannelTable {
+    Channel channels[PROTO_MAX_CHANNELS];   // channels[c - 1] is channel c
+    int open;
+} ChannelTable;
+
+static int command_timeout = 0;    // Set by channels_configure()
+
+
+void channels_configure(int timeout) {
+    command_timeout = timeout;
+}
+
+// Grows a buffer so that need more bytes fit behind len
+static int buffer_reserve(char **buf, size_t *cap, size_t len, size_t need) {
+    if (len + need <= *cap) return 0;
+    size_t n = *cap ? *cap : 4096;
+    while (n < len + need) n *= 2;
+    char *grown = realloc(*buf, n);
+    if (!grown) return -1;
+    *buf = grown;
+    *cap = n;
+    return 0;
+}
+
+// Frees one slot once its relay is reaped, stopped or forgotten
+static void channel_release(Channel *c) {
+    free(c->out);
+    memset(c, 0, sizeof(*c));
+    c->relay.fd = -1;
+}
+
+
+// Channel process: reads COMMAND frames from the socket pair and answers
+// them on its copy of the session, like a session process does with a
+// client. Commands and output are counted in the session's slot here.
+static void channel_main(Session *cs, void *arg) {
+    int id = (int)(intptr_t)arg;
+    int fd = cs->fd;
+    char buffer[PROTO_READ_SIZE];
+    char command[PROTO_MAX_COMMAND];
+    int done = 0;
+
+    while (!done) {
+        struct pollfd pfd[1 + MAX_JOBS];
+        int job_fds[MAX_JOBS];
+        int jobs = jobs_fds(cs, job_fds);
+        pfd[0] = (struct pollfd){ fd, POLLIN, 0 };
+        for (int i = 0; i < jobs; i++) pfd[1 + i] = (struct pollfd){ job_fds[i], POLLIN, 0 };
+
+        if (poll(pfd, 1 + jobs, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (jobs) jobs_input(cs);
+        if (!pfd[0].revents) continue;
+
+        ssize_t bytes = read(fd, buffer, sizeof(buffer));
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes <= 0 || session_feed(cs, buffer, bytes) < 0) break;
+
+        int r;
+        while ((r = session_next_command(cs, command, sizeof(command))) == 1) {
+            if (cs->verbose) fprintf(stderr, "[DEBUG] Command on channel %d: %s\n", id, command);
+            log_write(LOG_LEVEL_INFO, "Command on channel %d: %s\n", id, command);
+
+            if (command_timeout > 0) alarm(command_timeout);
+            int result = handle_command(cs, command);
+            alarm(0);
+            // quit closes the channel; halt has signalled the whole server
+            if (result != 0 || cs->failed) {
+                done = 1;
+                break;
+            }
+        }
+        if (r < 0) break;
+    }
+
+    jobs_free(cs);
+}
+
+// Returns channel id, forking its process if it isn't open
+static Channel *channel_open(Session *s, int id) {
+    if (!s->chans && !(s->chans = calloc(1, sizeof(ChannelTable)))) return NULL;
+    ChannelTable *t = s->chans;
+    Channel *c = &t->channels[id - 1];
+    if (c->id) return c;
+
+    memset(c, 0, sizeof(*c));
+    if (relay_start(s, &c->relay, channel_main, (void *)(intptr_t)id) < 0) {
+        c->relay.fd = -1;
+        return NULL;
+    }
+    c->id = id;
+    c->window = PROTO_CHANNEL_WINDOW;
+    t->open++;
+    stats_channels(s->index, 1);
+
+    if (s->verbose) fprintf(stderr, "[DEBUG] Channel %d opened, pid %d\n", id, c->relay.pid);
+    return c;
+}
+
+// Hands queued commands to the channel as far as its socket takes them
+static void channel_push(Channel *c) {
+    while (c->out_pos < c->out_len) {
+        ssize_t n = send(c->relay.fd, c->out + c->out_pos, c->out_len - c->out_pos, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return; // retried with its next output
+        if (n < 0) {
+            c->out_pos = c->out_len; // the channel is gone, its EOF follows
+            break;
+        }
+        c->out_pos += n;
+    }
+    c->out_pos = c->out_len = 0;
+}
+
+void channel_command(Session *s, int id, uint32_t request_id, const char *cmd) {
+    Channel *c = channel_open(s, id);
+    size_t len = strlen(cmd);
+
+    if (!c || buffer_reserve(&c->out, &c->out_cap, c->out_len, FRAME_HEADER_SIZE + len) < 0) {
+        // Answered on channel 0's socket, under the command's own request id
+        uint32_t current = s->request_id;
+        s->request_id = request_id;
+        session_printf(s, "Error: cannot open channel %d: %s\n", id, strerror(errno));
+        session_end(s, 1);
+        s->request_id = current;
+        return;
+    }
+
+    FrameHeader h;
+    frame_pack(&h, FRAME_COMMAND, request_id, len, 0);
+    memcpy(c->out + c->out_len, &h, FRAME_HEADER_SIZE);
+    memcpy(c->out + c->out_len + FRAME_HEADER_SIZE, cmd, len);
+    c->out_len += FRAME_HEADER_SIZE + len;
+    channel_push(c);
+}
+
+int channels_fds(const Session *s, int *fds) {
+    int n = 0;
+    if (!s->chans) return 0;
+    for (int i = 0; i < PROTO_MAX_CHANNELS; i++) {
+        const Channel *c = &s->chans->channels[i];
+        if (c->id && c->window > 0) fds[n++] = c->relay.fd;
+    }
+    return n;
+}
+
+
+// Passes the whole frames received from a channel on while its window lasts.
+// Its `quit` notice becomes a CHANNEL_CLOSE, so the client keeps the session.
+static void channel_forward(Session *s, Channel *c) {
+    Relay *r = &c->relay;
+    size_t off = 0;
+    FrameHeader h;
+    char *payload;
+
+    while (c->window > 0 && (payload = relay_frame(r, &off, &h))) {
+        FrameHeader *raw = (FrameHeader *)(payload - FRAME_HEADER_SIZE);
+        if (h.type == FRAME_DATA && h.length > c->window) {
+            // Only the start of a big chunk fits; the rest stays as a frame of its own
+            uint32_t take = (uint32_t)c->window;
+            FrameHeader part = *raw;
+            part.length = htonl(take);
+            session_write_frames(s, &part, FRAME_HEADER_SIZE);
+            session_write_frames(s, payload, take);
+
+            raw->length = htonl(h.length - take);
+            memmove(payload, payload + take, r->in_len - (off + FRAME_HEADER_SIZE + take));
+            r->in_len -= take;
+            c->window = 0;
+            break;
+        }
+        if (h.type == FRAME_DATA) {
+            c->window -= h.length;
+        } else if (h.type == FRAME_CLOSE) {
+            raw->type = FRAME_CHANNEL_CLOSE;
+            raw->status = htonl(c->id);
+            c->closing = 1;
+        }
+        session_write_frames(s, raw, FRAME_HEADER_SIZE + h.length);
+        off += FRAME_HEADER_SIZE + h.length;
+    }
+    relay_consume(r, off);
+}
+
+void channel_window(Session *s, int id, uint32_t increment) {
+    if (!s->chans || id < 1 || id > PROTO_MAX_CHANNELS) return;
+    Channel *c = &s->chans->channels[id - 1];
+    if (!c->id) return;
+
+    int stopped = c->window <= 0;
+    c->window += increment;
+    if (!stopped || c->window <= 0) return;
+
+    // What arrived before the window closed goes first; the socket may stay quiet
+    channel_forward(s, c);
+    if (c->window > 0) relay_watch(s, &c->relay);
+}
+
+// Reports a closed channel, reaps its process and frees its slot
+static void channel_closed(Session *s, ChannelTable *t, Channel *c) {
+    if (!c->closing) {
+        const char *reason = c->reason ? c->reason : "Channel closed\n";
+        FrameHeader h;
+        frame_pack(&h, FRAME_CHANNEL_CLOSE, 0, strlen(reason), c->id);
+
+        char frame[FRAME_HEADER_SIZE + 64];
+        memcpy(frame, &h, FRAME_HEADER_SIZE);
+        memcpy(frame + FRAME_HEADER_SIZE, reason, strlen(reason));
+        session_write_frames(s, frame, FRAME_HEADER_SIZE + strlen(reason));
+    }
+    if (s->verbose) fprintf(stderr, "[DEBUG] Channel %d closed\n", c->id);
+
+    relay_reap(&c->relay);
+    channel_release(c);
+    t->open--;
+    stats_channels(s->index, -1);
+}
+
+void channels_input(Session *s) {
+    ChannelTable *t = s->chans;
+    if (!t) return;
+
+    // One read per channel and call, so a busy channel can't starve the others
+    for (int i = 0; i < PROTO_MAX_CHANNELS && !s->failed; i++) {
+        Channel *c = &t->channels[i];
+        if (!c->id) continue;
+
+        channel_push(c);
+        channel_forward(s, c);
+        if (c->window <= 0) continue;
+
+        ssize_t n = relay_read(&c->relay);
+        if (n < 0) continue;
+        channel_forward(s, c);
+        if (n == 0) channel_closed(s, t, c);
+    }
+}
+
+void channels_arm(Session *s) {
+    if (!s->chans) return;
+    for (int i = 0; i < PROTO_MAX_CHANNELS; i++) {
+        Channel *c = &s->chans->channels[i];
+        if (c->id && c->window > 0) relay_watch(s, &c->relay);
+    }
+}
+
+int channels_open(const Session *s) {
+    return s->chans ? s->chans->open : 0;
+}
+
+void channels_check_aborts(Session *s) {
+    uint32_t mask = client_slot_take_channel_aborts(s->index);
+    if (!mask || !s->chans) return;
+
+    // The processes go now; the client hears of it when their EOF is read
+    for (int i = 0; i < PROTO_MAX_CHANNELS; i++) {
+        Channel *c = &s->chans->channels[i];
+        if (!c->id || !(mask & (1u << i))) continue;
+        c->reason = "Channel aborted\n";
+        kill(c->relay.pid, SIGTERM);
+        if (s->verbose) fprintf(stderr, "[DEBUG] Channel %d aborted\n", c->id);
+    }
+}
+
+void channels_forget(Session *s) {
+    ChannelTable *t = s->chans;
+    if (!t) return;
+
+    for (int i = 0; i < PROTO_MAX_CHANNELS; i++) {
+        if (!t->channels[i].id) continue;
+        relay_forget(&t->channels[i].relay);
+        channel_release(&t->channels[i]);
+    }
+    free(t);
+    s->chans = NULL;
+}
+
+void channels_free(Session *s) {
+    ChannelTable *t = s->chans;
+    if (!t) return;
+
+    for (int i = 0; i < PROTO_MAX_CHANNELS; i++) {
+        Channel *c = &t->channels[i];
+        if (!c->id) continue;
+        relay_stop(&c->relay);
+        channel_release(c);
+        stats_channels(s->index, -1);
+    }
+    free(t);
+    s->chans = NULL;
+}
@@ -0,0 +1,53 @@
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <stdint.h>
+
+// Logical channels (see protocol.h)
+//
+// Every channel of a connection is a channel process forked by the process
+// that owns the session (relay.h), with a copy of the session (working
+// directory, environment) whose socket is one end of a socket pair. The
+// owner passes the channel's COMMAND frames to it and its answer frames,
+// whole, back to the client. A channel whose window is used up is not read
+// any more, so its process blocks on the full socket pair and its command
+// on the full pipe, while the other channels go on.
+
+struct Session;
+
+// command_timeout is the -T deadline of the commands run by channels
+void channels_configure(int command_timeout);
+
+// Passes a command to channel (1 to PROTO_MAX_CHANNELS), opening the
+// channel first if needed. A channel that can't be opened answers the
+// command with an error.
+void channel_command(struct Session *s, int channel, uint32_t request_id, const char *cmd);
+
+// Grants the channel increment more bytes of DATA payload
+void channel_window(struct Session *s, int channel, uint32_t increment);
+
+// Descriptors to watch for channel output: the channels that still have
+// window left. Returns how many were stored in fds (PROTO_MAX_CHANNELS at
+// most).
+int channels_fds(const struct Session *s, int *fds);
+
+// Passes on what the channels wrote, without waiting, and reports the
+// channels that closed
+void channels_input(struct Session *s);
+
+// Re-arms the channels with window left in the reactor's epoll instance
+void channels_arm(struct Session *s);
+
+// Number of open channels
+int channels_open(const struct Session *s);
+
+// Closes the channels another client asked to abort (client table)
+void channels_check_aborts(struct Session *s);
+
+// Drops the channels inherited from the parent, without touching them
+void channels_forget(struct Session *s);
+
+// Stops every channel of a closing session and frees the table
+void channels_free(struct Session *s);
+
+#endif
@@ -1,50 +1,602 @@
+#define _GNU_SOURCE
+
+#include "client.h"
+#include "log.h"
 #include "prompt.h"
+#include "protocol.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <arpa/inet.h>
 #include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <errno.h>
 #include <time.h>
+#include <zlib.h>
 
-// Runs the client, connecting to the server and sending/receiving commands
-void run_client(int port, int verbose, FILE *logfile) {
-    time_t now = time(NULL);
-    struct tm *t = localtime(&now);
-    char timestr[32];   // Buffer for timestamp string
+// What frame_output() found in the frames it consumed
+typedef struct {
+    int ended;      // Responses completed (FRAME_END)
+    int failed;     // ... of which with a non-zero exit status
+    int closed;     // Server is closing the session (FRAME_CLOSE)
+} FrameEvents;
 
-    int sock = 0;
-    struct sockaddr_in serv_addr;
+// Received bytes of framed mode that don't form a whole frame yet
+static char *frame_buf;
+static size_t frame_len, frame_cap;
 
-    // Create socket
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        perror("socket");
-        exit(1);
+// Decompressor of the current response (compressed DATA frames)
+static z_stream inflater;
+static int inflater_ready;
+
+// Tail of text-mode output that may be the start of the end marker
+static char marker_carry[sizeof(PROTO_END_MARKER)];
+static size_t marker_carry_len;
+
+// Batch mode shows no prompts between responses
+static int interactive = 1;
+
+// Output of one logical channel (-N), held back until its response ends so
+// the answers of different channels don't mix
+typedef struct {
+    char *buf;
+    size_t len, cap;
+    int outstanding;    // Commands sent on it that weren't answered yet
+    uint32_t grant;     // Payload shown but not granted back to the server yet
+} ClientChannel;
+
+static ClientChannel channels[PROTO_MAX_CHANNELS + 1];
+static int channel_count;          // Channels the batch is spread over, 0 = none
+static uint32_t channel_requests;  // Requests 1 to this went to channels
+
+
+// Logs a "Received" line for output shown to the user
+static void log_received(const char *data, size_t len) {
+    log_write(LOG_LEVEL_INFO, "Received: %.*s", (int)len, data);
+}
+
+// Reads exactly len bytes, waiting at most timeout_ms for each chunk
+static int recv_exact(int sock, void *buf, size_t len, int timeout_ms) {
+    char *p = buf;
+    while (len > 0) {
+        fd_set fds;
+        struct timeval tv = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+        FD_ZERO(&fds);
+        FD_SET(sock, &fds);
+        if (select(sock + 1, &fds, NULL, NULL, &tv) <= 0) return -1;
+
+        ssize_t n = recv(sock, p, len, 0);
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
     }
+    return 0;
+}
 
+// Opens a connection to the server on the local machine, over the Unix
+// socket if a path is given, otherwise over TCP loopback
+int client_connect(const char *unix_path, int port, int flags) {
+    struct sockaddr_storage address;
+    socklen_t len;
 
-    // Prepare server address
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(port);
-    if (inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr) <= 0) {
-        perror("inet_pton");
-        exit(1);
+    if (unix_path) {
+        int n = proto_unix_address(unix_path, (struct sockaddr_un *)&address);
+        if (n < 0) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        len = n;
+    } else {
+        struct sockaddr_in *serv_addr = (struct sockaddr_in *)&address;
+        memset(serv_addr, 0, sizeof(*serv_addr));
+        serv_addr->sin_family = AF_INET;
+        serv_addr->sin_port = htons(port);
+        serv_addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        len = sizeof(*serv_addr);
+    }
+
+    int sock = socket(address.ss_family, SOCK_STREAM | SOCK_CLOEXEC | flags, 0);
+    if (sock < 0) return -1;
+
+    // A Unix socket with a full listen queue fails with EAGAIN, the caller retries
+    if (connect(sock, (struct sockaddr *)&address, len) < 0 &&
+        !((flags & SOCK_NONBLOCK) && errno == EINPROGRESS)) {
+        int err = errno;
+        close(sock);
+        errno = err;
+        return -1;
+    }
+    return sock;
+}
+
+// Sends the line asking for the framed protocol
+int client_send_hello(int sock, int compress, int channels) {
+    char hello[64];
+    int len = snprintf(hello, sizeof(hello), "%s %d%s%s\n", PROTO_HELLO, PROTO_VERSION,
+                       compress ? " " PROTO_COMPRESS_OPTION : "",
+                       channels ? " " PROTO_CHANNELS_OPTION : "");
+    return send(sock, hello, len, MSG_NOSIGNAL) == len ? 0 : -1;
+}
+
+// Asks the server for the framed protocol. *compress and *channels are
+// cleared unless the server agreed to compress output and to open channels.
+// Returns 1 if the server agreed, 0 if it only speaks the text protocol,
+// -1 if the server turned the connection away.
+static int negotiate(int sock, int verbose, int *compress, int *channels) {
+    int asked = *compress, asked_channels = *channels;
+    *compress = *channels = 0;
+    if (client_send_hello(sock, asked, asked_channels) < 0) return 0;
+
+    // The first two bytes tell a FRAME_HELLO apart from text output
+    unsigned char peek[2];
+    int queued = 0;
+    while (1) {
+        fd_set fds;
+        struct timeval tv = { PROTO_HELLO_TIMEOUT_MS / 1000, (PROTO_HELLO_TIMEOUT_MS % 1000) * 1000 };
+        FD_ZERO(&fds);
+        FD_SET(sock, &fds);
+        if (select(sock + 1, &fds, NULL, NULL, queued ? NULL : &tv) <= 0 ||
+            recv(sock, peek, sizeof(peek), MSG_PEEK | MSG_WAITALL) != sizeof(peek))
+            return 0;
+        if (peek[0] != PROTO_VERSION || (peek[1] != FRAME_WAIT && peek[1] != FRAME_CLOSE)) break;
+
+        // Admission control: queued (keep waiting, however long) or turned away
+        char raw[FRAME_HEADER_SIZE];
+        char msg[256];
+        FrameHeader h;
+        if (recv_exact(sock, raw, sizeof(raw), PROTO_HELLO_TIMEOUT_MS) < 0 ||
+            frame_unpack(raw, sizeof(raw), &h) != 1 || h.length >= sizeof(msg) ||
+            recv_exact(sock, msg, h.length, PROTO_HELLO_TIMEOUT_MS) < 0)
+            return -1;
+        msg[h.length] = '\0';
+        fprintf(stderr, "%s", msg);
+        log_write(LOG_LEVEL_INFO, "%s", msg);
+        if (h.type == FRAME_CLOSE) return -1;
+        queued = 1;
+    }
+
+    if (peek[0] == PROTO_VERSION && peek[1] == FRAME_HELLO) {
+        char raw[FRAME_HEADER_SIZE];
+        char banner[128];
+        FrameHeader h;
+
+        if (recv_exact(sock, raw, sizeof(raw), PROTO_HELLO_TIMEOUT_MS) < 0 ||
+            frame_unpack(raw, sizeof(raw), &h) != 1 || h.length >= sizeof(banner) ||
+            recv_exact(sock, banner, h.length, PROTO_HELLO_TIMEOUT_MS) < 0)
+            return 0;
+
+        banner[h.length] = '\0';
+        *compress = asked && (h.flags & FRAME_FLAG_DEFLATE);
+        *channels = asked_channels && (h.flags & FRAME_FLAG_CHANNELS);
+        if (verbose) fprintf(stderr, "[DEBUG] Framed protocol accepted by %s%s%s\n", banner,
+                             asked && !*compress ? " (without compression)" : "",
+                             asked_channels && !*channels ? " (without channels)" : "");
+        return 1;
+    }
+
+    // An older server ran the hello line as a command; skip its answer
+    size_t mlen = strlen(PROTO_END_MARKER);
+    char window[sizeof(PROTO_END_MARKER)] = {0};
+    char c;
+    while (recv_exact(sock, &c, 1, PROTO_HELLO_TIMEOUT_MS) == 0) {
+        memmove(window, window + 1, mlen - 1);
+        window[mlen - 1] = c;
+        if (memcmp(window, PROTO_END_MARKER, mlen) == 0) break;
+    }
+    if (verbose) fprintf(stderr, "[DEBUG] Server speaks the text protocol only\n");
+    return 0;
+}
+
+// Shows text-mode output. The end marker may be split across reads, so a
+// tail that could start it is held back until the next read.
+// Returns the number of responses that ended.
+static int text_output(const char *data, size_t len) {
+    const char *marker = PROTO_END_MARKER;
+    size_t mlen = strlen(marker);
+    char work[sizeof(marker_carry) + 4096];
+    int ended = 0;
+
+    while (len > 0) {
+        // Process at most one work buffer at a time
+        size_t take = len < sizeof(work) - marker_carry_len ? len : sizeof(work) - marker_carry_len;
+        memcpy(work, marker_carry, marker_carry_len);
+        memcpy(work + marker_carry_len, data, take);
+        size_t wlen = marker_carry_len + take;
+        marker_carry_len = 0;
+        data += take;
+        len -= take;
+
+        char *pos;
+        char *start = work;
+        while ((pos = memmem(start, wlen - (start - work), marker, mlen)) != NULL) {
+            fwrite(start, 1, pos - start, stdout);
+            log_received(start, pos - start);
+            if (interactive) print_prompt();
+            ended++;
+            start = pos + mlen;
+        }
+
+        // Hold back the longest tail that is a prefix of the marker
+        size_t rest = wlen - (start - work);
+        size_t hold = rest < mlen - 1 ? rest : mlen - 1;
+        while (hold > 0 && memcmp(start + rest - hold, marker, hold) != 0) hold--;
+
+        fwrite(start, 1, rest - hold, stdout);
+        if (rest - hold > 0) log_received(start, rest - hold);
+        memcpy(marker_carry, start + rest - hold, hold);
+        marker_carry_len = hold;
+    }
+
+    fflush(stdout);
+    return ended;
+}
+
+// Shows the output carried by a compressed DATA frame.
+// Returns 0, or -1 if the data is not a valid continuation of the stream.
+static int inflate_output(const char *data, size_t len) {
+    static unsigned char out[65536];
+
+    if (!inflater_ready) {
+        if (inflateInit(&inflater) != Z_OK) return -1;
+        inflater_ready = 1;
+    }
+
+    inflater.next_in = (Bytef *)data;
+    inflater.avail_in = len;
+    do {
+        inflater.next_out = out;
+        inflater.avail_out = sizeof(out);
+        int r = inflate(&inflater, Z_SYNC_FLUSH);
+        if (r != Z_OK && r != Z_BUF_ERROR && r != Z_STREAM_END) return -1;
+
+        size_t n = sizeof(out) - inflater.avail_out;
+        fwrite(out, 1, n, stdout);
+        if (n > 0) log_received((const char *)out, n);
+    } while (inflater.avail_out == 0);
+    return 0;
+}
+
+// Channel a request was sent on, 0 = the session's own stream
+static int request_channel(uint32_t request_id) {
+    if (!channel_count || request_id == 0 || request_id > channel_requests) return 0;
+    return (int)((request_id - 1) % channel_count) + 1;
+}
+
+// Shows the first n bytes a channel held back and counts them as consumed,
+// for the next grant
+static void channel_show(ClientChannel *c, size_t n) {
+    fwrite(c->buf, 1, n, stdout);
+    if (n > 0) log_received(c->buf, n);
+    c->grant += n;
+    c->len -= n;
+    memmove(c->buf, c->buf + n, c->len);
+}
+
+// Holds channel output back; half a window of it is shown anyway, up to its
+// last whole line, so the server never waits for a grant while we wait for
+// the end of the response
+static int channel_output(ClientChannel *c, const char *data, size_t len) {
+    if (c->len + len > c->cap) {
+        size_t cap = c->cap ? c->cap : 4096;
+        while (cap < c->len + len) cap *= 2;
+        char *p = realloc(c->buf, cap);
+        if (!p) return -1;
+        c->buf = p;
+        c->cap = cap;
+    }
+    memcpy(c->buf + c->len, data, len);
+    c->len += len;
+    if (c->len >= PROTO_CHANNEL_WINDOW / 2) {
+        const char *nl = memrchr(c->buf, '\n', c->len);
+        channel_show(c, nl ? (size_t)(nl + 1 - c->buf) : c->len);
+    }
+    return 0;
+}
+
+// Frees what the frame decoder kept between reads
+static void frame_state_free(void) {
+    free(frame_buf);
+    frame_buf = NULL;
+    frame_len = frame_cap = 0;
+    for (int i = 0; i <= PROTO_MAX_CHANNELS; i++) {
+        free(channels[i].buf);
+        memset(&channels[i], 0, sizeof(channels[i]));
+    }
+    if (inflater_ready) inflateEnd(&inflater);
+    inflater_ready = 0;
+}
+
+// Consumes whole frames from the receive buffer and reports what they were.
+// Returns 0, or -1 on a protocol error.
+static int frame_output(const char *data, size_t len, int verbose, FrameEvents *ev) {
+    if (frame_len + len > frame_cap) {
+        size_t cap = frame_cap ? frame_cap : 4096;
+        while (cap < frame_len + len) cap *= 2;
+        char *p = realloc(frame_buf, cap);
+        if (!p) return -1;
+        frame_buf = p;
+        frame_cap = cap;
+    }
+    memcpy(frame_buf + frame_len, data, len);
+    frame_len += len;
+
+    size_t off = 0;
+    while (!ev->closed) {
+        FrameHeader h;
+        int r = frame_unpack(frame_buf + off, frame_len - off, &h);
+        if (r < 0) return -1;
+        if (r == 0 || frame_len - off < FRAME_HEADER_SIZE + h.length) break;
+
+        const char *payload = frame_buf + off + FRAME_HEADER_SIZE;
+        int channel = request_channel(h.request_id);
+        switch (h.type) {
+        case FRAME_DATA:
+            if (channel > 0) {
+                if (channel_output(&channels[channel], payload, h.length) < 0) return -1;
+                break;
+            }
+            if (h.flags & FRAME_FLAG_DEFLATE) {
+                if (inflate_output(payload, h.length) < 0) return -1;
+                break;
+            }
+            fwrite(payload, 1, h.length, stdout);
+            log_received(payload, h.length);
+            break;
+        case FRAME_END:
+            // The next response starts a new compressed stream
+            if (inflater_ready) inflateReset(&inflater);
+            if (verbose) fprintf(stderr, "[DEBUG] Request %u finished with status %d\n", h.request_id, h.status);
+            if (channel > 0) {
+                channel_show(&channels[channel], channels[channel].len);
+                channels[channel].outstanding--;
+            }
+            ev->ended++;
+            if (h.status != 0) ev->failed++;
+            if (interactive) print_prompt();
+            break;
+        case FRAME_CLOSE:
+            fwrite(payload, 1, h.length, stdout);
+            log_received(payload, h.length);
+            ev->closed = 1;
+            break;
+        case FRAME_CHANNEL_CLOSE:
+            // Its unanswered commands are lost; they count as failed
+            if (h.status < 1 || h.status > PROTO_MAX_CHANNELS) return -1;
+            channel = h.status;
+            channel_show(&channels[channel], channels[channel].len);
+            fprintf(stderr, "Channel %d: %.*s", channel, (int)h.length, payload);
+            log_write(LOG_LEVEL_WARN, "Channel %d: %.*s", channel, (int)h.length, payload);
+            ev->ended += channels[channel].outstanding;
+            ev->failed += channels[channel].outstanding;
+            channels[channel].outstanding = 0;
+            break;
+        }
+        off += FRAME_HEADER_SIZE + h.length;
+    }
+
+    frame_len -= off;
+    memmove(frame_buf, frame_buf + off, frame_len);
+    fflush(stdout);
+    return 0;
+}
+
+// Sends one command, as a FRAME_COMMAND in framed mode
+static void send_command(int sock, int framed, const char *input) {
+    static uint32_t request_id = 0;
+
+    if (framed) {
+        FrameHeader h;
+        frame_pack(&h, FRAME_COMMAND, ++request_id, strlen(input), 0);
+        send(sock, &h, sizeof(h), MSG_MORE);
+    }
+    send(sock, input, strlen(input), 0);
+}
+
+// Appends one frame to a growing batch buffer
+static int batch_frame(char **buf, size_t *len, size_t *cap, int type, uint32_t request_id,
+                       const void *payload, size_t n, int status) {
+    if (*len + FRAME_HEADER_SIZE + n > *cap) {
+        size_t c = *cap ? *cap : 4096;
+        while (c < *len + FRAME_HEADER_SIZE + n) c *= 2;
+        char *p = realloc(*buf, c);
+        if (!p) return -1;
+        *buf = p;
+        *cap = c;
+    }
+
+    FrameHeader h;
+    frame_pack(&h, type, request_id, n, status);
+    memcpy(*buf + *len, &h, FRAME_HEADER_SIZE);
+    memcpy(*buf + *len + FRAME_HEADER_SIZE, payload, n);
+    *len += FRAME_HEADER_SIZE + n;
+    return 0;
+}
+
+// Appends one COMMAND frame for channel (0 = the session's own stream)
+static int batch_append(char **buf, size_t *len, size_t *cap, uint32_t request_id, const char *cmd, int channel) {
+    return batch_frame(buf, len, cap, FRAME_COMMAND, request_id, cmd, strlen(cmd), channel);
+}
+
+// Appends a FRAME_WINDOW for every channel whose output was shown since its
+// last grant. Frames are only ever added whole behind what is being sent.
+static int batch_grants(char **buf, size_t *len, size_t *cap) {
+    for (int c = 1; c <= channel_count; c++) {
+        if (channels[c].grant == 0) continue;
+        uint32_t increment = htonl(channels[c].grant);
+        if (batch_frame(buf, len, cap, FRAME_WINDOW, 0, &increment, sizeof(increment), c) < 0) return -1;
+        channels[c].grant = 0;
+    }
+    return 0;
+}
+
+// Reads the next command line of a batch, skipping empty lines.
+// Returns 0 at the end of the input.
+static int batch_next_line(FILE *in, char *line, size_t size) {
+    while (fgets(line, size, in)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] != '\0') return 1;
+    }
+    return 0;
+}
+
+// Runs every command of a batch file. With the framed protocol all commands
+// are sent at once and the answers are read while sending, so neither side
+// blocks on a full socket buffer. With channels (-N) command i goes to
+// channel i % N + 1, and a final quit or halt follows on the session's own
+// stream once they all answered. A text-only server gets them one by one.
+// Returns 1 if any command failed or the batch was cut short, 0 otherwise.
+static int run_batch(int sock, int framed, FILE *in, int verbose) {
+    char line[PROTO_MAX_COMMAND];
+    char held[PROTO_MAX_COMMAND] = "";
+    char *out = NULL;
+    size_t out_len = 0, out_cap = 0, out_sent = 0;
+    int queued = 0, stop = 0;
+    int stop_sent = 0;  // The last command queued is quit or halt
+    int gone = 0;       // Server closed the connection
+    FrameEvents ev = {0};
+
+    if (framed) {
+        while (!stop && batch_next_line(in, line, sizeof(line))) {
+            // Nothing after these gets an answer
+            stop = strcmp(line, "quit") == 0 || strcmp(line, "halt") == 0;
+            if (stop && channel_count) {
+                snprintf(held, sizeof(held), "%s", line);
+                break;
+            }
+
+            int channel = channel_count ? queued % channel_count + 1 : 0;
+            if (batch_append(&out, &out_len, &out_cap, queued + 1, line, channel) < 0) {
+                perror("realloc");
+                free(out);
+                return 1;
+            }
+            channels[channel].outstanding++;
+            queued++;
+            stop_sent = stop;
+        }
+        if (channel_count) channel_requests = queued;
+        if (verbose) fprintf(stderr, "[DEBUG] Sending %d pipelined commands over %d channels\n",
+                             queued, channel_count);
+    } else if (batch_next_line(in, line, sizeof(line))) {
+        send_command(sock, 0, line);
+        queued = 1;
+        stop_sent = strcmp(line, "quit") == 0 || strcmp(line, "halt") == 0;
+    }
+
+    while (!ev.closed) {
+        if (held[0] && ev.ended == queued) {
+            if (batch_append(&out, &out_len, &out_cap, queued + 1, held, 0) < 0) break;
+            queued++;
+            stop_sent = 1;
+            held[0] = '\0';
+        }
+        if (ev.ended >= queued) break;
+
+        fd_set rfds, wfds;
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        FD_SET(sock, &rfds);
+        if (out_sent < out_len) FD_SET(sock, &wfds);
+
+        if (select(sock + 1, &rfds, &wfds, NULL, NULL) < 0) {
+            if (errno == EINTR) continue;
+            perror("select");
+            break;
+        }
+
+        if (FD_ISSET(sock, &wfds)) {
+            ssize_t n = send(sock, out + out_sent, out_len - out_sent, MSG_DONTWAIT);
+            if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                perror("send");
+                break;
+            }
+            if (n > 0) out_sent += n;
+            if (out_sent == out_len) out_sent = out_len = 0; // grants reuse the buffer
+        }
+
+        if (FD_ISSET(sock, &rfds)) {
+            char buf[PROTO_READ_SIZE];
+            ssize_t bytes = read(sock, buf, sizeof(buf));
+            if (bytes <= 0) { // server closed the connection
+                gone = 1;
+                break;
+            }
+
+            if (framed) {
+                if (frame_output(buf, bytes, verbose, &ev) < 0 ||
+                    batch_grants(&out, &out_len, &out_cap) < 0) {
+                    fprintf(stderr, "Protocol error, closing the connection\n");
+                    break;
+                }
+            } else if (text_output(buf, bytes) > 0) {
+                // The text protocol has no status; only count the answers
+                ev.ended++;
+                if (!stop_sent && batch_next_line(in, line, sizeof(line))) {
+                    send_command(sock, 0, line);
+                    queued++;
+                    stop_sent = strcmp(line, "quit") == 0 || strcmp(line, "halt") == 0;
+                }
+            }
+        }
     }
 
+    // quit and halt are answered by the server closing the connection, not
+    // by an end of response
+    if (stop_sent && (ev.closed || gone) && ev.ended == queued - 1) ev.ended++;
+
+    if (verbose) fprintf(stderr, "[DEBUG] %d of %d commands answered, %d failed\n", ev.ended, queued, ev.failed);
+    free(out);
+    return ev.failed > 0 || ev.ended < queued;
+}
+
+// Runs the client, connecting to the server and sending/receiving commands
+int run_client(const ClientConfig *cfg) {
+    int port = cfg->port;
+    int verbose = cfg->verbose;
+
     // Connect to server
-    if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+    int sock = client_connect(cfg->unix_path, port, 0);
+    if (sock < 0) {
         perror("connect");
         exit(1);
     }
 
     // Log and print connection established
-    if (verbose) fprintf(stderr, "[DEBUG] Connected to server on port %d\n", port);
-    now = time(NULL);
-    t = localtime(&now);
-    strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", t);
-    if (logfile) fprintf(logfile, "[%s] [LOG] Connected to server on port %d\n", timestr, port);
+    if (cfg->unix_path) {
+        if (verbose) fprintf(stderr, "[DEBUG] Connected to server on %s\n", cfg->unix_path);
+        log_write(LOG_LEVEL_INFO, "Connected to server on %s\n", cfg->unix_path);
+    } else {
+        if (verbose) fprintf(stderr, "[DEBUG] Connected to server on port %d\n", port);
+        log_write(LOG_LEVEL_INFO, "Connected to server on port %d\n", port);
+    }
+
+    // Prefer the framed protocol, fall back to text with an older server
+    int compress = cfg->compress;
+    int channels_accepted = cfg->channels > 0 && cfg->batch_file;
+    int framed = negotiate(sock, verbose, &compress, &channels_accepted);
+    if (framed < 0) {
+        close(sock);
+        return 1;
+    }
+
+    if (cfg->batch_file) {
+        FILE *in = strcmp(cfg->batch_file, "-") == 0 ? stdin : fopen(cfg->batch_file, "r");
+        if (!in) {
+            perror("fopen batch");
+            close(sock);
+            return 1;
+        }
+
+        interactive = 0;
+        if (channels_accepted) channel_count = cfg->channels;
+        int result = run_batch(sock, framed, in, verbose);
+        if (in != stdin) fclose(in);
+        frame_state_free();
+        close(sock);
+        return result;
+    }
 
     print_prompt(); // Show initial prompt
     fflush(stdout);
@@ -66,48 +618,25 @@ void run_client(int port, int verbose, FILE *logfile) {
 
         // Handle incoming data from server
         if (FD_ISSET(sock, &fds)) {
-            char buf[1024];
-            int bytes = read(sock, buf, sizeof(buf) - 1);
+            char buf[4096];
+            int bytes = read(sock, buf, sizeof(buf));
             if (bytes <= 0) {
                 // Server closed connection
                 if (verbose) fprintf(stderr, "[DEBUG] Server disconnected. Exiting.\n");
-                now = time(NULL);
-                t = localtime(&now);
-                strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", t);
-                if (logfile) fprintf(logfile, "[%s] [LOG] Server disconnected. Exiting.\n", timestr);
+                log_write(LOG_LEVEL_INFO, "Server disconnected. Exiting.\n");
                 break;
             }
 
-            buf[bytes] = '\0';
-
-            // Look for end marker to separate outputs
-            char *pos = strstr(buf, "__END__\n");
-            if (pos) {
-                *pos = '\0';
-                printf("%s", buf);
-
-                // Log the clean response
-                if (logfile) {
-                    now = time(NULL);
-                    t = localtime(&now);
-                    strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", t);
-                    fprintf(logfile, "[%s] [LOG] Received: %s\n", timestr, buf);
+            if (framed) {
+                FrameEvents ev = {0};
+                if (frame_output(buf, bytes, verbose, &ev) < 0) {
+                    fprintf(stderr, "Protocol error, closing the connection\n");
+                    break;
                 }
-
-                print_prompt();
+                if (ev.closed) break; // server is closing the session
             } else {
-                printf("%s", buf);
-
-                // Log the raw output
-                if (logfile) {
-                    now = time(NULL);
-                    t = localtime(&now);
-                    strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", t);
-                    fprintf(logfile, "[%s] [LOG] Received: %s\n", timestr, buf);
-                }
+                text_output(buf, bytes);
             }
-
-            fflush(stdout);
         }
 
         // Handle user input
@@ -160,7 +689,7 @@ void run_client(int port, int verbose, FILE *logfile) {
             }
 
             // Send regular input to the server
-            send(sock, input, strlen(input), 0);
+            send_command(sock, framed, input);
 
             // Exit if internal quit/halt command was issued
             if (strcmp(input, "quit") == 0 || strcmp(input, "halt") == 0)
@@ -169,5 +698,7 @@ void run_client(int port, int verbose, FILE *logfile) {
     }
 
     // Close socket when done
+    frame_state_free();
     close(sock);
+    return 0;
 }
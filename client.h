@@ -0,0 +1,32 @@
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include <stdio.h>
+
+// Client settings collected from the command line
+typedef struct {
+    int port;               // TCP port of the server
+    const char *unix_path;  // Unix socket of the server (-u), "@name" = abstract, NULL = use TCP
+    int verbose;            // Verbose (debug) output to stderr
+    const char *batch_file; // Commands to run pipelined (-f), "-" = stdin, NULL = interactive
+    int compress;           // Ask the server to compress large outputs (-z)
+    int channels;           // Logical channels the batch is spread over (-N), 0 = none
+} ClientConfig;
+
+// Opens a connection to the server on this machine: to the Unix socket
+// unix_path if it is not NULL, otherwise to the TCP port. flags may contain
+// SOCK_NONBLOCK, the connect is then still in progress on return.
+// Returns the socket, or -1 with errno set.
+int client_connect(const char *unix_path, int port, int flags);
+
+// Sends the line asking the server for the framed protocol, with compressed
+// output if compress is set and logical channels if channels is set.
+// Returns 0, or -1 if it could not be sent.
+int client_send_hello(int sock, int compress, int channels);
+
+// Runs the client until the user or the server ends the session.
+// Returns the exit status for the program: in batch mode 1 if any command
+// failed, otherwise 0.
+int run_client(const ClientConfig *cfg);
+
+#endif
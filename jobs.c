@@ -0,0 +1,271 @@
+#include "jobs.h"
+#include "shell.h"
+#include "output.h"
+#include "protocol.h"
+#include "table.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+
+#define JOB_KILLED_STATUS (128 + SIGTERM)  // Reported for a job that ended without its END frame
+
+// What a job process runs
+typedef struct {
+    int (*run)(Session *, void *);
+    void *arg;
+} JobMain;
+
+// Frees one slot once its relay is reaped, stopped or forgotten
+static void job_release(Job *j) {
+    memset(j, 0, sizeof(*j));
+    j->relay.fd = -1;
+}
+
+
+// Job process: runs the pipeline against its copy of the session, which
+// counts nothing in the client table
+static void job_main(Session *js, void *arg) {
+    const JobMain *m = arg;
+    js->index = -1;
+    session_end(js, m->run(js, m->arg));
+}
+
+// Starts a job in the first free slot
+int job_start(Session *s, const char *name, int (*run)(Session *, void *), void *arg) {
+    if (!s->jobs && !(s->jobs = calloc(1, sizeof(JobTable)))) return -1;
+    JobTable *t = s->jobs;
+
+    Job *j = NULL;
+    for (int i = 0; i < MAX_JOBS && !j; i++)
+        if (t->jobs[i].id == 0) j = &t->jobs[i];
+    if (!j) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    JobMain m = { run, arg };
+    memset(j, 0, sizeof(*j));
+    if (relay_start(s, &j->relay, job_main, &m) < 0) {
+        j->relay.fd = -1;
+        return -1;
+    }
+    j->id = (int)(j - t->jobs) + 1;
+    snprintf(j->name, sizeof(j->name), "%s", name);
+
+    if (s->verbose) fprintf(stderr, "[DEBUG] Job %d started, pid %d: %s\n", j->id, j->relay.pid, name);
+    return j->id;
+}
+
+int jobs_fds(const Session *s, int *fds) {
+    int n = 0;
+    if (!s->jobs) return 0;
+    for (int i = 0; i < MAX_JOBS; i++)
+        if (s->jobs->jobs[i].id) fds[n++] = s->jobs->jobs[i].relay.fd;
+    return n;
+}
+
+
+// Passes the whole lines of a piece of job output on, "[n] " in front of
+// each. An unfinished line is held back until its newline arrives (or it
+// gets too long), so lines of different jobs and responses never mix.
+// flush: the job ended, what is held back goes too.
+static void job_output(Session *s, Job *j, const char *data, size_t len, int flush) {
+    char prefix[16];
+    int plen = snprintf(prefix, sizeof(prefix), "[%d] ", j->id);
+
+    size_t lines = 2;
+    for (size_t i = 0; i < len; i++)
+        if (data[i] == '\n') lines++;
+
+    char *out = malloc(j->line_len + len + lines * (plen + 1));
+    if (!out) return;
+
+    size_t n = 0;
+    const char *p = data, *end = data + len;
+    while (p < end || (flush && j->line_len > 0)) {
+        const char *nl = p < end ? memchr(p, '\n', end - p) : NULL;
+        size_t take = nl ? (size_t)(nl + 1 - p) : (size_t)(end - p);
+        if (!nl && !flush && j->line_len + take < JOB_LINE_MAX) {
+            memcpy(j->line + j->line_len, p, take);
+            j->line_len += take;
+            break;
+        }
+
+        memcpy(out + n, prefix, plen);
+        n += plen;
+        memcpy(out + n, j->line, j->line_len);
+        n += j->line_len;
+        memcpy(out + n, p, take);
+        n += take;
+        if (!nl) out[n++] = '\n';
+        j->line_len = 0;
+        p += take;
+    }
+
+    session_write_unsolicited(s, out, n);
+    free(out);
+}
+
+// Handles the whole frames received from a job so far
+static void job_frames(Session *s, Job *j) {
+    size_t off = 0;
+    FrameHeader h;
+    const char *payload;
+
+    while ((payload = relay_frame(&j->relay, &off, &h))) {
+        if (h.type == FRAME_DATA) {
+            job_output(s, j, payload, h.length, 0);
+        } else if (h.type == FRAME_END) {
+            j->ended = 1;
+            j->status = h.status;
+        }
+        off += FRAME_HEADER_SIZE + h.length;
+    }
+    relay_consume(&j->relay, off);
+}
+
+// Reports the end of a job, reaps it and frees its slot
+static void job_done(Session *s, JobTable *t, Job *j) {
+    int status = j->ended ? j->status : JOB_KILLED_STATUS;
+    job_output(s, j, NULL, 0, 1);
+
+    char msg[JOB_NAME_SIZE + 64];
+    int n;
+    if (!j->ended) n = snprintf(msg, sizeof(msg), "[%d] Terminated  %s\n", j->id, j->name);
+    else if (status == 0) n = snprintf(msg, sizeof(msg), "[%d] Done  %s\n", j->id, j->name);
+    else n = snprintf(msg, sizeof(msg), "[%d] Exit %d  %s\n", j->id, status, j->name);
+    session_write_unsolicited(s, msg, n);
+
+    if (s->verbose) fprintf(stderr, "[DEBUG] Job %d finished with status %d\n", j->id, status);
+    if (t->waiting == -1 || t->waiting == j->id) t->wait_status = status;
+
+    relay_reap(&j->relay);
+    job_release(j);
+}
+
+// Reads one chunk from every job that has something, without waiting
+static void jobs_read(Session *s, JobTable *t) {
+    for (int i = 0; i < MAX_JOBS; i++) {
+        Job *j = &t->jobs[i];
+        if (!j->id) continue;
+
+        ssize_t n = relay_read(&j->relay);
+        if (n == 0) job_done(s, t, j);
+        else if (n > 0) job_frames(s, j);
+    }
+}
+
+int jobs_input(Session *s) {
+    JobTable *t = s->jobs;
+    if (!t) return 0;
+
+    jobs_read(s, t);
+    if (!t->waiting || jobs_running(s, t->waiting > 0 ? t->waiting : 0)) return 0;
+
+    t->waiting = 0;
+    s->status = t->wait_status;
+    session_end(s, t->wait_status);
+    return 1;
+}
+
+void jobs_arm(Session *s) {
+    if (!s->jobs) return;
+    for (int i = 0; i < MAX_JOBS; i++)
+        if (s->jobs->jobs[i].id) relay_watch(s, &s->jobs->jobs[i].relay);
+}
+
+
+void jobs_list(Session *s) {
+    if (!s->jobs) return;
+    for (int i = 0; i < MAX_JOBS; i++) {
+        const Job *j = &s->jobs->jobs[i];
+        if (j->id) session_printf(s, "[%d] Running  %s\n", j->id, j->name);
+    }
+}
+
+int jobs_running(const Session *s, int id) {
+    if (!s->jobs) return 0;
+    for (int i = 0; i < MAX_JOBS; i++) {
+        int job = s->jobs->jobs[i].id;
+        if (job && (id == 0 || job == id)) return 1;
+    }
+    return 0;
+}
+
+// Blocks until the job (0 = all) ended, the client is gone or another
+// client aborted the session
+int jobs_wait(Session *s, int id) {
+    JobTable *t = s->jobs;
+    if (!t) return 0;
+
+    t->waiting = id ? id : -1;
+    t->wait_status = 0;
+    while (jobs_running(s, id) && !s->failed) {
+        struct pollfd pfd[MAX_JOBS];
+        int n = 0;
+        for (int i = 0; i < MAX_JOBS; i++)
+            if (t->jobs[i].id) pfd[n++] = (struct pollfd){ t->jobs[i].relay.fd, POLLIN, 0 };
+
+        if (poll(pfd, n, -1) < 0) {
+            if (errno != EINTR) break;
+            if (client_slot_abort_requested(s->index, s->session_id)) break;
+            continue;
+        }
+        jobs_read(s, t);
+    }
+    t->waiting = 0;
+    return t->wait_status;
+}
+
+void jobs_wait_begin(Session *s, int id) {
+    if (!s->jobs) return;
+    s->jobs->waiting = id ? id : -1;
+    s->jobs->wait_status = 0;
+}
+
+int jobs_waiting(const Session *s) {
+    return s->jobs && s->jobs->waiting != 0;
+}
+
+int jobs_kill(Session *s, int id, int sig) {
+    if (!s->jobs || id < 1 || id > MAX_JOBS || !s->jobs->jobs[id - 1].id) return -1;
+    // The job process passes SIGTERM on to its pipeline (command_signals_setup)
+    return kill(s->jobs->jobs[id - 1].relay.pid, sig) < 0 ? -1 : 0;
+}
+
+
+void jobs_finish(Session *s) {
+    if (!s->jobs) return;
+    jobs_wait(s, 0);
+    jobs_free(s);
+}
+
+void jobs_forget(Session *s) {
+    JobTable *t = s->jobs;
+    if (!t) return;
+
+    for (int i = 0; i < MAX_JOBS; i++)
+        if (t->jobs[i].id) {
+            relay_forget(&t->jobs[i].relay);
+            job_release(&t->jobs[i]);
+        }
+    free(t);
+    s->jobs = NULL;
+}
+
+void jobs_free(Session *s) {
+    JobTable *t = s->jobs;
+    if (!t) return;
+
+    for (int i = 0; i < MAX_JOBS; i++) {
+        Job *j = &t->jobs[i];
+        if (!j->id) continue;
+        relay_stop(&j->relay);
+        job_release(j);
+    }
+    free(t);
+    s->jobs = NULL;
+}
@@ -0,0 +1,86 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include "relay.h"
+#include <stddef.h>     // For size_t
+
+// Background jobs
+//
+// A pipeline ended by '&' runs in a job process forked by the process that
+// owns the session (relay.h), and the line goes on at once. The job writes
+// its output as frames into its socket pair; the owner reads it between
+// commands and passes it on a whole line at a time, every line tagged
+// "[n] ", outside any response (request id 0 in framed mode), followed by a
+// notice once the job ended. `jobs`, `wait` and `kill %n` manage them. Jobs
+// are not subject to the -T deadline.
+
+#define MAX_JOBS 16         // Background jobs per session
+#define JOB_NAME_SIZE 128   // Command text kept for `jobs` and the notices
+#define JOB_LINE_MAX 4096   // Longest unfinished output line held back
+
+struct Session;
+
+typedef struct {
+    int id;             // Number shown as [n], 0 = free slot
+    Relay relay;        // Job process and its output socket
+    int ended;          // Its FRAME_END arrived, status is valid
+    int status;         // Exit status of its pipeline
+    char line[JOB_LINE_MAX];    // Start of a line whose newline didn't arrive yet
+    size_t line_len;
+    char name[JOB_NAME_SIZE];
+} Job;
+
+typedef struct JobTable {
+    Job jobs[MAX_JOBS];
+    int waiting;        // Job a `wait` in progress waits for: -1 = all, 0 = none
+    int wait_status;    // Exit status of the last job it saw end
+} JobTable;
+
+// Starts a job that calls run(job_session, arg) and reports what it returns
+// as its exit status. The job session writes frames to the job socket and
+// counts nothing in the client table; the owner counts what it forwards.
+// Returns the job number, or -1 with errno set (EAGAIN: MAX_JOBS running).
+int job_start(struct Session *s, const char *name, int (*run)(struct Session *, void *), void *arg);
+
+// Descriptors to watch for job output; returns how many were stored in fds
+// (MAX_JOBS at most)
+int jobs_fds(const struct Session *s, int *fds);
+
+// Passes on whatever the jobs have written, without waiting, and reports
+// the jobs that ended. Returns 1 if this finished a `wait` begun with
+// jobs_wait_begin() (its response was ended), 0 otherwise.
+int jobs_input(struct Session *s);
+
+// Re-arms the session's job sockets in the reactor's epoll instance
+void jobs_arm(struct Session *s);
+
+// Lists the running jobs
+void jobs_list(struct Session *s);
+
+// Returns 1 if job id (0 = any) is running
+int jobs_running(const struct Session *s, int id);
+
+// Waits for job id (0 = all of them) while passing their output on.
+// Returns the exit status of the job (of the last one with 0).
+int jobs_wait(struct Session *s, int id);
+
+// Reactor: like jobs_wait(), but returns at once; jobs_input() ends the
+// response when the job is done
+void jobs_wait_begin(struct Session *s, int id);
+
+// Returns 1 while a wait begun with jobs_wait_begin() is in progress
+int jobs_waiting(const struct Session *s);
+
+// Sends sig to job id. Returns 0, or -1 if there is no such job.
+int jobs_kill(struct Session *s, int id, int sig);
+
+// Waits for every job, then frees the table (a runner does before it exits)
+void jobs_finish(struct Session *s);
+
+// Drops the jobs inherited from the parent, without touching them
+void jobs_forget(struct Session *s);
+
+// Stops every job of a closing session and frees the table
+void jobs_free(struct Session *s);
+
+#endif
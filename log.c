@@ -0,0 +1,297 @@
+#define _GNU_SOURCE
+
+#include "log.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/eventfd.h>
+
+#define LOG_RING_SIZE (1 << 20)             // Bytes shared by all producers
+#define LOG_MAX_RECORD (LOG_RING_SIZE / 4)  // Longer messages are truncated
+#define LOG_STACK_MESSAGE 1024              // Messages formatted without malloc
+#define LOG_POLL_MS 500                     // Writer checks on its owner this often
+#define LOG_STUCK_MS 2000                   // Record given up if never completed
+
+// Record header; the message follows. Records start 8-byte aligned, so the
+// size/ready pair never wraps around the end of the ring.
+typedef struct {
+    uint32_t size;      // Bytes of the whole record, padded to 8
+    uint32_t ready;     // Set by the producer once the record is complete
+    uint32_t level;     // LogLevel
+    uint32_t len;       // Message bytes
+    int64_t time;       // Seconds since the epoch
+} LogRecord;
+
+typedef struct {
+    uint64_t tail __attribute__((aligned(64)));    // Next byte a producer reserves
+    uint64_t head __attribute__((aligned(64)));    // Next byte the writer reads
+    uint64_t dropped;   // Lines lost because the ring was full
+    int sleeping;       // Writer waits on the eventfd
+    int closing;        // Owner asked the writer to drain and exit
+    char data[LOG_RING_SIZE] __attribute__((aligned(64)));
+} LogRing;
+
+static LogRing *ring;
+static LogLevel min_level = LOG_LEVEL_INFO;
+static int wake_fd = -1;        // eventfd the writer sleeps on
+static pid_t writer_pid = -1;
+static pid_t owner_pid = -1;    // Process that called log_open()
+
+static const char *level_tags[] = { "DEBUG", "LOG", "WARN", "ERROR" };
+
+
+int log_level_parse(const char *name) {
+    static const char *names[] = { "debug", "info", "warn", "error" };
+    for (int i = 0; i < 4; i++)
+        if (strcmp(name, names[i]) == 0) return i;
+    return -1;
+}
+
+// Copies between a linear buffer and the ring, wrapping at its end
+static void ring_put(uint64_t pos, const void *src, size_t len) {
+    size_t off = pos % LOG_RING_SIZE;
+    size_t first = len < LOG_RING_SIZE - off ? len : LOG_RING_SIZE - off;
+    memcpy(ring->data + off, src, first);
+    memcpy(ring->data, (const char *)src + first, len - first);
+}
+
+static void ring_get(uint64_t pos, void *dst, size_t len) {
+    size_t off = pos % LOG_RING_SIZE;
+    size_t first = len < LOG_RING_SIZE - off ? len : LOG_RING_SIZE - off;
+    memcpy(dst, ring->data + off, first);
+    memcpy((char *)dst + first, ring->data, len - first);
+}
+
+static void ring_zero(uint64_t pos, size_t len) {
+    size_t off = pos % LOG_RING_SIZE;
+    size_t first = len < LOG_RING_SIZE - off ? len : LOG_RING_SIZE - off;
+    memset(ring->data + off, 0, first);
+    memset(ring->data, 0, len - first);
+}
+
+static uint32_t *record_words(uint64_t pos) {
+    return (uint32_t *)(ring->data + pos % LOG_RING_SIZE);
+}
+
+
+void log_write(LogLevel level, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    log_vwrite(level, fmt, ap);
+    va_end(ap);
+}
+
+void log_vwrite(LogLevel level, const char *fmt, va_list ap) {
+    if (!ring || level < min_level) return;
+
+    char stack[LOG_STACK_MESSAGE];
+    char *msg = stack;
+    va_list again;
+
+    va_copy(again, ap);
+    int len = vsnprintf(stack, sizeof(stack), fmt, ap);
+    if (len < 0) {
+        va_end(again);
+        return;
+    }
+
+    if (len >= (int)sizeof(stack)) {
+        if (len > LOG_MAX_RECORD - (int)sizeof(LogRecord))
+            len = LOG_MAX_RECORD - (int)sizeof(LogRecord);
+        msg = malloc(len + 1);
+        if (msg) {
+            vsnprintf(msg, len + 1, fmt, again);
+        } else {
+            msg = stack;
+            len = sizeof(stack) - 1;
+        }
+    }
+
+    va_end(again);
+
+    // Reserve room; a full ring drops the line instead of waiting
+    uint32_t size = (sizeof(LogRecord) + len + 7) & ~7u;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    do {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (tail + size - head > LOG_RING_SIZE) {
+            __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+            if (msg != stack) free(msg);
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(&ring->tail, &tail, tail + size, 0,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    uint32_t *words = record_words(tail);
+    __atomic_store_n(&words[0], size, __ATOMIC_RELAXED); // lets the writer skip us if we die
+
+    LogRecord rec = { .size = size, .level = level, .len = len, .time = time(NULL) };
+    ring_put(tail + 8, (const char *)&rec + 8, sizeof(rec) - 8);
+    ring_put(tail + sizeof(rec), msg, len);
+    __atomic_store_n(&words[1], 1, __ATOMIC_RELEASE);
+
+    if (msg != stack) free(msg);
+
+    // Wake the writer only if it went to sleep
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->sleeping, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&ring->sleeping, 0, __ATOMIC_ACQ_REL)) {
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0) { /* writer polls anyway */ }
+    }
+}
+
+
+// Writes every complete record to the file. Returns 1 if the oldest record
+// is reserved but not complete yet.
+static int writer_drain(FILE *file, char *text) {
+    static time_t cached_sec = -1;
+    static char timestr[32];
+
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    while (head < tail) {
+        uint32_t *words = record_words(head);
+        if (!__atomic_load_n(&words[1], __ATOMIC_ACQUIRE)) break;
+
+        LogRecord rec;
+        ring_get(head, &rec, sizeof(rec));
+        ring_get(head + sizeof(rec), text, rec.len);
+
+        // localtime()/strftime() at most once per second
+        if (rec.time != cached_sec) {
+            time_t t = (time_t)rec.time;
+            strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", localtime(&t));
+            cached_sec = rec.time;
+        }
+
+        const char *tag = rec.level < 4 ? level_tags[rec.level] : "LOG";
+        int newline = rec.len == 0 || text[rec.len - 1] != '\n';
+        fprintf(file, "[%s] [%s] %.*s%s", timestr, tag, (int)rec.len, text, newline ? "\n" : "");
+
+        // Stale bytes must not look like a ready flag on the next lap
+        ring_zero(head, rec.size);
+        head += rec.size;
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    }
+
+    uint64_t lost = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+    if (lost > 0) {
+        time_t now = time(NULL);
+        strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", localtime(&now));
+        cached_sec = now;
+        fprintf(file, "[%s] [WARN] %llu log lines dropped, the log ring was full\n",
+                timestr, (unsigned long long)lost);
+    }
+
+    fflush(file);
+    return head < tail;
+}
+
+// Gives up on a record whose producer never completed it (killed mid-write)
+static void writer_skip_stuck(void) {
+    uint64_t head = ring->head;
+    uint32_t size = __atomic_load_n(&record_words(head)[0], __ATOMIC_ACQUIRE);
+    if (size == 0) return; // nothing known about it, keep waiting
+
+    ring_zero(head, size);
+    __atomic_store_n(&ring->head, head + size, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+}
+
+// Body of the writer process
+static void writer_main(FILE *file) {
+    char *text = malloc(LOG_MAX_RECORD);
+    if (!text) _exit(1);
+
+    // 'halt' signals the whole process group; the writer outlives the server
+    // long enough to write its last lines
+    signal(SIGTERM, SIG_IGN);
+    signal(SIGINT, SIG_IGN);
+
+    int stuck_ms = 0;
+    while (1) {
+        int pending = writer_drain(file, text);
+
+        if (__atomic_load_n(&ring->closing, __ATOMIC_ACQUIRE) || getppid() != owner_pid) {
+            if (!pending) break;
+        }
+
+        __atomic_store_n(&ring->sleeping, 1, __ATOMIC_SEQ_CST);
+        uint64_t head = ring->head;
+        if (head != __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) &&
+            __atomic_load_n(&record_words(head)[1], __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+            continue; // a record completed meanwhile
+        }
+
+        struct pollfd pfd = { .fd = wake_fd, .events = POLLIN };
+        int r = poll(&pfd, 1, LOG_POLL_MS);
+        uint64_t count;
+        if (r > 0 && read(wake_fd, &count, sizeof(count)) < 0) { /* spurious */ }
+        __atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+
+        // A producer that died between reserving and completing blocks the ring
+        stuck_ms = (r == 0 && pending) ? stuck_ms + LOG_POLL_MS : 0;
+        if (stuck_ms >= LOG_STUCK_MS) {
+            writer_skip_stuck();
+            stuck_ms = 0;
+        }
+    }
+
+    free(text);
+    fflush(file);
+    _exit(0);
+}
+
+
+int log_open(FILE *file, LogLevel level) {
+    ring = mmap(NULL, sizeof(LogRing), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        ring = NULL;
+        return -1;
+    }
+
+    wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wake_fd < 0) {
+        munmap(ring, sizeof(LogRing));
+        ring = NULL;
+        return -1;
+    }
+
+    min_level = level;
+    owner_pid = getpid();
+    fflush(file);
+
+    writer_pid = fork();
+    if (writer_pid == 0) writer_main(file);
+    if (writer_pid < 0) {
+        close(wake_fd);
+        munmap(ring, sizeof(LogRing));
+        ring = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void log_close(void) {
+    if (!ring || getpid() != owner_pid) return;
+
+    __atomic_store_n(&ring->closing, 1, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0) { /* writer polls anyway */ }
+    waitpid(writer_pid, NULL, 0);
+
+    close(wake_fd);
+    munmap(ring, sizeof(LogRing));
+    ring = NULL;
+}
@@ -0,0 +1,37 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+#include <stdarg.h>
+
+// Asynchronous logging to the -l file
+//
+// log_open() maps a ring buffer shared by every process forked afterwards and
+// starts one writer process. log_write() formats the message, reserves room
+// in the ring with a CAS and returns; it never waits for the file. The writer
+// drains the ring in batches, adds the timestamp (formatted once per second)
+// and flushes once per batch. When the ring is full new lines are dropped and
+// counted, the writer reports how many were lost.
+
+typedef enum {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR
+} LogLevel;
+
+// Starts logging into file for lines of min_level and above.
+// Returns 0, or -1 if the ring or the writer could not be set up.
+int log_open(FILE *file, LogLevel min_level);
+
+// Lets the writer drain the ring and waits for it (owner process only)
+void log_close(void);
+
+// Queues one log line; does nothing if logging is off or the level is filtered
+void log_write(LogLevel level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void log_vwrite(LogLevel level, const char *fmt, va_list ap);
+
+// Parses "debug", "info", "warn" or "error", returns -1 for anything else
+int log_level_parse(const char *name);
+
+#endif
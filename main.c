@@ -2,28 +2,88 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-
-// Declaration of server and client runner functions
-void run_server(int port, int timeout_seconds, int verbose, FILE *logfile);
-void run_client(int port, int verbose, FILE *logfile);
+#include "server.h"
+#include "client.h"
+#include "log.h"
+#include "bench.h"
+#include "cache.h"
+#include "output.h"
+#include "quota.h"
+#include "spawn.h"
+#include "zygote.h"
+#include "protocol.h"
+#include "trace.h"
 
 void print_help() {
     printf("Use: ./spaasm [OPTIONS]\n");
     printf("  -h            Displays this help message\n");
     printf("  -s            Start the program in server mode\n");
     printf("  -c            Start the program in client mode\n");
+    printf("  -b            Start the program in benchmark mode (load generator)\n");
     printf("  -p PORT       Specify the port number to use\n");
+    printf("  -u PATH       Unix domain socket, @NAME = abstract: the server listens on it as\n"
+           "                well, the client connects to it, the benchmark compares it with TCP\n");
     printf("  -t SECONDS    Set client inactivity timeout in seconds (server only)\n");
+    printf("  -T SECONDS    Kill commands that run longer, 0 = no limit (server only)\n");
+    printf("  -e            Serve all clients from one event-driven process (server only)\n");
+    printf("  -w N          Pre-fork N event-driven workers, 0 = one per CPU (server only)\n");
+    printf("  -q BACKLOG    Set the listen queue length (server only)\n");
+    printf("  -m SESSIONS   Most concurrent sessions (server only)\n");
+    printf("  -I SESSIONS   Most concurrent sessions per client address (server only)\n");
+    printf("  -Q COUNT      Connections that may wait for a session, 0 = turn them away (server only)\n");
+    printf("  -C LIST       Cache the output of these programs, e.g. cat,ls,df (server only)\n");
+    printf("  -a SECONDS    How long a cached output stays valid (server only)\n");
+    printf("  -o POLICY     Clients that stop reading: stall, drop or disconnect, optionally\n"
+           "                with :SECONDS of grace, e.g. drop:5 (server only)\n");
+    printf("  -B KB         Output queued per session before the command is paused (server only)\n");
+    printf("  -R LIST       Limits of every command: cpu=SECONDS, as=SIZE, nofile=N, nice=N,\n"
+           "                io=idle|best-effort[:LEVEL], mem=SIZE, e.g. cpu=10,as=512M (server only)\n");
+    printf("  -G DIR        Run each pipeline in its own cgroup v2 group below DIR (server only)\n");
+    printf("  -Z            Start the commands from a zygote process forked at startup (server only)\n");
+    printf("  -X FILE       Record the phases of every command as Chrome trace JSON in FILE (server only)\n");
+    printf("  -f FILE       Run the commands in FILE (- = stdin) pipelined, then exit (client),\n"
+           "                or use them as the command mix (benchmark)\n");
+    printf("  -n SESSIONS   Concurrent sessions (benchmark only)\n");
+    printf("  -r RATE       Commands per second over all sessions, 0 = unlimited (benchmark only)\n");
+    printf("  -d SECONDS    How long to send commands (benchmark only)\n");
+    printf("  -k COUNT      Reconnect after COUNT commands, 0 = never (benchmark only)\n");
+    printf("  -j FILE       Write the benchmark results as JSON to FILE (benchmark only)\n");
+    printf("  -z            Ask the server to compress large outputs (client only)\n");
+    printf("  -N CHANNELS   Spread the -f batch over CHANNELS logical channels of one\n"
+           "                connection, run at the same time (client only)\n");
     printf("  -v            Enable verbose (debug) output to stderr\n");
     printf("  -l FILE       Log actions to the specified log file\n");
+    printf("  -L LEVEL      Lowest level written to the log: debug, info, warn, error\n");
 }
 
 int main(int argc, char *argv[]) {
     int port = -1;      // Port number to use
-    int is_server = 0, is_client = 0;   // Role flags
+    int is_server = 0, is_client = 0, is_bench = 0; // Role flags
     int timeout_seconds = 30;   // Default timeout for server inactivity
+    int command_timeout = 0;    // Deadline of one command line (0 = none)
     int verbose = 0;    // Enable verbose/debug output
     char *log_filename = NULL;  // File name for logging (optional)
+    int log_level = LOG_LEVEL_INFO; // Lowest level written to the log file
+    int event_mode = 0; // Use the epoll reactor instead of a process per client
+    int workers = -1;   // Number of pre-forked workers (-1 = no worker pool)
+    int backlog = DEFAULT_BACKLOG;  // Listen queue length
+    int max_sessions = 0;       // Concurrent sessions (0 = table capacity)
+    int max_per_ip = 0;         // Concurrent sessions per address (0 = no limit)
+    int admission_queue = 0;    // Connections waiting for a session
+    char *batch_file = NULL;    // Batch of commands for the client (optional)
+    char *cache_commands = NULL;    // Programs whose output the server caches (optional)
+    int cache_ttl = CACHE_DEFAULT_TTL;  // Seconds a cached output stays valid
+    OutputPolicy output_policy = OUTPUT_STALL;  // What happens to clients that stop reading
+    int slow_seconds = OUTPUT_SLOW_SECONDS;     // Grace before the policy applies
+    size_t output_buffer = OUTPUT_BUFFER_SIZE;  // Output queued per session
+    char *limits = NULL;        // Resource limits of every command (optional)
+    char *cgroup_dir = NULL;    // cgroup v2 directory for the commands (optional)
+    char *trace_file = NULL;    // Span trace of the commands (optional)
+    char *unix_path = NULL;     // Unix domain socket next to TCP (optional)
+    int zygote = 0;     // Commands are started by the zygote
+    int compress = 0;   // Client asks for compressed output
+    int channels = 0;   // Logical channels of the client batch (0 = none)
+    BenchConfig bcfg = { .sessions = 16, .duration = 10 }; // Benchmark settings
 
     // Parse command-line arguments
     for (int i = 1; i < argc; i++) {
@@ -35,6 +95,23 @@ int main(int argc, char *argv[]) {
             is_server = 1;
         } else if (!strcmp(argv[i], "-c")) {
             is_client = 1;
+        } else if (!strcmp(argv[i], "-b")) {
+            is_bench = 1;
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            // Benchmark: concurrent sessions
+            bcfg.sessions = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            // Benchmark: target command rate
+            bcfg.rate = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            // Benchmark: run time
+            bcfg.duration = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) {
+            // Benchmark: commands per connection
+            bcfg.per_connection = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            // Benchmark: JSON report
+            bcfg.json_file = argv[++i];
         } else if (!strcmp(argv[i], "-p")) {
             // Parse port number
             if (i + 1 < argc) {
@@ -43,24 +120,121 @@ int main(int argc, char *argv[]) {
                 fprintf(stderr, "Missing port for -p\n");
                 return 1;
             }
+        } else if (strcmp(argv[i], "-u") == 0 && i + 1 < argc) {
+            // Unix domain socket
+            unix_path = argv[++i];
         } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
             // Parse inactivity timeout for server
             timeout_seconds = atoi(argv[++i]);
+            if (timeout_seconds <= 0) {
+                fprintf(stderr, "Timeout must be at least 1 second\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-T") == 0 && i + 1 < argc) {
+            // Parse the per-command deadline
+            command_timeout = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-e") == 0) {
+            // Event-driven server mode
+            event_mode = 1;
+        } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            // Worker pool size, 0 picks one worker per CPU
+            workers = atoi(argv[++i]);
+            if (workers <= 0) workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        } else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+            // Listen backlog
+            backlog = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            // Admission: concurrent sessions
+            max_sessions = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-I") == 0 && i + 1 < argc) {
+            // Admission: sessions per client address
+            max_per_ip = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-Q") == 0 && i + 1 < argc) {
+            // Admission: queue for excess connections
+            admission_queue = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-C") == 0 && i + 1 < argc) {
+            // Output cache allowlist
+            cache_commands = argv[++i];
+        } else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+            // Output cache lifetime
+            cache_ttl = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            // Backpressure policy
+            if (output_policy_parse(argv[++i], &output_policy, &slow_seconds) < 0) {
+                fprintf(stderr, "Unknown output policy %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-B") == 0 && i + 1 < argc) {
+            // Output queue per session
+            output_buffer = (size_t)atoi(argv[++i]) * 1024;
+        } else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc) {
+            // Per-command resource limits
+            limits = argv[++i];
+        } else if (strcmp(argv[i], "-G") == 0 && i + 1 < argc) {
+            // cgroup v2 placement of the commands
+            cgroup_dir = argv[++i];
+        } else if (strcmp(argv[i], "-Z") == 0) {
+            // Zygote launcher
+            zygote = 1;
+        } else if (strcmp(argv[i], "-X") == 0 && i + 1 < argc) {
+            // Span trace file
+            trace_file = argv[++i];
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            // Batch file for the client
+            batch_file = argv[++i];
+        } else if (strcmp(argv[i], "-z") == 0) {
+            // Compressed output for the client
+            compress = 1;
+        } else if (strcmp(argv[i], "-N") == 0 && i + 1 < argc) {
+            // Logical channels for the client batch
+            channels = atoi(argv[++i]);
+            if (channels < 0 || channels > PROTO_MAX_CHANNELS) {
+                fprintf(stderr, "Channels must be between 0 and %d\n", PROTO_MAX_CHANNELS);
+                return 1;
+            }
         } else if (strcmp(argv[i], "-v") == 0) {
             // Enable verbose output
             verbose = 1;
         } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
             // Parse log filename
             log_filename = argv[++i];
+        } else if (strcmp(argv[i], "-L") == 0 && i + 1 < argc) {
+            // Parse log level
+            log_level = log_level_parse(argv[++i]);
+            if (log_level < 0) {
+                fprintf(stderr, "Unknown log level %s\n", argv[i]);
+                return 1;
+            }
         }
     }
 
-    // Ensure a valid port is specified
-    if (port == -1) {
+    // Ensure a valid port is specified; clients may use the Unix socket instead
+    if (port == -1 && !(unix_path && (is_client || is_bench))) {
         fprintf(stderr, "Port not specified (-p)\n");
         return 1;
     }
 
+    if (!is_client && !is_bench) {
+        // Limits of the commands, checked before anything runs; the zygote
+        // applies them too, so they come first
+        if (quota_init(limits, cgroup_dir) < 0) return 1;
+
+        // The zygote is forked before the log writer, the client table and
+        // the sessions exist, so it stays small
+        if (zygote) {
+            if (zygote_start() < 0) {
+                perror("zygote");
+                return 1;
+            }
+            spawn_method = SPAWN_ZYGOTE;
+        }
+
+        if (trace_file && trace_open(trace_file) < 0) {
+            perror("fopen trace");
+            return 1;
+        }
+    }
+
     // Open logfile if provided
     FILE *logfile = NULL;
     if (log_filename) {
@@ -69,20 +243,65 @@ int main(int argc, char *argv[]) {
             perror("fopen log");
             exit(1);
         }
+        // Lines are written by a separate writer process
+        if (log_open(logfile, log_level) < 0) {
+            perror("log_open");
+            exit(1);
+        }
     }
 
+    ServerConfig cfg = {
+        .port = port,
+        .timeout_seconds = timeout_seconds,
+        .command_timeout = command_timeout,
+        .verbose = verbose,
+        .event_mode = event_mode,
+        .workers = workers > 0 ? workers : 0,
+        .backlog = backlog,
+        .max_sessions = max_sessions,
+        .max_per_ip = max_per_ip,
+        .admission_queue = admission_queue,
+        .cache_commands = cache_commands,
+        .cache_ttl = cache_ttl,
+        .output_policy = output_policy,
+        .slow_seconds = slow_seconds,
+        .output_buffer = output_buffer,
+        .unix_path = unix_path,
+    };
+
+    ClientConfig ccfg = {
+        .port = port,
+        .unix_path = unix_path,
+        .verbose = verbose,
+        .batch_file = batch_file,
+        .compress = compress,
+        .channels = channels,
+    };
+    int result = 0;
+
     // Start client or server mode based on arguments
-    if (is_client) {
-        run_client(port, verbose, logfile);
+    if (is_bench) {
+        // The benchmark replays the -f file as its command mix
+        bcfg.port = port;
+        bcfg.unix_path = unix_path;
+        bcfg.verbose = verbose;
+        bcfg.mix_file = batch_file;
+        result = run_bench(&bcfg);
+    } else if (is_client) {
+        result = run_client(&ccfg);
     } else if (is_server) {
-        run_server(port, timeout_seconds, verbose, logfile);
+        run_server(&cfg);
     } else {
         // Default to server mode if neither -c nor -s specified
-        run_server(port, timeout_seconds, verbose, logfile);
+        run_server(&cfg);
     }
 
+    // Spans still buffered by the server go out first
+    trace_close();
+
     // Close log file if it was opened
+    log_close();
     if (logfile) fclose(logfile);
 
-    return 0;
+    return result;
 }
\ No newline at end of file
@@ -0,0 +1,509 @@
+#define _GNU_SOURCE
+
+#include "output.h"
+#include "protocol.h"
+#include "shell.h"
+#include "table.h"
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
+// Set once splice() turned out not to work here, skips retrying it every time
+static int splice_unsupported = 0;
+
+// Backpressure settings (output_configure)
+static OutputPolicy policy = OUTPUT_STALL;
+static size_t buffer_limit = OUTPUT_BUFFER_SIZE;
+static int slow_ms = OUTPUT_SLOW_SECONDS * 1000;
+
+static const char *policy_names[] = { "stall", "drop", "disconnect" };
+
+
+// Sets the backpressure policy, the queue bound and the grace period
+void output_configure(OutputPolicy p, size_t buffer_size, int slow_seconds) {
+    policy = p;
+    if (buffer_size > 0) buffer_limit = buffer_size;
+    if (slow_seconds >= 0) slow_ms = slow_seconds * 1000;
+}
+
+// Parses "stall", "drop" or "disconnect[:SECONDS]"
+int output_policy_parse(const char *text, OutputPolicy *p, int *slow_seconds) {
+    const char *colon = strchr(text, ':');
+    size_t len = colon ? (size_t)(colon - text) : strlen(text);
+
+    for (int i = 0; i < (int)(sizeof(policy_names) / sizeof(policy_names[0])); i++) {
+        if (strlen(policy_names[i]) != len || strncmp(text, policy_names[i], len) != 0) continue;
+        *p = (OutputPolicy)i;
+        if (colon) *slow_seconds = atoi(colon + 1);
+        return 0;
+    }
+    return -1;
+}
+
+// Enlarges a command output pipe so data can be moved in big chunks
+void output_pipe_setup(int pipe_fd) {
+    // Fails with EPERM above pipe-max-size or the per-user limit; the
+    // default 64 KB pipe still works, so the error is ignored
+    fcntl(pipe_fd, F_SETPIPE_SZ, OUTPUT_PIPE_SIZE);
+}
+
+
+// Bytes waiting in the session's output queue
+size_t session_output_pending(const Session *s) {
+    return s->outlen - s->outpos;
+}
+
+// Adds bytes to the end of the output queue
+static int queue_append(Session *s, const void *buf, size_t len) {
+    if (len == 0) return 0;
+
+    // Reuse the space of what was already sent before growing
+    if (s->outlen + len > s->outcap && s->outpos > 0) {
+        memmove(s->outbuf, s->outbuf + s->outpos, s->outlen - s->outpos);
+        s->outlen -= s->outpos;
+        s->outpos = 0;
+    }
+    if (s->outlen + len > s->outcap) {
+        size_t cap = s->outcap ? s->outcap : 4096;
+        while (cap < s->outlen + len) cap *= 2;
+        char *grown = realloc(s->outbuf, cap);
+        if (!grown) return -1;
+        s->outbuf = grown;
+        s->outcap = cap;
+    }
+
+    memcpy(s->outbuf + s->outlen, buf, len);
+    s->outlen += len;
+    return 0;
+}
+
+// Gives up on a client that is gone or too slow. The socket is shut down, so
+// the reactor that shares it with a command runner sees the end as well.
+static int session_fail(Session *s, const char *why) {
+    if (!s->failed) {
+        s->failed = 1;
+        shutdown(s->fd, SHUT_RDWR);
+        if (s->verbose) fprintf(stderr, "[DEBUG] Output to the client stopped: %s\n", why);
+    }
+    return -1;
+}
+
+// Sends as much of the queue as the socket takes now, without waiting
+int session_flush(Session *s) {
+    if (s->failed) return -1;
+
+    while (s->outpos < s->outlen) {
+        ssize_t n = send(s->fd, s->outbuf + s->outpos, s->outlen - s->outpos, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return session_fail(s, strerror(errno));
+        }
+        s->outpos += n;
+    }
+
+    // An empty queue is freed so idle sessions don't keep it around
+    free(s->outbuf);
+    s->outbuf = NULL;
+    s->outpos = s->outlen = s->outcap = 0;
+    return 0;
+}
+
+// Returns 1 if a wait for the client should end: another client aborted the session
+static int wait_interrupted(Session *s) {
+    if (!client_slot_abort_requested(s->index, s->session_id)) return 0;
+    session_fail(s, "session aborted");
+    return 1;
+}
+
+// Waits until at most limit bytes are queued. The grace period of the
+// disconnect policy counts from the last time the client took any data.
+static int session_drain(Session *s, size_t limit) {
+    uint64_t progress = stats_now_ms();
+
+    while (1) {
+        size_t before = session_output_pending(s);
+        if (session_flush(s) < 0) return -1;
+        size_t queued = session_output_pending(s);
+        if (queued <= limit) return 0;
+        if (queued < before) progress = stats_now_ms();
+
+        int timeout = -1;
+        if (policy == OUTPUT_DISCONNECT) {
+            long long left = (long long)(progress + slow_ms) - (long long)stats_now_ms();
+            if (left <= 0) return session_fail(s, "client too slow");
+            timeout = (int)left;
+        }
+
+        struct pollfd pfd = { s->fd, POLLOUT, 0 };
+        if (poll(&pfd, 1, timeout) < 0) {
+            if (errno != EINTR) return session_fail(s, strerror(errno));
+            if (wait_interrupted(s)) return -1;
+        }
+    }
+}
+
+// Sends the buffers in order. What the socket does not take is queued; outside
+// the reactor the call then waits until the queue is back within its bound.
+// Nothing is counted in the client table (session_send does).
+static int session_push(Session *s, struct iovec *iov, int cnt) {
+    if (s->failed) return -1;
+
+    // Straight to the socket unless older output is still queued
+    size_t sent = 0;
+    if (session_output_pending(s) == 0) {
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = cnt };
+        ssize_t n;
+        do n = sendmsg(s->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        while (n < 0 && errno == EINTR);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) return session_fail(s, strerror(errno));
+        if (n > 0) sent = n;
+    }
+
+    for (int i = 0; i < cnt; i++) {
+        size_t skip = sent < iov[i].iov_len ? sent : iov[i].iov_len;
+        sent -= skip;
+        if (queue_append(s, (char *)iov[i].iov_base + skip, iov[i].iov_len - skip) < 0)
+            return session_fail(s, "out of memory");
+    }
+
+    if (s->deferred) return 0;
+    return session_drain(s, buffer_limit);
+}
+
+// session_push() that counts the bytes as output of the client
+static int session_send(Session *s, struct iovec *iov, int cnt) {
+    size_t total = 0;
+    for (int i = 0; i < cnt; i++) total += iov[i].iov_len;
+
+    if (s->failed) return -1;
+    stats_output(s->index, total);
+    return session_push(s, iov, cnt);
+}
+
+
+// Writes one frame; header and payload leave in a single sendmsg()
+static int write_frame(Session *s, int type, int flags, const void *buf, size_t len, int status) {
+    FrameHeader h;
+    frame_pack(&h, type, s->request_id, len, status);
+    h.flags = htons(flags);
+
+    struct iovec iov[2] = {
+        { &h, sizeof(h) },
+        { (void *)buf, len },
+    };
+    return session_send(s, iov, 2);
+}
+
+// Returns the session's compressor, creating it on first use
+static z_stream *session_deflater(Session *s) {
+    if (!s->deflater) {
+        z_stream *zs = calloc(1, sizeof(*zs));
+        if (!zs) return NULL;
+        // Fastest level: the link is slow, but the server must keep up with the commands
+        if (deflateInit(zs, Z_BEST_SPEED) != Z_OK) {
+            free(zs);
+            return NULL;
+        }
+        s->deflater = zs;
+    }
+    return s->deflater;
+}
+
+// Sends buf as compressed DATA frames. Each call ends with a sync flush, so
+// the client can show everything sent so far without waiting for the end.
+static int write_compressed(Session *s, const void *buf, size_t len) {
+    static unsigned char out[OUTPUT_COPY_SIZE];
+
+    z_stream *zs = session_deflater(s);
+    if (!zs) return write_frame(s, FRAME_DATA, 0, buf, len, 0); // raw frames still work
+
+    zs->next_in = (Bytef *)buf;
+    zs->avail_in = len;
+    do {
+        zs->next_out = out;
+        zs->avail_out = sizeof(out);
+        if (deflate(zs, Z_SYNC_FLUSH) == Z_STREAM_ERROR) return -1;
+
+        size_t n = sizeof(out) - zs->avail_out;
+        if (n > 0 && write_frame(s, FRAME_DATA, FRAME_FLAG_DEFLATE, out, n, 0) < 0) return -1;
+    } while (zs->avail_out == 0);
+    return 0;
+}
+
+// Frees the session's output queue and compressor
+void session_output_free(Session *s) {
+    free(s->outbuf);
+    s->outbuf = NULL;
+    s->outpos = s->outlen = s->outcap = 0;
+
+    if (!s->deflater) return;
+    deflateEnd(s->deflater);
+    free(s->deflater);
+    s->deflater = NULL;
+}
+
+// Sends bytes exactly as they are, in either mode
+int session_write_raw(Session *s, const void *buf, size_t len) {
+    struct iovec iov = { (void *)buf, len };
+    return session_send(s, &iov, 1);
+}
+
+// Session output: raw bytes in text mode, FRAME_DATA frames in framed mode
+int session_write(Session *s, const void *buf, size_t len) {
+    if (!s->framed) return session_write_raw(s, buf, len);
+    if (len == 0) return 0;
+    if (s->compress && len >= PROTO_COMPRESS_MIN) return write_compressed(s, buf, len);
+    return write_frame(s, FRAME_DATA, 0, buf, len, 0);
+}
+
+int session_printf(Session *s, const char *fmt, ...) {
+    char buf[1024];
+    va_list ap;
+
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+
+    if (n < 0) return -1;
+    if (n >= (int)sizeof(buf)) n = sizeof(buf) - 1;
+    return session_write(s, buf, n);
+}
+
+// Output that belongs to no request: raw in text mode, uncompressed DATA
+// frames with request id 0 in framed mode
+int session_write_unsolicited(Session *s, const void *buf, size_t len) {
+    if (!s->framed) return session_write_raw(s, buf, len);
+    if (len == 0) return 0;
+
+    uint32_t request_id = s->request_id;
+    s->request_id = 0;
+    int r = write_frame(s, FRAME_DATA, 0, buf, len, 0);
+    s->request_id = request_id;
+    return r;
+}
+
+// Passes frames built by a channel process on (channel.c); they were
+// counted when the channel wrote them
+int session_write_frames(Session *s, const void *buf, size_t len) {
+    struct iovec iov = { (void *)buf, len };
+    return session_push(s, &iov, 1);
+}
+
+
+// Output kept by session_forward_copy()
+typedef struct {
+    char *buf;
+    size_t cap, kept;
+    int fits;       // Everything read so far is in buf
+} OutputCopy;
+
+// Moves one chunk of avail bytes out of the pipe; only this process reads it,
+// so they will all be there. With nothing queued the bytes are spliced
+// straight into the socket (framed: behind a FRAME_DATA header), what the
+// socket does not take right away is read into the queue. Kept and
+// compressed output goes through user space instead.
+// Returns the bytes taken from the pipe or -1.
+static long long forward_chunk(Session *s, int pipe_fd, size_t avail, OutputCopy *copy) {
+    static char chunk[OUTPUT_COPY_SIZE];
+
+    if (copy || (s->framed && s->compress && avail >= PROTO_COMPRESS_MIN)) {
+        // Read straight into the copy while it has room
+        char *buf = chunk;
+        size_t room = sizeof(chunk);
+        if (copy && copy->fits && copy->kept < copy->cap) {
+            buf = copy->buf + copy->kept;
+            room = copy->cap - copy->kept;
+        }
+
+        ssize_t n = read(pipe_fd, buf, avail < room ? avail : room);
+        if (n < 0 && errno == EINTR) return 0;
+        if (n <= 0) return -1;
+
+        if (copy && buf == chunk) copy->fits = 0;
+        else if (copy) copy->kept += n;
+        return session_write(s, buf, n) < 0 ? -1 : n;
+    }
+
+    int direct = session_output_pending(s) == 0 && !splice_unsupported;
+    if (!direct && avail > OUTPUT_COPY_SIZE) avail = OUTPUT_COPY_SIZE; // the queue grows by one chunk at most
+    if (avail > PROTO_MAX_PAYLOAD) avail = PROTO_MAX_PAYLOAD;
+    size_t left = avail;
+
+    if (s->framed) {
+        FrameHeader h;
+        frame_pack(&h, FRAME_DATA, s->request_id, avail, 0);
+
+        ssize_t n = 0;
+        if (direct) {
+            n = send(s->fd, &h, sizeof(h), MSG_MORE | MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                return session_fail(s, strerror(errno));
+            if (n < 0) n = 0;
+        }
+        if ((size_t)n < sizeof(h)) {
+            if (queue_append(s, (char *)&h + n, sizeof(h) - n) < 0) return session_fail(s, "out of memory");
+            direct = 0;
+        }
+        stats_output(s->index, sizeof(h));
+    }
+
+    // splice() moves pipe pages straight into the socket, no user-space copy
+    while (direct && left > 0) {
+        ssize_t n = splice(pipe_fd, NULL, s->fd, NULL, left, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            left -= n;
+            stats_output(s->index, n);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break; // socket full
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            // Target (or kernel) can't splice, nothing was consumed
+            splice_unsupported = 1;
+            break;
+        }
+        return session_fail(s, n < 0 ? strerror(errno) : "output pipe closed");
+    }
+
+    // The rest of the chunk waits in the queue
+    while (left > 0) {
+        ssize_t n = read(pipe_fd, chunk, left < sizeof(chunk) ? left : sizeof(chunk));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        if (queue_append(s, chunk, n) < 0) return session_fail(s, "out of memory");
+        stats_output(s->index, n);
+        left -= n;
+    }
+    return avail;
+}
+
+// Streams the pipe until EOF. The pipe is only read while the queue has room,
+// so a slow client pauses the command instead of growing the queue. Once the
+// queue stayed full for the grace period the policy takes over.
+static long long forward_loop(Session *s, int pipe_fd, OutputCopy *copy) {
+    static char discard[OUTPUT_COPY_SIZE];
+    long long total = 0, dropped = 0;
+    uint64_t full_since = 0;    // Last progress while the queue was full, 0 = it has room
+    uint64_t first_byte = trace_begin();    // Until the command wrote something
+    int eof = 0;
+    int deferred = s->deferred;
+
+    s->deferred = 1; // writes below only queue, this loop does the waiting
+    while (!s->failed) {
+        size_t before = session_output_pending(s);
+        if (session_flush(s) < 0) break;
+        size_t queued = session_output_pending(s);
+        if (eof && queued == 0) break;
+
+        uint64_t now = stats_now_ms();
+        int full = queued >= buffer_limit;
+        if (!full) full_since = 0;
+        else if (!full_since || queued < before) full_since = now;
+
+        int overdue = full && now - full_since >= (uint64_t)slow_ms;
+        if (overdue && policy == OUTPUT_DISCONNECT) {
+            session_fail(s, "client too slow");
+            break;
+        }
+        int timeout = full && !overdue && policy != OUTPUT_STALL ? (int)(full_since + slow_ms - now) : -1;
+        int read_pipe = !eof && (!full || (overdue && policy == OUTPUT_DROP));
+
+        struct pollfd pfd[2] = {
+            { read_pipe ? pipe_fd : -1, POLLIN, 0 },
+            { queued > 0 ? s->fd : -1, POLLOUT, 0 },
+        };
+        if (poll(pfd, 2, timeout) < 0) {
+            if (errno == EINTR && !wait_interrupted(s)) continue;
+            session_fail(s, strerror(errno));
+            break;
+        }
+        if (!pfd[0].revents) continue;
+
+        int avail = 0;
+        if (ioctl(pipe_fd, FIONREAD, &avail) < 0) break;
+        if (avail <= 0) {
+            if (pfd[0].revents & (POLLHUP | POLLERR)) eof = 1; // the command closed its output
+            continue;
+        }
+        if (first_byte) {
+            trace_end(s, "first byte", first_byte, NULL);
+            first_byte = 0;
+        }
+
+        if (full) {
+            // Drop policy: the command keeps running, what it writes is lost
+            ssize_t n = read(pipe_fd, discard, avail < (int)sizeof(discard) ? avail : (int)sizeof(discard));
+            if (n < 0 && errno != EINTR) break;
+            if (n > 0) dropped += n;
+            if (copy) copy->fits = 0;
+            continue;
+        }
+
+        long long n = forward_chunk(s, pipe_fd, avail, copy);
+        if (n < 0) break;
+        total += n;
+    }
+    s->deferred = deferred;
+
+    if (dropped > 0 && !s->failed) {
+        if (s->verbose) fprintf(stderr, "[DEBUG] Dropped %lld bytes of output for a slow client\n", dropped);
+        session_printf(s, "\n[%lld bytes of output dropped, the client was too slow]\n", dropped);
+    }
+    return s->failed ? -1 : total;
+}
+
+// Streams a command's output pipe to the session until EOF
+long long session_forward(Session *s, int pipe_fd) {
+    return forward_loop(s, pipe_fd, NULL);
+}
+
+// Streams the pipe to the session, keeping a copy of the output
+long long session_forward_copy(Session *s, int pipe_fd, char *copy, size_t cap, size_t *copied) {
+    OutputCopy c = { .buf = copy, .cap = cap, .fits = 1 };
+    long long total = forward_loop(s, pipe_fd, &c);
+
+    *copied = c.fits ? c.kept : cap + 1;
+    return total;
+}
+
+// Marks the end of the response to the current command
+int session_end(Session *s, int status) {
+    int r;
+    if (!s->framed) {
+        r = session_write_raw(s, PROTO_END_MARKER, strlen(PROTO_END_MARKER));
+    } else {
+        // The next response starts a new compressed stream
+        if (s->deflater) deflateReset(s->deflater);
+        r = write_frame(s, FRAME_END, 0, NULL, 0, status);
+    }
+
+    // A runner exits right after, so the response must leave the queue first
+    if (r < 0 || s->deferred) return r;
+    return session_drain(s, 0);
+}
+
+// Sends a last message before the server closes the connection
+int session_notice(Session *s, const char *msg) {
+    // Best effort: the connection is closed next, nobody waits for room
+    int deferred = s->deferred;
+    s->deferred = 1;
+
+    int r;
+    if (!s->framed) r = session_write_raw(s, msg, strlen(msg));
+    else r = write_frame(s, FRAME_CLOSE, 0, msg, strlen(msg), 0);
+
+    s->deferred = deferred;
+    return r;
+}
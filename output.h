@@ -0,0 +1,76 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h> // For size_t
+
+#define OUTPUT_PIPE_SIZE (1024 * 1024) // Requested capacity of command output pipes
+#define OUTPUT_COPY_SIZE (64 * 1024)   // Buffer for reads from the pipe
+#define OUTPUT_BUFFER_SIZE (256 * 1024) // Bytes queued per session unless -B is given
+#define OUTPUT_SLOW_SECONDS 10          // Grace for a client that stopped reading
+
+// Client sockets are non-blocking. Whatever a socket does not take right away
+// waits in the session's output queue. While the queue is full the command's
+// pipe is not read, so the command itself blocks on its full pipe and only
+// that session waits. Once the client has kept the queue full for the grace
+// period, the policy decides what happens.
+typedef enum {
+    OUTPUT_STALL,       // Keep waiting for the client
+    OUTPUT_DROP,        // Discard command output until the client catches up
+    OUTPUT_DISCONNECT,  // Close the connection
+} OutputPolicy;
+
+// Sets the policy, the queue bound in bytes and the grace in seconds.
+// Must be called before any session starts.
+void output_configure(OutputPolicy policy, size_t buffer_size, int slow_seconds);
+
+// Parses "stall", "drop" or "disconnect", optionally followed by ":SECONDS"
+// for the grace period. Returns 0, or -1 for an unknown policy.
+int output_policy_parse(const char *text, OutputPolicy *policy, int *slow_seconds);
+
+// Enlarges a command output pipe so data can be moved in big chunks
+void output_pipe_setup(int pipe_fd);
+
+struct Session;
+
+// Session output: raw bytes in text mode, FRAME_DATA frames in framed mode
+int session_write(struct Session *s, const void *buf, size_t len);
+int session_printf(struct Session *s, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+// Output outside any response (background jobs): raw bytes in text mode,
+// FRAME_DATA frames with request id 0 in framed mode
+int session_write_unsolicited(struct Session *s, const void *buf, size_t len);
+
+// Framed mode: sends whole frames of a channel (channel.c) as they are,
+// without counting them in the client table again
+int session_write_frames(struct Session *s, const void *buf, size_t len);
+
+// Sends bytes exactly as they are, in either mode (protocol handshake)
+int session_write_raw(struct Session *s, const void *buf, size_t len);
+
+// Streams a command's output pipe to the session until EOF
+long long session_forward(struct Session *s, int pipe_fd);
+
+// Like session_forward(), but through user space so that the first cap
+// bytes of the output are also kept in copy. *copied is set to the bytes
+// kept, or to cap + 1 if the output was longer or partly dropped.
+long long session_forward_copy(struct Session *s, int pipe_fd, char *copy, size_t cap, size_t *copied);
+
+// Marks the end of the response to the current command. Outside the reactor
+// it also waits until the whole response has left the queue.
+int session_end(struct Session *s, int status);
+
+// Sends a last message before the server closes the connection
+int session_notice(struct Session *s, const char *msg);
+
+// Bytes waiting in the session's output queue
+size_t session_output_pending(const struct Session *s);
+
+// Sends as much of the queue as the socket takes now, without waiting.
+// Returns 0, or -1 if the client is gone.
+int session_flush(struct Session *s);
+
+// Releases the session's output state (queue and compressor)
+void session_output_free(struct Session *s);
+
+#endif
@@ -0,0 +1,233 @@
+#include "parser.h"
+#include <stdint.h>
+#include <string.h>
+
+#define ARENA_ALIGN 8   // Alignment of every node
+
+#define ERR_TOO_LONG "Error: command line too long\n"
+#define ERR_NO_FILE "Error: missing file name after a redirection\n"
+
+// Characters that end an unquoted word, or start a quote or escape
+enum { CH_WORD = 0, CH_END, CH_SPECIAL };
+static const unsigned char char_class[256] = {
+    ['\0'] = CH_END, [' '] = CH_END, ['\t'] = CH_END, ['\r'] = CH_END, ['\n'] = CH_END,
+    [';'] = CH_END, ['&'] = CH_END, ['|'] = CH_END, ['<'] = CH_END, ['>'] = CH_END,
+    ['\''] = CH_SPECIAL, ['"'] = CH_SPECIAL, ['\\'] = CH_SPECIAL,
+};
+
+// Argument collected until its command ends and argv is built
+typedef struct ArgNode {
+    char *word;
+    struct ArgNode *next;
+} ArgNode;
+
+// Parser state while walking the line
+typedef struct {
+    Arena *arena;
+    AstSequence *seq;
+    AstPipeline **pipeline_tail;
+    AstPipeline *pipeline;      // Pipeline being built, NULL between pipelines
+    AstCommand **command_tail;
+    ArgNode *args, **args_tail; // Words of the command being built
+    int argc;
+    int piped;                  // After '|': the next command must not be empty
+    const char **target;        // Redirection waiting for its file name
+} Parser;
+
+
+void arena_init(Arena *a, void *buf, size_t size) {
+    a->base = buf;
+    a->size = size;
+    a->used = 0;
+}
+
+void *arena_alloc(Arena *a, size_t size) {
+    uintptr_t base = (uintptr_t)a->base;
+    size_t start = ((base + a->used + ARENA_ALIGN - 1) & ~(uintptr_t)(ARENA_ALIGN - 1)) - base;
+    if (start > a->size || size > a->size - start) return NULL;
+    a->used = start + size;
+    return a->base + start;
+}
+
+
+// Starts a pipeline unless one is already being built
+static int begin_pipeline(Parser *p) {
+    if (p->pipeline) return 0;
+
+    AstPipeline *pl = arena_alloc(p->arena, sizeof(*pl));
+    if (!pl) return -1;
+    memset(pl, 0, sizeof(*pl));
+    p->pipeline = pl;
+    p->command_tail = &pl->commands;
+    return 0;
+}
+
+// Turns the collected words into the next command of the pipeline
+static const char *end_command(Parser *p) {
+    if (p->argc == 0) return "Error: empty command in pipeline\n";
+
+    AstCommand *cmd = arena_alloc(p->arena, sizeof(*cmd));
+    char **argv = arena_alloc(p->arena, (p->argc + 1) * sizeof(char *));
+    if (!cmd || !argv) return ERR_TOO_LONG;
+
+    int i = 0;
+    for (ArgNode *n = p->args; n; n = n->next) argv[i++] = n->word;
+    argv[i] = NULL;
+
+    cmd->argv = argv;
+    cmd->argc = p->argc;
+    cmd->next = NULL;
+    *p->command_tail = cmd;
+    p->command_tail = &cmd->next;
+    p->pipeline->count++;
+
+    p->args = NULL;
+    p->args_tail = &p->args;
+    p->argc = 0;
+    p->piped = 0;
+    return NULL;
+}
+
+// Adds the pipeline being built to the sequence (at ';', '&' and the end)
+static const char *end_pipeline(Parser *p) {
+    if (p->target) return ERR_NO_FILE;
+    if (!p->pipeline) return NULL; // nothing since the last ';'
+
+    if (p->argc > 0 || p->piped) {
+        const char *err = end_command(p);
+        if (err) return err;
+    }
+    if (p->pipeline->count == 0) return "Error: missing command\n"; // only redirections
+
+    *p->pipeline_tail = p->pipeline;
+    p->pipeline_tail = &p->pipeline->next;
+    p->seq->count++;
+    p->pipeline = NULL;
+    return NULL;
+}
+
+// Copies one word to the top of the arena, resolving quotes and escapes.
+// *pos is left on the character that ended the word.
+static const char *read_word(Parser *p, const char **pos, char **word) {
+    Arena *a = p->arena;
+    char *start = a->base + a->used;
+    char *end = a->base + a->size;
+    char *out = start;
+    const char *c = *pos;
+    char quote = 0;
+
+    while (1) {
+        if (quote) {
+            if (*c == '\0') break;
+            if (*c == quote) {
+                quote = 0;
+                c++;
+                continue;
+            }
+            if (quote == '"' && *c == '\\' && c[1] && strchr("\"\\$`", c[1])) c++;
+        } else if (char_class[(unsigned char)*c] == CH_WORD) {
+            // plain character, the common case
+        } else if (char_class[(unsigned char)*c] == CH_END) {
+            break;
+        } else if (*c == '\'' || *c == '"') {
+            quote = *c++;
+            continue;
+        } else if (*c == '\\' && c[1]) {
+            c++;
+        }
+
+        if (out == end) return ERR_TOO_LONG;
+        *out++ = *c++;
+    }
+
+    if (quote) return "Error: unterminated quote\n";
+    if (out == end) return ERR_TOO_LONG;
+    *out++ = '\0';
+
+    a->used = out - a->base;
+    *word = start;
+    *pos = c;
+    return NULL;
+}
+
+// Parses line into seq
+const char *parse_command_line(const char *line, Arena *arena, AstSequence *seq) {
+    Parser p = { .arena = arena, .seq = seq };
+    seq->pipelines = NULL;
+    seq->count = 0;
+    p.pipeline_tail = &seq->pipelines;
+    p.args_tail = &p.args;
+
+    const char *c = line;
+    const char *err;
+
+    while (*c) {
+        switch (*c) {
+        case ' ': case '\t': case '\r': case '\n':
+            c++;
+            continue;
+
+        case '#':
+            c += strlen(c); // comment up to the end of the line
+            continue;
+
+        case ';':
+            if ((err = end_pipeline(&p))) return err;
+            c++;
+            continue;
+
+        case '&':
+            if (c[1] == '&') return "Error: '&&' is not supported\n";
+            if (!p.pipeline) return "Error: missing command before '&'\n";
+            p.pipeline->background = 1;
+            if ((err = end_pipeline(&p))) return err;
+            c++;
+            continue;
+
+        case '|':
+            if (p.target) return ERR_NO_FILE;
+            if (!p.pipeline || p.argc == 0) return "Error: empty command in pipeline\n";
+            if (p.pipeline->output) return "Error: only the last command of a pipeline can write to a file\n";
+            if ((err = end_command(&p))) return err;
+            p.piped = 1;
+            c++;
+            continue;
+
+        case '<':
+            if (p.target) return ERR_NO_FILE;
+            if (begin_pipeline(&p) < 0) return ERR_TOO_LONG;
+            if (p.pipeline->count > 0) return "Error: only the first command of a pipeline can read a file\n";
+            p.target = &p.pipeline->input;
+            c++;
+            continue;
+
+        case '>':
+            if (p.target) return ERR_NO_FILE;
+            if (begin_pipeline(&p) < 0) return ERR_TOO_LONG;
+            p.pipeline->append = c[1] == '>';
+            p.target = &p.pipeline->output;
+            c += p.pipeline->append ? 2 : 1;
+            continue;
+        }
+
+        char *word;
+        if (begin_pipeline(&p) < 0) return ERR_TOO_LONG;
+        if ((err = read_word(&p, &c, &word))) return err;
+
+        if (p.target) {
+            *p.target = word;
+            p.target = NULL;
+            continue;
+        }
+
+        ArgNode *n = arena_alloc(arena, sizeof(*n));
+        if (!n) return ERR_TOO_LONG;
+        n->word = word;
+        n->next = NULL;
+        *p.args_tail = n;
+        p.args_tail = &n->next;
+        p.argc++;
+    }
+
+    return end_pipeline(&p);
+}
@@ -0,0 +1,66 @@
+#ifndef PARSER_H
+#define PARSER_H
+
+#include <stddef.h> // For size_t
+
+// Command line parser
+//
+// One pass over the line builds the whole tree inside a caller-provided
+// arena: no malloc() per command, and everything is dropped at once by
+// reinitializing the arena.
+//
+// Grammar:
+//   line     = pipeline { ( ';' | '&' ) pipeline } [ '&' ]
+//   pipeline = command [ '<' word ] { '|' command } [ ( '>' | '>>' ) word ]
+//   command  = word { word }
+// A word may contain '...' (taken literally), "..." (where \" \\ \$ \`
+// are escapes) and \c outside quotes. '#' at the start of a word begins a
+// comment. '<' is only allowed on the first command of a pipeline, '>' only
+// on the last, like in the shell. A pipeline ended by '&' runs in the
+// background (see jobs.h).
+
+// Bump allocator over a fixed buffer
+typedef struct {
+    char *base;
+    size_t size;
+    size_t used;
+} Arena;
+
+// Arena big enough for any line of len bytes. The worst case is "a;a;...":
+// every two source bytes become a word, a command and a pipeline.
+#define PARSE_ARENA_SIZE(len) (96 * (size_t)(len) + 256)
+
+void arena_init(Arena *a, void *buf, size_t size);
+
+// Returns size bytes aligned for any node, or NULL if the arena is full
+void *arena_alloc(Arena *a, size_t size);
+
+// A program and its arguments
+typedef struct AstCommand {
+    char **argv;                // NULL-terminated
+    int argc;
+    struct AstCommand *next;    // Next command of the pipeline
+} AstCommand;
+
+// Commands joined by '|'
+typedef struct AstPipeline {
+    AstCommand *commands;
+    int count;
+    const char *input;          // File for the first command's stdin, NULL = none
+    const char *output;         // File for the last command's output, NULL = client
+    int append;                 // Output opened with '>>'
+    int background;             // Ended by '&': runs as a job
+    struct AstPipeline *next;   // Next pipeline after ';' or '&'
+} AstPipeline;
+
+// Pipelines run one after another; empty ones (";;") are left out
+typedef struct {
+    AstPipeline *pipelines;
+    int count;
+} AstSequence;
+
+// Parses line into seq. Every node and string lives in the arena.
+// Returns NULL, or a message for the client describing the first error.
+const char *parse_command_line(const char *line, Arena *arena, AstSequence *seq);
+
+#endif
@@ -0,0 +1,203 @@
+#include "protocol.h"
+#include "shell.h"
+#include "output.h"
+#include "channel.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <arpa/inet.h>
+#include <sys/un.h>
+
+
+// Fills a header in network byte order
+void frame_pack(FrameHeader *h, int type, uint32_t request_id, uint32_t length, int32_t status) {
+    h->version = PROTO_VERSION;
+    h->type = (uint8_t)type;
+    h->flags = 0;
+    h->request_id = htonl(request_id);
+    h->length = htonl(length);
+    h->status = (int32_t)htonl((uint32_t)status);
+}
+
+// Decodes a header from the start of buf
+int frame_unpack(const void *buf, size_t len, FrameHeader *h) {
+    if (len < FRAME_HEADER_SIZE) return 0;
+
+    memcpy(h, buf, FRAME_HEADER_SIZE);
+    if (h->version != PROTO_VERSION || h->type < FRAME_HELLO || h->type > FRAME_CHANNEL_CLOSE)
+        return -1;
+
+    h->flags = ntohs(h->flags);
+    h->request_id = ntohl(h->request_id);
+    h->length = ntohl(h->length);
+    h->status = (int32_t)ntohl((uint32_t)h->status);
+    if (h->length > PROTO_MAX_PAYLOAD) return -1;
+    return 1;
+}
+
+
+// Fills a Unix socket address; the abstract name starts with a zero byte
+int proto_unix_address(const char *path, struct sockaddr_un *addr) {
+    size_t len = strlen(path);
+    if (len == 0 || len >= sizeof(addr->sun_path)) return -1;
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, path, len);
+    if (path[0] == PROTO_ABSTRACT_PREFIX) {
+        addr->sun_path[0] = '\0';
+        return (int)(offsetof(struct sockaddr_un, sun_path) + len); // no terminator in the name
+    }
+    return (int)sizeof(*addr);
+}
+
+
+// Appends bytes received from the client to the session's input buffer.
+// Commands already taken out are dropped first, so a long pipelined batch
+// costs one move per read rather than one per command.
+int session_feed(Session *s, const char *data, size_t len) {
+    if (s->inpos > 0) {
+        s->inlen -= s->inpos;
+        memmove(s->inbuf, s->inbuf + s->inpos, s->inlen);
+        s->inpos = 0;
+    }
+    if (s->inlen + len > PROTO_MAX_QUEUED) return -1;
+
+    if (s->inlen + len > s->incap) {
+        size_t cap = s->incap ? s->incap : 1024;
+        while (cap < s->inlen + len) cap *= 2;
+
+        char *p = realloc(s->inbuf, cap);
+        if (!p) return -1;
+        s->inbuf = p;
+        s->incap = cap;
+    }
+    memcpy(s->inbuf + s->inlen, data, len);
+    s->inlen += len;
+    return 0;
+}
+
+// Drops n bytes from the front of the input buffer; an empty buffer is freed
+// so idle sessions don't keep it around
+static void consume_input(Session *s, size_t n) {
+    s->inpos += n;
+    if (s->inpos == s->inlen) {
+        free(s->inbuf);
+        s->inbuf = NULL;
+        s->inlen = s->inpos = s->incap = 0;
+    }
+}
+
+// Returns 1 if word is one of the options following the version of a hello line
+static int hello_option(const char *line, const char *word) {
+    size_t n = strlen(word);
+    const char *p = line + strlen(PROTO_HELLO);
+
+    while ((p = strchr(p, ' ')) != NULL) {
+        p++;
+        if (strncmp(p, word, n) == 0 && (p[n] == ' ' || p[n] == '\0')) return 1;
+    }
+    return 0;
+}
+
+// Switches the session to frames if the client asked for a version we speak
+static int negotiate(Session *s, const char *line) {
+    int version = atoi(line + strlen(PROTO_HELLO));
+    if (version != PROTO_VERSION) return 0;
+
+    s->compress = hello_option(line, PROTO_COMPRESS_OPTION);
+    s->channels = hello_option(line, PROTO_CHANNELS_OPTION);
+
+    char banner[64];
+    snprintf(banner, sizeof(banner), "SPAASM/%d%s%s", PROTO_VERSION,
+             s->compress ? " " PROTO_COMPRESS_OPTION : "",
+             s->channels ? " " PROTO_CHANNELS_OPTION : "");
+
+    // Header and banner go out as one write
+    char reply[sizeof(FrameHeader) + sizeof(banner)];
+    FrameHeader h;
+    frame_pack(&h, FRAME_HELLO, 0, strlen(banner), 0);
+    h.flags = htons((s->compress ? FRAME_FLAG_DEFLATE : 0) | (s->channels ? FRAME_FLAG_CHANNELS : 0));
+    memcpy(reply, &h, sizeof(h));
+    memcpy(reply + sizeof(h), banner, strlen(banner));
+    session_write_raw(s, reply, sizeof(h) + strlen(banner));
+
+    s->framed = 1;
+    if (s->verbose) fprintf(stderr, "[DEBUG] Client switched to framed protocol v%d%s%s\n", version,
+                            s->compress ? " with compression" : "",
+                            s->channels ? " with channels" : "");
+    return 1;
+}
+
+// Takes the next command out of the session's input buffer
+int session_next_command(Session *s, char *cmd, size_t size) {
+    const char *data = s->inbuf + s->inpos;
+    size_t avail = s->inlen - s->inpos;
+    if (avail == 0) return 0;
+
+    if (!s->framed) {
+        // Text mode: once the client has sent a newline, commands are lines
+        // and a partial line waits for the rest. Before that (the original
+        // client never sends one) everything read at once is one command.
+        const char *nl = memchr(data, '\n', avail);
+        size_t n, used;
+        if (nl) {
+            s->lines = 1;
+            n = nl - data;
+            used = n + 1;
+        } else if (!s->lines) {
+            n = used = avail;
+        } else if (avail < size) {
+            return 0;
+        } else {
+            return -1; // line longer than any command
+        }
+
+        if (n > size - 1) n = size - 1;
+        memcpy(cmd, data, n);
+        cmd[n] = '\0';
+        if (n > 0 && cmd[n - 1] == '\r') cmd[n - 1] = '\0';
+        consume_input(s, used);
+
+        if (strncmp(cmd, PROTO_HELLO, strlen(PROTO_HELLO)) == 0 && negotiate(s, cmd))
+            return session_next_command(s, cmd, size); // frames may follow the hello
+        return 1;
+    }
+
+    // Frames for channels 1 and up are passed on here, the loop goes on
+    // until a command of channel 0 turns up
+    while (1) {
+        data = s->inbuf + s->inpos;
+        avail = s->inlen - s->inpos;
+
+        FrameHeader h;
+        int r = frame_unpack(data, avail, &h);
+        if (r <= 0) return r;
+        if (h.length >= size) return -1;
+        if (avail < FRAME_HEADER_SIZE + h.length) return 0; // payload incomplete
+
+        int channel = s->channels ? h.status : 0;
+        if (channel < 0 || channel > PROTO_MAX_CHANNELS) return -1;
+
+        if (h.type == FRAME_WINDOW && channel > 0 && h.length == sizeof(uint32_t)) {
+            uint32_t increment;
+            memcpy(&increment, data + FRAME_HEADER_SIZE, sizeof(increment));
+            consume_input(s, FRAME_HEADER_SIZE + h.length);
+            channel_window(s, channel, ntohl(increment));
+            continue;
+        }
+        if (h.type != FRAME_COMMAND) return -1;
+
+        memcpy(cmd, data + FRAME_HEADER_SIZE, h.length);
+        cmd[h.length] = '\0';
+        consume_input(s, FRAME_HEADER_SIZE + h.length);
+        if (channel > 0) {
+            channel_command(s, channel, h.request_id, cmd);
+            continue;
+        }
+
+        s->request_id = h.request_id;
+        return 1;
+    }
+}
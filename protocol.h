@@ -0,0 +1,127 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Framed wire protocol
+//
+// A client asks for it by sending the text line "SPAASM-HELLO <version>\n"
+// right after connecting. A server that supports the version answers with a
+// FRAME_HELLO frame and both sides switch to frames. Any other answer (an old
+// server tries to run the line as a command) means the legacy text protocol
+// with the "__END__\n" marker stays in use.
+//
+// Every frame is a 16 byte header in network byte order followed by
+// `length` bytes of payload.
+//
+// Commands may be pipelined: a client can send any number of COMMAND frames
+// (or newline-terminated lines in text mode) without waiting. The server
+// queues them per session and answers strictly in order; every DATA and END
+// frame carries the request_id of the command it answers.
+//
+// Background jobs (jobs.h): their output and the notices about their end
+// arrive between and during responses as DATA frames with request_id 0,
+// never compressed, every line tagged "[n] " with the job number.
+//
+// Compression: a client that adds the option "deflate" to its hello line
+// ("SPAASM-HELLO 1 deflate") may get compressed output. The server confirms
+// with FRAME_FLAG_DEFLATE on its FRAME_HELLO. From then on a DATA frame with
+// that flag carries a piece of a deflate (zlib) stream; all flagged frames of
+// one response form one stream, flushed at every frame, which ends with the
+// response. Output chunks below PROTO_COMPRESS_MIN bytes are sent raw so
+// short answers keep their latency.
+//
+// Channels: a client that adds the option "channels" to its hello line
+// gets logical channels if the server confirms with FRAME_FLAG_CHANNELS.
+// The status field of a COMMAND frame then names the channel (0 = the
+// session's own command stream, 1 to PROTO_MAX_CHANNELS). Each channel runs
+// its commands in order, at the same time as the other channels, and the
+// answers carry the request_id as usual. Channels 1 and up are served
+// between the commands of channel 0, so a client that wants parallelism
+// sends its work on them and keeps channel 0 for quick commands. Their
+// output is never compressed. Flow control is per channel: a channel may
+// send PROTO_CHANNEL_WINDOW bytes of DATA payload, then waits (with its
+// command) until the client grants more with a FRAME_WINDOW. `quit` on a
+// channel closes only that channel; the server reports a closed channel
+// with FRAME_CHANNEL_CLOSE, and its unanswered commands are lost. A command
+// for a closed channel opens it again.
+//
+// Admission: while the server has no room for a new connection, it sends
+// FRAME_WAIT frames before anything else, and the client keeps waiting for
+// FRAME_HELLO. A connection the server turns away gets a FRAME_CLOSE with
+// the reason instead. These two frames are sent whatever the client speaks,
+// so a plain text client sees the 16 header bytes before the message.
+
+#define PROTO_VERSION 1
+#define PROTO_HELLO "SPAASM-HELLO"      // Negotiation line sent by the client
+#define PROTO_HELLO_TIMEOUT_MS 2000     // How long the client waits for the answer
+#define PROTO_MAX_COMMAND 4096          // Longest accepted command line
+#define PROTO_MAX_PAYLOAD (1 << 20)     // Longest accepted frame payload
+#define PROTO_MAX_QUEUED (1 << 20)      // Most unprocessed input kept per session
+#define PROTO_READ_SIZE 16384           // Bytes read from a client socket at once
+#define PROTO_END_MARKER "__END__\n"    // End of a response in text mode
+#define PROTO_COMPRESS_OPTION "deflate" // Hello option asking for compressed output
+#define PROTO_COMPRESS_MIN 4096         // Smaller output chunks are not compressed
+#define PROTO_ABSTRACT_PREFIX '@'       // Unix socket path naming the abstract namespace
+#define PROTO_CHANNELS_OPTION "channels" // Hello option asking for logical channels
+#define PROTO_MAX_CHANNELS 16           // Channels per connection besides channel 0
+#define PROTO_CHANNEL_WINDOW (256 * 1024) // DATA payload a channel may send before a grant
+
+// Frame types
+enum {
+    FRAME_HELLO = 1,    // server → client: framing accepted, payload = server banner
+    FRAME_COMMAND,      // client → server: payload = command line
+    FRAME_DATA,         // server → client: a chunk of command output
+    FRAME_END,          // server → client: response complete, status = exit status
+    FRAME_CLOSE,        // server → client: connection is closing, payload = reason
+    FRAME_WAIT,         // server → client: queued for a session, status = position, payload = message
+    FRAME_WINDOW,       // client → server: status = channel, payload = 4 byte increment of its window
+    FRAME_CHANNEL_CLOSE // server → client: status = channel, payload = reason
+};
+
+// Frame flags
+#define FRAME_FLAG_DEFLATE 0x0001   // HELLO: output may be compressed, DATA: payload is compressed
+#define FRAME_FLAG_CHANNELS 0x0002  // HELLO: logical channels accepted
+
+typedef struct __attribute__((packed)) {
+    uint8_t version;        // PROTO_VERSION
+    uint8_t type;           // FRAME_*
+    uint16_t flags;         // FRAME_FLAG_*
+    uint32_t request_id;    // Command the frame belongs to
+    uint32_t length;        // Payload bytes that follow
+    int32_t status;         // Exit status (FRAME_END), channel (COMMAND, WINDOW, CHANNEL_CLOSE)
+} FrameHeader;
+
+#define FRAME_HEADER_SIZE ((int)sizeof(FrameHeader))
+
+// Fills a header in network byte order
+void frame_pack(FrameHeader *h, int type, uint32_t request_id, uint32_t length, int32_t status);
+
+// Decodes a header from the start of buf.
+// Returns 1 if a whole header is available, 0 if more bytes are needed,
+// -1 if the bytes are not a valid frame.
+int frame_unpack(const void *buf, size_t len, FrameHeader *h);
+
+struct sockaddr_un;
+
+// Fills a Unix domain socket address for path (-u). "@name" is a socket in
+// the abstract namespace: no file, gone with the last descriptor.
+// Returns the address length, or -1 if the path does not fit.
+int proto_unix_address(const char *path, struct sockaddr_un *addr);
+
+struct Session;
+
+// Appends bytes received from the client to the session's input buffer.
+// Returns 0, or -1 if the buffer cannot grow or more than PROTO_MAX_QUEUED
+// bytes would be waiting.
+int session_feed(struct Session *s, const char *data, size_t len);
+
+// Takes the next command out of the session's input buffer into cmd.
+// Answers protocol negotiation on the way, and passes commands and window
+// grants for channels 1 and up on to them (channel.h).
+// Returns 1 if a command was stored, 0 if more input is needed,
+// -1 on a protocol error (the connection should be closed).
+int session_next_command(struct Session *s, char *cmd, size_t size);
+
+#endif
@@ -0,0 +1,207 @@
+#define _GNU_SOURCE
+
+#include "quota.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
+
+#define CGROUP2_MAGIC 0x63677270    // f_type of a cgroup v2 mount
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+
+// Limits of every command, 0 = not set
+static struct {
+    long cpu_seconds;       // RLIMIT_CPU
+    long long address_space; // RLIMIT_AS in bytes
+    long open_files;        // RLIMIT_NOFILE
+    int nice;               // Niceness given to the command
+    int io_priority;        // ioprio value (class and level), 0 = unchanged
+    long long memory;       // memory.max of the pipeline's cgroup in bytes
+    char cgroup[256];       // Directory holding the pipeline cgroups, "" = none
+    int enabled;
+} quota;
+
+
+// Parses "512", "64K", "512M" or "2G"
+static long long parse_size(const char *text) {
+    char *end;
+    long long n = strtoll(text, &end, 10);
+    if (end == text || n <= 0) return -1;
+    switch (*end) {
+    case 'k': case 'K': n <<= 10; end++; break;
+    case 'm': case 'M': n <<= 20; end++; break;
+    case 'g': case 'G': n <<= 30; end++; break;
+    }
+    return *end == '\0' ? n : -1;
+}
+
+// Parses "idle", "best-effort" or "best-effort:LEVEL" (0 = highest, 7 = lowest)
+static int parse_io(const char *text) {
+    if (strcmp(text, "idle") == 0) return IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT;
+    if (strncmp(text, "best-effort", 11) != 0) return -1;
+    int level = 4; // the kernel's default for best-effort
+    if (text[11] == ':') level = atoi(text + 12);
+    else if (text[11] != '\0') return -1;
+    if (level < 0 || level > 7) return -1;
+    return IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT | level;
+}
+
+// Parses one "name=value" item of the -R list
+static int parse_item(char *item) {
+    char *value = strchr(item, '=');
+    if (!value) return -1;
+    *value++ = '\0';
+
+    if (strcmp(item, "cpu") == 0) return (quota.cpu_seconds = atol(value)) > 0 ? 0 : -1;
+    if (strcmp(item, "as") == 0) return (quota.address_space = parse_size(value)) > 0 ? 0 : -1;
+    if (strcmp(item, "nofile") == 0) return (quota.open_files = atol(value)) > 0 ? 0 : -1;
+    if (strcmp(item, "mem") == 0) return (quota.memory = parse_size(value)) > 0 ? 0 : -1;
+    if (strcmp(item, "io") == 0) return (quota.io_priority = parse_io(value)) > 0 ? 0 : -1;
+    if (strcmp(item, "nice") == 0) {
+        quota.nice = atoi(value);
+        return quota.nice >= 1 && quota.nice <= 19 ? 0 : -1;
+    }
+    return -1;
+}
+
+// Writes a short string into a cgroup control file
+static int cgroup_write(const char *dir, const char *file, const char *text) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t n = write(fd, text, strlen(text));
+    close(fd);
+    return n == (ssize_t)strlen(text) ? 0 : -1;
+}
+
+// Checks that dir is (or can be created as) a cgroup v2 group we can fill
+static int cgroup_setup(const char *dir) {
+    if (strlen(dir) >= sizeof(quota.cgroup) - 32) {
+        fprintf(stderr, "cgroup path too long: %s\n", dir);
+        return -1;
+    }
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        perror("mkdir cgroup");
+        return -1;
+    }
+
+    struct statfs fs;
+    if (statfs(dir, &fs) < 0 || fs.f_type != CGROUP2_MAGIC) {
+        fprintf(stderr, "%s is not on a cgroup v2 file system\n", dir);
+        return -1;
+    }
+
+    // Pipelines get leaf groups below dir; memory.max there needs the controller
+    if (quota.memory && cgroup_write(dir, "cgroup.subtree_control", "+memory") < 0) {
+        fprintf(stderr, "memory controller not available in %s, mem= is ignored\n", dir);
+        quota.memory = 0;
+    }
+
+    strcpy(quota.cgroup, dir);
+    return 0;
+}
+
+int quota_init(const char *spec, const char *cgroup_dir) {
+    if (spec) {
+        char *copy = strdup(spec);
+        char *save;
+        for (char *item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+            char *bad = strdup(item);
+            if (parse_item(item) < 0) {
+                fprintf(stderr, "Invalid limit %s (use cpu=SECONDS, as=SIZE, nofile=N, "
+                                "nice=1..19, io=idle|best-effort[:0..7], mem=SIZE)\n", bad);
+                free(bad);
+                free(copy);
+                return -1;
+            }
+            free(bad);
+        }
+        free(copy);
+        quota.enabled = 1;
+    }
+
+    if (quota.memory && !cgroup_dir) {
+        fprintf(stderr, "mem= needs a cgroup directory (-G)\n");
+        return -1;
+    }
+    if (cgroup_dir) {
+        if (cgroup_setup(cgroup_dir) < 0) return -1;
+        quota.enabled = 1;
+    }
+    return 0;
+}
+
+
+int quota_enabled(void) {
+    return quota.enabled;
+}
+
+// Sets both the soft and the hard limit, so the command can't raise it again
+static void set_limit(int resource, rlim_t soft, rlim_t hard) {
+    struct rlimit rl = { .rlim_cur = soft, .rlim_max = hard };
+    setrlimit(resource, &rl);
+}
+
+// Name of the cgroup of a pipeline
+static void cgroup_path(char *path, size_t size, pid_t pgid) {
+    snprintf(path, size, "%s/cmd-%d", quota.cgroup, (int)pgid);
+}
+
+void quota_apply(pid_t pgid) {
+    if (quota.cpu_seconds) set_limit(RLIMIT_CPU, quota.cpu_seconds, quota.cpu_seconds + 1);
+    if (quota.address_space) set_limit(RLIMIT_AS, quota.address_space, quota.address_space);
+    if (quota.open_files) set_limit(RLIMIT_NOFILE, quota.open_files, quota.open_files);
+    if (quota.nice) setpriority(PRIO_PROCESS, 0, quota.nice);
+    if (quota.io_priority) syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, quota.io_priority);
+
+    if (quota.cgroup[0]) {
+        char dir[512], text[32];
+        cgroup_path(dir, sizeof(dir), pgid > 0 ? pgid : getpid());
+
+        // The first command of the pipeline creates its group
+        if (mkdir(dir, 0755) == 0 && quota.memory) {
+            snprintf(text, sizeof(text), "%lld", quota.memory);
+            cgroup_write(dir, "memory.max", text);
+        }
+        cgroup_write(dir, "cgroup.procs", "0"); // "0" moves the writer
+    }
+}
+
+const char *quota_breach(int status) {
+    if (quota.cpu_seconds && status == 128 + SIGXCPU) return "CPU time limit exceeded";
+    return NULL;
+}
+
+int quota_pipeline_done(pid_t pgid) {
+    if (!quota.cgroup[0] || pgid <= 0) return 0;
+
+    char dir[512], path[600];
+    cgroup_path(dir, sizeof(dir), pgid);
+
+    int oom = 0;
+    snprintf(path, sizeof(path), "%s/memory.events", dir);
+    FILE *f = fopen(path, "re");
+    if (f) {
+        char key[32];
+        long long value;
+        while (fscanf(f, "%31s %lld", key, &value) == 2)
+            if (strcmp(key, "oom_kill") == 0 && value > 0) oom = 1;
+        fclose(f);
+    }
+
+    // Fails while something the pipeline left in the background still runs
+    rmdir(dir);
+    return oom;
+}
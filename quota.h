@@ -0,0 +1,42 @@
+#ifndef QUOTA_H
+#define QUOTA_H
+
+#include <sys/types.h>  // For pid_t
+
+// Per-command resource limits
+//
+// Set once at startup (-R, -G) and applied by every command to itself between
+// fork and exec, so one runaway command can't take the host's memory or CPU
+// away from the other sessions:
+//  - rlimits: CPU seconds, address space and open files, hard and soft alike
+//    (CPU: SIGXCPU at the limit, SIGKILL one second later)
+//  - scheduling: nice value and I/O priority class
+//  - cgroup v2 (optional): each pipeline gets a leaf group under the -G
+//    directory, with memory.max when a memory limit is given
+// A command that ran out of CPU time or was OOM-killed in its cgroup is
+// reported to the client; hitting the address space or open file limit only
+// makes calls inside the command fail.
+
+// Parses the -R list, e.g. "cpu=10,as=512M,nofile=64,nice=10,io=idle,mem=256M",
+// and prepares the cgroup directory if cgroup_dir is not NULL. Either may be
+// NULL. Must be called before any process is forked.
+// Returns 0, or -1 after printing what is wrong.
+int quota_init(const char *spec, const char *cgroup_dir);
+
+// Returns 1 if any limit or the cgroup is set up
+int quota_enabled(void);
+
+// Applies the limits to the calling process, a command about to exec (see
+// spawn_set_setup()). pgid is the group of its pipeline, 0 if the command
+// leads a new one; it also names the pipeline's cgroup.
+void quota_apply(pid_t pgid);
+
+// Describes the limit that ended a command, from its shell-style exit
+// status. Returns NULL if it was not stopped by a limit.
+const char *quota_breach(int status);
+
+// Called once the whole pipeline was waited for: removes its cgroup.
+// Returns 1 if the kernel OOM-killed one of its commands there.
+int quota_pipeline_done(pid_t pgid);
+
+#endif
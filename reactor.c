@@ -0,0 +1,590 @@
+#define _GNU_SOURCE
+
+#include "shell.h"
+#include "server.h"
+#include "output.h"
+#include "protocol.h"
+#include "table.h"
+#include "log.h"
+#include "timer.h"
+#include "admission.h"
+#include "jobs.h"
+#include "channel.h"
+#include "relay.h"
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+
+#define MAX_EVENTS 64   // Events handled per epoll_wait() call
+
+// One client connection owned by the reactor
+typedef struct ReactorSession {
+    Session s;
+    pid_t runner;           // Process running the current command (-1 if idle)
+    Timer idle;             // Inactivity timeout, armed while no command runs
+    Timer deadline;         // Deadline of the running command (-T)
+    struct ReactorSession *prev, *next; // Links in the idle, busy or closed list
+} ReactorSession;
+
+// Doubly linked list of sessions
+typedef struct {
+    ReactorSession *head, *tail;
+} SessionList;
+
+static SessionList idle_list;   // Waiting for input or for room to send
+static SessionList busy_list;   // A command runner is in progress
+static SessionList closed_list; // Closed during this loop pass, freed after it
+
+static int epoll_fd = -1;
+static int signal_fd = -1;
+static int listen_fd = -1;
+static int unix_listen_fd = -1; // -u listener, shared by all workers
+static int relay_epoll_fd = -1; // Sockets of background jobs and channels, one-shot (jobs.h, channel.h)
+static sigset_t saved_mask;     // Signal mask to restore in command runners
+static const ServerConfig *config; // For the timer callbacks
+static Timer admission_timer;   // Retries queued clients
+
+// Markers stored in epoll data for the non-client descriptors
+static int listen_marker, unix_marker, signal_marker, timer_marker, relay_marker;
+
+// Writes the message to stderr (verbose) and to the log file
+static void reactor_log(const ServerConfig *cfg, const char *fmt, ...) {
+    va_list ap;
+
+    if (cfg->verbose) {
+        fprintf(stderr, "[DEBUG] ");
+        va_start(ap, fmt);
+        vfprintf(stderr, fmt, ap);
+        va_end(ap);
+    }
+
+    va_start(ap, fmt);
+    log_vwrite(LOG_LEVEL_INFO, fmt, ap);
+    va_end(ap);
+}
+
+
+static void list_append(SessionList *list, ReactorSession *rs) {
+    rs->next = NULL;
+    rs->prev = list->tail;
+    if (list->tail) list->tail->next = rs;
+    else list->head = rs;
+    list->tail = rs;
+}
+
+static void list_remove(SessionList *list, ReactorSession *rs) {
+    if (rs->prev) rs->prev->next = rs->next;
+    else list->head = rs->next;
+    if (rs->next) rs->next->prev = rs->prev;
+    else list->tail = rs->prev;
+    rs->prev = rs->next = NULL;
+}
+
+
+// Disconnects a session; the memory is released at the end of the loop pass
+static void session_close(const ServerConfig *cfg, ReactorSession *rs) {
+    if (rs->s.fd < 0) return; // already closed in this pass
+
+    timer_cancel(&rs->idle);
+    timer_cancel(&rs->deadline);
+
+    if (rs->runner > 0) {
+        list_remove(&busy_list, rs);
+        killpg(rs->runner, SIGTERM); // the runner stops its command and exits
+    } else {
+        list_remove(&idle_list, rs);
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, rs->s.fd, NULL);
+    }
+
+    jobs_free(&rs->s);
+    channels_free(&rs->s);
+    trace_free(&rs->s);
+
+    // A runner may still hold a copy of the socket, so shut it down explicitly
+    shutdown(rs->s.fd, SHUT_RDWR);
+    close(rs->s.fd);
+    client_slot_release(rs->s.index);
+
+    rs->s.fd = -1;
+    rs->runner = -1;
+    free(rs->s.inbuf);
+    rs->s.inbuf = NULL;
+    session_output_free(&rs->s);
+    session_context_free(&rs->s);
+    list_append(&closed_list, rs);
+
+    reactor_log(cfg, "Klient sa odpojil\n");
+}
+
+// Restarts the inactivity timeout after input or output
+static void session_touch(ReactorSession *rs) {
+    timer_set(&rs->idle, (uint64_t)config->timeout_seconds * 1000);
+}
+
+// Timer callback: the client was inactive for the whole timeout
+static void idle_expired(void *data) {
+    ReactorSession *rs = data;
+    if (jobs_running(&rs->s, 0) || channels_open(&rs->s)) {
+        session_touch(rs); // running jobs and channels keep the session
+        return;
+    }
+    session_notice(&rs->s, "You have been disconnected due to inactivity\n");
+    session_close(config, rs);
+}
+
+// Timer callback: the running command is past its deadline. The runner kills
+// the command's process group and still ends the response.
+static void deadline_expired(void *data) {
+    ReactorSession *rs = data;
+    if (rs->runner <= 0) return;
+    reactor_log(config, "Command deadline passed, stopping runner %d\n", rs->runner);
+    kill(rs->runner, SIGALRM);
+}
+
+// Starts serving an admitted client
+static void reactor_add_session(const ServerConfig *cfg, int client_fd, int index, uint64_t session_id) {
+    ReactorSession *rs = calloc(1, sizeof(*rs));
+    if (!rs) {
+        perror("calloc");
+        client_slot_release(index);
+        close(client_fd);
+        return;
+    }
+
+    rs->s.fd = client_fd;
+    rs->s.index = index;
+    rs->s.session_id = session_id;
+    rs->s.verbose = cfg->verbose;
+    rs->s.deferred = 1; // never wait for a slow client here, EPOLLOUT does
+    rs->runner = -1;
+    timer_setup(&rs->idle, idle_expired, rs);
+    timer_setup(&rs->deadline, deadline_expired, rs);
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = rs };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+        perror("epoll_ctl");
+        client_slot_release(rs->s.index);
+        close(client_fd);
+        free(rs);
+        return;
+    }
+    list_append(&idle_list, rs);
+    session_touch(rs);
+}
+
+// Admits queued clients that fit now; while any are left, retries later
+// since sessions of other workers may end too
+static void reactor_admit(void *data) {
+    const ServerConfig *cfg = data;
+    uint64_t session_id;
+    int client_fd, index;
+
+    while ((index = admission_next(getpid(), &client_fd, &session_id)) >= 0) {
+        reactor_log(cfg, "Queued client admitted\n");
+        reactor_add_session(cfg, client_fd, index, session_id);
+    }
+    if (admission_waiting() && !timer_pending(&admission_timer))
+        timer_set(&admission_timer, ADMISSION_RETRY_MS);
+}
+
+// Accepts all pending connections on a listening socket
+static void reactor_accept(const ServerConfig *cfg, int fd) {
+    while (1) {
+        struct sockaddr_in address;
+
+        uint64_t accept_start = trace_begin();
+        int client_fd = server_accept(fd, &address);
+        if (client_fd < 0) {
+            if (errno == EINTR) continue;
+            // Another worker may have taken a shared Unix connection first
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+            return;
+        }
+        trace_end(NULL, "accept", accept_start, NULL);
+
+        uint64_t dispatch_start = trace_begin();
+        client_socket_setup(client_fd);
+        reactor_log(cfg, "New client connected!\n");
+
+        // Claim a slot in the client table, or wait in the queue for one
+        uint64_t session_id;
+        int index = admission_accept(client_fd, &address, getpid(), &session_id);
+        if (index >= 0)
+            reactor_add_session(cfg, client_fd, index, session_id);
+        else if (admission_waiting() && !timer_pending(&admission_timer))
+            timer_set(&admission_timer, ADMISSION_RETRY_MS);
+        trace_end(NULL, "dispatch", dispatch_start, index >= 0 ? NULL : "queued");
+    }
+}
+
+// Drops the reactor's descriptors and signal setup in a forked runner, job
+// or channel
+static void runner_setup(void) {
+    close(epoll_fd);
+    close(signal_fd);
+    close(listen_fd);
+    if (unix_listen_fd >= 0) close(unix_listen_fd);
+    close(relay_epoll_fd);
+    epoll_fd = signal_fd = listen_fd = unix_listen_fd = relay_epoll_fd = -1;
+    relay_configure(-1, NULL);
+    admission_forget();
+    timer_close();
+
+    signal(SIGPIPE, SIG_DFL);
+    sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+}
+
+// Runs an external command line in a child process that writes to the client.
+// Jobs it starts (a line mixing '&' with other commands) are its own; it
+// waits for them before it exits.
+static void session_run(const ServerConfig *cfg, ReactorSession *rs, const char *cmd) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        session_printf(&rs->s, "Error: cannot start the command\n");
+        session_end(&rs->s, 1);
+        return;
+    }
+
+    if (pid == 0) {
+        // Runner: own process group so abort and halt can stop the whole command
+        setpgid(0, 0);
+        command_signals_setup();
+        runner_setup();
+        jobs_forget(&rs->s); // the reactor's jobs and channels stay with the reactor
+        channels_forget(&rs->s);
+
+        // Only this session waits for its client, so the runner may block
+        rs->s.deferred = 0;
+        handle_command(&rs->s, cmd);
+        jobs_finish(&rs->s);
+        trace_flush(&rs->s);
+        _exit(0);
+    }
+
+    // The runner owns the socket until the command finishes
+    setpgid(pid, pid);
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, rs->s.fd, NULL);
+    list_remove(&idle_list, rs);
+    rs->runner = pid;
+    list_append(&busy_list, rs);
+
+    // A running command is not inactivity, but it may have a deadline
+    timer_cancel(&rs->idle);
+    if (cfg->command_timeout > 0) timer_set(&rs->deadline, (uint64_t)cfg->command_timeout * 1000);
+}
+
+// Watches the socket for input, or for room while output is queued. Job and
+// channel output is only taken while nothing is queued.
+static int session_watch(ReactorSession *rs, int op) {
+    int pending = session_output_pending(&rs->s) > 0;
+    struct epoll_event ev = {
+        .events = pending ? EPOLLOUT : EPOLLIN,
+        .data.ptr = rs,
+    };
+    if (!pending) {
+        jobs_arm(&rs->s);
+        channels_arm(&rs->s);
+    }
+    return epoll_ctl(epoll_fd, op, rs->s.fd, &ev);
+}
+
+// Dispatches the commands waiting in the session's input buffer until one of
+// them needs a runner, waits for a job, or the client has to catch up with
+// the output first.
+// Returns -1 if the session was closed.
+static int session_process(const ServerConfig *cfg, ReactorSession *rs) {
+    char command[PROTO_MAX_COMMAND];
+    int r = 0;
+
+    while (rs->runner < 0 && !session_output_pending(&rs->s) && !jobs_waiting(&rs->s) &&
+           (r = session_next_command(&rs->s, command, sizeof(command))) == 1) {
+        reactor_log(cfg, "Command from the client: %s\n", command);
+
+        // Internal commands are cheap and answered in place
+        if (is_internal_command(command)) {
+            int result = handle_command(&rs->s, command);
+            if (result == 1 || rs->s.failed) {
+                session_close(cfg, rs); // client requested quit, or is gone
+                return -1;
+            }
+            if (result == 2) running = 0; // server halt requested
+            continue;
+        }
+
+        session_run(cfg, rs, command);
+    }
+
+    if (rs->runner < 0 && r < 0) {
+        session_close(cfg, rs); // malformed frame
+        return -1;
+    }
+    return 0;
+}
+
+// Reads client input and dispatches the complete commands
+static void session_input(const ServerConfig *cfg, ReactorSession *rs) {
+    char buffer[PROTO_READ_SIZE];
+
+    int bytes = read(rs->s.fd, buffer, sizeof(buffer));
+    if (bytes <= 0) {
+        if (bytes < 0 && (errno == EINTR || errno == EAGAIN)) return;
+        session_close(cfg, rs);
+        return;
+    }
+
+    session_touch(rs);
+    stats_input(rs->s.index, bytes);
+
+    if (session_feed(&rs->s, buffer, bytes) < 0) {
+        session_close(cfg, rs);
+        return;
+    }
+    if (session_process(cfg, rs) < 0 || rs->runner > 0) return;
+
+    // A response the client did not take yet: wait for room before reading on
+    if (session_output_pending(&rs->s) && session_watch(rs, EPOLL_CTL_MOD) < 0) {
+        perror("epoll_ctl");
+        session_close(cfg, rs);
+    }
+}
+
+// Sends queued output once the client has room, then takes the next commands
+static void session_output_ready(const ServerConfig *cfg, ReactorSession *rs) {
+    if (session_flush(&rs->s) < 0) {
+        session_close(cfg, rs);
+        return;
+    }
+    if (session_output_pending(&rs->s)) return; // still catching up
+
+    session_touch(rs);
+
+    if (session_process(cfg, rs) < 0 || rs->runner > 0) return;
+    if (session_watch(rs, EPOLL_CTL_MOD) < 0) {
+        perror("epoll_ctl");
+        session_close(cfg, rs);
+    }
+}
+
+// Collects finished command runners and gives their sessions back to epoll
+static void reap_runners(const ServerConfig *cfg) {
+    pid_t pid;
+    int status;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        ReactorSession *rs = busy_list.head;
+        while (rs && rs->runner != pid) rs = rs->next;
+        if (!rs) continue; // session was closed while the command ran
+
+        list_remove(&busy_list, rs);
+        rs->runner = -1;
+        list_append(&idle_list, rs);
+        timer_cancel(&rs->deadline);
+        session_touch(rs);
+
+        if (client_slot_abort_requested(rs->s.index, rs->s.session_id)) {
+            session_close(cfg, rs);
+            continue;
+        }
+
+        // Commands that arrived together with the finished one go next
+        if (session_process(cfg, rs) < 0 || rs->runner > 0) continue;
+
+        if (session_watch(rs, EPOLL_CTL_ADD) < 0) {
+            perror("epoll_ctl");
+            session_close(cfg, rs);
+        }
+    }
+}
+
+// Passes job and channel output on to the sessions that are idle. A busy
+// session, or one whose client is behind, re-arms them in session_watch() later.
+static void handle_relays(const ServerConfig *cfg) {
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(relay_epoll_fd, events, MAX_EVENTS, 0);
+
+    for (int i = 0; i < n; i++) {
+        ReactorSession *rs = events[i].data.ptr;
+        if (rs->s.fd < 0 || rs->runner > 0 || session_output_pending(&rs->s)) continue;
+
+        int waited = jobs_input(&rs->s);
+        channels_input(&rs->s);
+        if (rs->s.failed) {
+            session_close(cfg, rs);
+            continue;
+        }
+        // A finished `wait` lets the next commands go
+        if (waited) {
+            session_touch(rs);
+            if (session_process(cfg, rs) < 0 || rs->runner > 0) continue;
+        }
+        if (session_watch(rs, EPOLL_CTL_MOD) < 0) {
+            perror("epoll_ctl");
+            session_close(cfg, rs);
+        }
+    }
+}
+
+// Closes every session another client asked to abort, and the channels
+// it asked to abort in the others
+static void handle_aborts(const ServerConfig *cfg) {
+    SessionList *lists[] = { &idle_list, &busy_list };
+
+    for (int l = 0; l < 2; l++) {
+        ReactorSession *rs = lists[l]->head;
+        while (rs) {
+            ReactorSession *next = rs->next;
+            if (client_slot_abort_requested(rs->s.index, rs->s.session_id))
+                session_close(cfg, rs);
+            else
+                channels_check_aborts(&rs->s);
+            rs = next;
+        }
+    }
+}
+
+// Drains the signalfd and reacts to each delivered signal
+static void handle_signals(const ServerConfig *cfg) {
+    struct signalfd_siginfo info;
+
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGTERM) running = 0;
+        else if (info.ssi_signo == SIGCHLD) reap_runners(cfg);
+        else if (info.ssi_signo == SIGUSR1) handle_aborts(cfg);
+    }
+}
+
+// Event-driven server loop: one process owns every client socket and forks
+// only to run external commands
+void run_reactor(const ServerConfig *cfg, int server_fd, int unix_fd) {
+    listen_fd = server_fd;
+    unix_listen_fd = unix_fd;
+    config = cfg;
+
+    // Signals are delivered through a descriptor instead of handlers
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &mask, &saved_mask);
+
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0) {
+        perror("signalfd");
+        exit(1);
+    }
+
+    // A client closing its socket must not kill the whole server
+    signal(SIGPIPE, SIG_IGN);
+
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+    if (unix_listen_fd >= 0) fcntl(unix_listen_fd, F_SETFL, fcntl(unix_listen_fd, F_GETFL) | O_NONBLOCK);
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+
+    // Idle timeouts and command deadlines of every session share one timer wheel
+    if (timer_init() < 0) {
+        perror("timerfd_create");
+        exit(1);
+    }
+    timer_setup(&admission_timer, reactor_admit, (void *)cfg);
+
+    relay_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (relay_epoll_fd < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    relay_configure(relay_epoll_fd, runner_setup);
+    channels_configure(cfg->command_timeout);
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &listen_marker };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+    if (unix_listen_fd >= 0) {
+        // Workers share this socket; wake one of them per connection
+        struct epoll_event uev = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = &unix_marker };
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, unix_listen_fd, &uev);
+    }
+    ev.data.ptr = &signal_marker;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &ev);
+    ev.data.ptr = &timer_marker;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd(), &ev);
+    ev.data.ptr = &relay_marker;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, relay_epoll_fd, &ev);
+
+    reactor_log(cfg, "Event-driven mode, pid %d\n", getpid());
+
+    struct epoll_event events[MAX_EVENTS];
+
+    // <===> Main reactor loop <===>
+    while (running) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < n && running; i++) {
+            void *ptr = events[i].data.ptr;
+
+            if (ptr == &listen_marker) {
+                reactor_accept(cfg, listen_fd);
+            } else if (ptr == &unix_marker) {
+                reactor_accept(cfg, unix_listen_fd);
+            } else if (ptr == &signal_marker) {
+                handle_signals(cfg);
+            } else if (ptr == &timer_marker) {
+                timer_run();
+            } else if (ptr == &relay_marker) {
+                handle_relays(cfg);
+            } else {
+                ReactorSession *rs = ptr;
+                if (rs->s.fd < 0 || rs->runner > 0) continue;
+                if (events[i].events & EPOLLOUT) session_output_ready(cfg, rs);
+                else session_input(cfg, rs);
+            }
+        }
+
+        // Release sessions closed during this pass; their slots may go to
+        // queued clients right away
+        int closed = closed_list.head != NULL;
+        while (closed_list.head) {
+            ReactorSession *rs = closed_list.head;
+            list_remove(&closed_list, rs);
+            free(rs);
+        }
+        if (closed && admission_waiting()) reactor_admit((void *)cfg);
+    }
+
+    // Cleanup: disconnect every remaining client
+    while (busy_list.head) session_close(cfg, busy_list.head);
+    while (idle_list.head) session_close(cfg, idle_list.head);
+    while (closed_list.head) {
+        ReactorSession *rs = closed_list.head;
+        list_remove(&closed_list, rs);
+        free(rs);
+    }
+
+    close(epoll_fd);
+    close(signal_fd);
+    close(relay_epoll_fd);
+    relay_configure(-1, NULL);
+    timer_close();
+    trace_flush_all();
+    sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+}
@@ -0,0 +1,135 @@
+#include "relay.h"
+#include "shell.h"
+#include "jobs.h"
+#include "channel.h"
+#include "output.h"
+#include "trace.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+
+// Set by relay_configure() in the reactor
+static int watch_fd = -1;
+static void (*child_setup)(void) = NULL;
+
+
+void relay_configure(int epoll_fd, void (*setup)(void)) {
+    watch_fd = epoll_fd;
+    child_setup = setup;
+}
+
+static void relay_child(Session *s, int fd, void (*run)(Session *, void *), void *arg) {
+    // Handlers first: a SIGTERM still blocked in the reactor is delivered
+    // as soon as child_setup() restores the signal mask
+    command_signals_setup();
+    if (child_setup) child_setup();
+    jobs_forget(s);
+    channels_forget(s);
+    close(s->fd);
+
+    // The owner reads at its own pace (a channel's: the client's window)
+    output_configure(OUTPUT_STALL, 0, -1);
+    signal(SIGPIPE, SIG_DFL);
+
+    Session cs;
+    session_fork_copy(&cs, s, fd);
+    run(&cs, arg);
+    trace_flush(&cs);
+    _exit(0);
+}
+
+int relay_start(Session *s, Relay *r, void (*run)(Session *, void *), void *arg) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) return -1;
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        relay_child(s, sv[1], run, arg);
+    }
+
+    close(sv[1]);
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+    memset(r, 0, sizeof(*r));
+    r->pid = pid;
+    r->fd = sv[0];
+
+    if (watch_fd >= 0) {
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT, .data.ptr = s };
+        epoll_ctl(watch_fd, EPOLL_CTL_ADD, r->fd, &ev);
+    }
+    return 0;
+}
+
+void relay_watch(Session *s, Relay *r) {
+    if (watch_fd < 0) return;
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT, .data.ptr = s };
+    epoll_ctl(watch_fd, EPOLL_CTL_MOD, r->fd, &ev);
+}
+
+
+ssize_t relay_read(Relay *r) {
+    if (r->in_len + PROTO_READ_SIZE > r->in_cap) {
+        size_t cap = r->in_cap ? r->in_cap : 4096;
+        while (cap < r->in_len + PROTO_READ_SIZE) cap *= 2;
+        char *grown = realloc(r->in, cap);
+        if (!grown) return -1; // left in the socket, the next call may fit
+        r->in = grown;
+        r->in_cap = cap;
+    }
+
+    ssize_t n = read(r->fd, r->in + r->in_len, PROTO_READ_SIZE);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return -1;
+    if (n <= 0) return 0;
+    r->in_len += n;
+    return n;
+}
+
+char *relay_frame(Relay *r, size_t *off, FrameHeader *h) {
+    int ok = frame_unpack(r->in + *off, r->in_len - *off, h);
+    if (ok < 0) {
+        *off = r->in_len; // nothing to salvage
+        return NULL;
+    }
+    if (ok == 0 || r->in_len - *off < FRAME_HEADER_SIZE + h->length) return NULL;
+    return r->in + *off + FRAME_HEADER_SIZE;
+}
+
+void relay_consume(Relay *r, size_t n) {
+    r->in_len -= n;
+    memmove(r->in, r->in + n, r->in_len);
+}
+
+
+void relay_forget(Relay *r) {
+    close(r->fd);
+    free(r->in);
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+void relay_reap(Relay *r) {
+    // It closed its socket on the way out, so this does not block for long;
+    // the reactor may have reaped it already (ECHILD)
+    while (waitpid(r->pid, NULL, 0) < 0 && errno == EINTR);
+
+    if (watch_fd >= 0) epoll_ctl(watch_fd, EPOLL_CTL_DEL, r->fd, NULL);
+    relay_forget(r);
+}
+
+void relay_stop(Relay *r) {
+    kill(r->pid, SIGTERM);
+    if (watch_fd >= 0) epoll_ctl(watch_fd, EPOLL_CTL_DEL, r->fd, NULL);
+    relay_forget(r);
+}
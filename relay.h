@@ -0,0 +1,65 @@
+#ifndef RELAY_H
+#define RELAY_H
+
+#include "protocol.h"
+#include <sys/types.h>  // For pid_t, ssize_t
+
+// Helper processes of a session
+//
+// Background jobs (jobs.h) and logical channels (channel.h) are processes
+// forked by the process that owns the session (session process, reactor or
+// runner). Each works on a copy of the session whose socket is one end of a
+// socket pair and answers in frames. The owner keeps the other end,
+// non-blocking, and collects what arrives until whole frames are there. In
+// the reactor the owner's ends are watched with EPOLLONESHOT in one epoll
+// instance.
+//
+// A process forked from the owner inherits its helpers and drops them with
+// relay_forget(), which leaves the epoll instance alone: it is shared with
+// the parent.
+
+struct Session;
+
+typedef struct {
+    pid_t pid;      // Helper process
+    int fd;         // Our end of its socket pair
+    char *in;       // Received bytes not forming a whole frame yet
+    size_t in_len, in_cap;
+} Relay;
+
+// Reactor: relays are watched in epoll_fd (data = the session), and
+// child_setup runs first in every helper process. Elsewhere -1 and NULL.
+void relay_configure(int epoll_fd, void (*child_setup)(void));
+
+// Forks a helper that calls run() on its copy of s (session_fork_copy()),
+// then writes its spans and exits. Fills r and watches it.
+// Returns 0, or -1 with errno set.
+int relay_start(struct Session *s, Relay *r, void (*run)(struct Session *cs, void *arg), void *arg);
+
+// Re-arms the watch of r (reactor)
+void relay_watch(struct Session *s, Relay *r);
+
+// Appends what the helper wrote to r->in, without waiting.
+// Returns the bytes added, 0 if the helper closed its end, -1 if there is
+// nothing to read right now.
+ssize_t relay_read(Relay *r);
+
+// Returns the payload of the whole frame at *off in r->in, its header
+// decoded into h, or NULL if no whole frame is there yet. Bytes that are not
+// a frame can't come from our helper and are skipped (*off moves to the end).
+char *relay_frame(Relay *r, size_t *off, FrameHeader *h);
+
+// Drops the first n bytes of r->in
+void relay_consume(Relay *r, size_t n);
+
+// The helper closed its end: reaps it, stops watching r and frees it
+void relay_reap(Relay *r);
+
+// Sends the helper SIGTERM without waiting for it, stops watching r and
+// frees it
+void relay_stop(Relay *r);
+
+// Frees r of an inherited helper, leaving the helper and the watch alone
+void relay_forget(Relay *r);
+
+#endif
@@ -1,24 +1,34 @@
-#define _POSIX_C_SOURCE 200809L
-#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
 
 #include "shell.h"
+#include "server.h"
+#include "output.h"
+#include "protocol.h"
+#include "table.h"
+#include "cache.h"
+#include "admission.h"
+#include "jobs.h"
+#include "channel.h"
+#include "trace.h"
+#include "log.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <poll.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <signal.h>
 #include <arpa/inet.h>
-#include <sys/mman.h>
 #include <stdarg.h>
 #include <time.h>
-
-// Shared memory array for storing client information
-ClientInfo *clients;
+#include <sys/wait.h>
 
 // Unused, but could be used for stats or limits
 int client_count = 0;
@@ -31,38 +41,30 @@ void handle_sigterm(int sig) {
     running = 0;
 }
 
+// Signal handler for SIGUSR1 — only interrupts select(), 'abort' sets the flag
+void handle_sigusr1(int sig) {
+}
 
 
-// Starts the server on the specified port and handles client connections
-void run_server(int port, int timeout_seconds, int verbose, FILE *logfile) {
-    time_t now = time(NULL);
-    struct tm *t = localtime(&now);
-    char timestr[32];
-
-    // Allocate shared memory for client table
-    clients = mmap(NULL, sizeof(ClientInfo) * MAX_CLIENTS,
-               PROT_READ | PROT_WRITE,
-               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-
-    if (clients == MAP_FAILED) {
-        perror("mmap");
-        exit(1);
-    }
-
-    int server_fd, client_fd;
-    struct sockaddr_in address;
-    socklen_t addrlen = sizeof(address);
-
-    // Create new process group (for killpg in halt)
-    setpgid(0, 0);
-
-    // Create server socket
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
+// Creates a listening TCP socket on the given port
+static int server_listen(int port, int backlog, int reuseport) {
+    int server_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (server_fd < 0) {
         perror("socket");
         exit(1);
     }
 
+    // Lets several workers bind the same port; the kernel balances connections
+    if (reuseport) {
+        int one = 1;
+        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+            perror("setsockopt SO_REUSEPORT");
+            exit(1);
+        }
+    }
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
     address.sin_port = htons(port);
@@ -74,16 +76,329 @@ void run_server(int port, int timeout_seconds, int verbose, FILE *logfile) {
     }
 
     // Start listening for connections
-    if (listen(server_fd, 3) < 0) {
+    if (listen(server_fd, backlog) < 0) {
         perror("listen");
         exit(1);
     }
 
+    return server_fd;
+}
+
+// Removes a socket file left behind by a server that is gone. A socket
+// that still accepts connections belongs to a running server and stays.
+static void remove_stale_socket(const char *path, const struct sockaddr_un *addr, int len) {
+    struct stat st;
+    if (path[0] == PROTO_ABSTRACT_PREFIX || lstat(path, &st) < 0 || !S_ISSOCK(st.st_mode)) return;
+
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe < 0) return;
+    if (connect(probe, (const struct sockaddr *)addr, len) < 0 && errno == ECONNREFUSED) unlink(path);
+    close(probe);
+}
+
+// Creates a listening Unix domain socket (-u) for clients on this host
+static int server_listen_unix(const char *path, int backlog) {
+    struct sockaddr_un address;
+    int len = proto_unix_address(path, &address);
+    if (len < 0) {
+        fprintf(stderr, "Invalid Unix socket path %s\n", path);
+        exit(1);
+    }
+
+    int server_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server_fd < 0) {
+        perror("socket unix");
+        exit(1);
+    }
+
+    remove_stale_socket(path, &address, len);
+    if (bind(server_fd, (struct sockaddr *)&address, len) < 0) {
+        perror("bind unix");
+        exit(1);
+    }
+    if (listen(server_fd, backlog) < 0) {
+        perror("listen unix");
+        exit(1);
+    }
+    return server_fd;
+}
+
+// Closes the Unix listener and removes its socket file
+static void server_close_unix(const ServerConfig *cfg, int unix_fd) {
+    if (unix_fd < 0) return;
+    close(unix_fd);
+    if (cfg->unix_path[0] != PROTO_ABSTRACT_PREFIX) unlink(cfg->unix_path);
+}
+
+// Accepts a client on either listener. Unix clients have no IP address;
+// they are recorded with sin_family AF_UNIX.
+int server_accept(int listen_fd, struct sockaddr_in *address) {
+    struct sockaddr_storage peer;
+    socklen_t len = sizeof(peer);
+
+    int fd = accept4(listen_fd, (struct sockaddr *)&peer, &len, SOCK_CLOEXEC);
+    if (fd < 0) return -1;
+
+    if (peer.ss_family == AF_INET) {
+        memcpy(address, &peer, sizeof(*address));
+    } else {
+        memset(address, 0, sizeof(*address));
+        address->sin_family = AF_UNIX;
+    }
+    return fd;
+}
+
+// Prepares an accepted client socket. Responses end with a small END frame
+// or marker; without TCP_NODELAY it waits for the client's delayed ACK
+// (Unix sockets have no Nagle, the option just fails there).
+// The socket is non-blocking: output a slow client can't take yet is queued
+// (see output.h) instead of stopping the process that serves it.
+void client_socket_setup(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+// Forks a worker that runs a reactor on its own listening socket
+// The Unix socket can't be bound per worker, so all of them share it
+static pid_t start_worker(const ServerConfig *cfg, int *fds, int count, int n, int unix_fd) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Keep only this worker's socket
+        for (int i = 0; i < count; i++)
+            if (i != n) close(fds[i]);
+
+        run_reactor(cfg, fds[n], unix_fd);
+        exit(0);
+    }
+    if (pid < 0) perror("fork");
+    return pid;
+}
+
+// Supervises the pre-forked workers and restarts any that die unexpectedly
+static void run_workers(const ServerConfig *cfg, int *fds, int count, int unix_fd) {
+    pid_t pids[MAX_WORKERS];
+
+    for (int i = 0; i < count; i++) {
+        pids[i] = start_worker(cfg, fds, count, i, unix_fd);
+        if (cfg->verbose) fprintf(stderr, "[DEBUG] Worker %d started (pid %d)\n", i, pids[i]);
+    }
+
+    // The supervisor keeps every socket open, so queued connections survive a
+    // worker restart
+    while (running) {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (pids[i] != pid) continue;
+
+            // Sessions of the dead worker can't release their slots anymore
+            int lost = client_table_release_pid(pid);
+            if (cfg->verbose) fprintf(stderr, "[DEBUG] Worker %d (pid %d) exited, %d sessions lost\n", i, pid, lost);
+            pids[i] = -1;
+
+            if (running) pids[i] = start_worker(cfg, fds, count, i, unix_fd);
+            break;
+        }
+    }
+
+    // Stop the remaining workers
+    for (int i = 0; i < count; i++)
+        if (pids[i] > 0) kill(pids[i], SIGTERM);
+    for (int i = 0; i < count; i++)
+        if (pids[i] > 0) waitpid(pids[i], NULL, 0);
+}
+
+
+// <===> Handle client in child process <===>
+// Serves one admitted client in a forked session process; never returns
+static void run_session(const ServerConfig *cfg, int client_fd, int index, uint64_t session_id) {
+    command_signals_setup();
+    channels_configure(cfg->command_timeout);
+    int verbose = cfg->verbose;
+    Session session = { .fd = client_fd, .index = index, .session_id = session_id, .verbose = verbose };
+    
+    char buffer[PROTO_READ_SIZE];
+    char command[PROTO_MAX_COMMAND];
+    fd_set set;
+    struct timeval timeout;
+    int done = 0;
+
+    // <===> Per-client loop with timeout <===>
+    while (!done) {
+        // Another client asked to abort this session
+        if (client_slot_abort_requested(index, session_id)) break;
+        channels_check_aborts(&session);
+
+        FD_ZERO(&set);
+        FD_SET(client_fd, &set);
+        int maxfd = client_fd;
+
+        // Output of background jobs is passed on between commands
+        int job_fds[MAX_JOBS];
+        int jobs = jobs_fds(&session, job_fds);
+        for (int i = 0; i < jobs; i++) {
+            FD_SET(job_fds[i], &set);
+            if (job_fds[i] > maxfd) maxfd = job_fds[i];
+        }
+
+        // So is the output of logical channels, as long as their window lasts
+        int channel_fds[PROTO_MAX_CHANNELS];
+        int channels = channels_fds(&session, channel_fds);
+        for (int i = 0; i < channels; i++) {
+            FD_SET(channel_fds[i], &set);
+            if (channel_fds[i] > maxfd) maxfd = channel_fds[i];
+        }
+
+        timeout.tv_sec = cfg->timeout_seconds;
+        timeout.tv_usec = 0;
+
+        int activity = select(maxfd + 1, &set, NULL, NULL, &timeout);
+        if (activity == -1) {
+            if (errno == EINTR) continue;
+            perror("select");
+            break;
+        } else if (activity == 0) {
+            if (jobs || channels_open(&session)) continue; // running jobs and channels keep the session
+            // Timeout occurred
+            session_notice(&session, "You have been disconnected due to inactivity\n");
+            break;
+        }
+
+        if (jobs) {
+            jobs_input(&session);
+            if (session.failed) break;
+        }
+        if (channels) {
+            channels_input(&session);
+            if (session.failed) break;
+        }
+        if (!FD_ISSET(client_fd, &set)) continue;
+
+        // Read client input
+        int bytes = read(client_fd, buffer, sizeof(buffer));
+        if (bytes < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+        if (bytes <= 0) break;
+        stats_input(index, bytes);
+        if (session_feed(&session, buffer, bytes) < 0) break;
+
+        // Run every complete command received so far
+        int r;
+        while ((r = session_next_command(&session, command, sizeof(command))) == 1) {
+            if (verbose) fprintf(stderr, "[DEBUG] Command from the client: %s\n", command);
+            log_write(LOG_LEVEL_INFO, "Command from the client: %s\n", command);
+
+            // Dispatch command; this process runs one command at a time, so
+            // its deadline is a plain alarm()
+            if (cfg->command_timeout > 0) alarm(cfg->command_timeout);
+            int result = handle_command(&session, command);
+            alarm(0);
+            if (result == 1 || session.failed) { // client requested quit, or is gone
+                done = 1;
+                break;
+            }
+            if (result == 2) {
+                // Server halt requested
+                sleep(1);
+                exit(0);
+            }
+        }
+        if (r < 0) break; // malformed frame
+    }
+    
+    if (verbose) fprintf(stderr, "[DEBUG] Klient sa odpojil\n");
+    log_write(LOG_LEVEL_INFO, "Klient sa odpojil\n");
+
+    // Jobs and channels end with their session
+    jobs_free(&session);
+    channels_free(&session);
+    trace_free(&session);
+
+    // Mark client as inactive
+    client_slot_release(index);
+
+    close(client_fd);
+    exit(0); // Child exits
+}
+
+// Forks the session process of an admitted client
+static void start_session(const ServerConfig *cfg, int server_fd, int unix_fd,
+                          int client_fd, int index, uint64_t session_id) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Child does not accept new connections
+        close(server_fd);
+        if (unix_fd >= 0) close(unix_fd);
+        admission_forget();
+        run_session(cfg, client_fd, index, session_id);
+    }
+
+    if (pid > 0) {
+        client_slot_set_pid(index, session_id, pid);
+    } else {
+        perror("fork");
+        client_slot_release(index);
+    }
+    close(client_fd); // Parent doesn't handle this client directly
+}
+
+// Starts the server on the specified port and handles client connections
+void run_server(const ServerConfig *cfg) {
+    int port = cfg->port;
+    int verbose = cfg->verbose;
+
+    // Allocate shared memory for client table
+    if (client_table_init() < 0) {
+        perror("mmap");
+        exit(1);
+    }
+
+    // Admission control: every process checks the limits in the table,
+    // each accepting process keeps its own queue
+    client_table_limits(cfg->max_sessions, cfg->max_per_ip);
+    admission_configure(cfg->admission_queue, cfg->timeout_seconds);
+
+    // Shared output cache, only if asked for
+    if (cfg->cache_commands && cache_init(cfg->cache_commands, cfg->cache_ttl) < 0) {
+        perror("mmap cache");
+        exit(1);
+    }
+
+    // Backpressure for clients that read their output slowly
+    output_configure(cfg->output_policy, cfg->output_buffer, cfg->slow_seconds);
+
+    int server_fd = -1, client_fd;
+    struct sockaddr_in address;
+
+    // Create new process group (for killpg in halt)
+    setpgid(0, 0);
+
+    // Worker pool: every worker gets its own SO_REUSEPORT socket
+    int worker_fds[MAX_WORKERS];
+    int workers = cfg->workers;
+    if (workers > MAX_WORKERS) workers = MAX_WORKERS;
+
+    if (workers > 0) {
+        for (int i = 0; i < workers; i++)
+            worker_fds[i] = server_listen(port, cfg->backlog, 1);
+    } else {
+        server_fd = server_listen(port, cfg->backlog, 0);
+    }
+
+    // Local clients may skip the TCP stack
+    int unix_fd = cfg->unix_path ? server_listen_unix(cfg->unix_path, cfg->backlog) : -1;
+
     if (verbose) fprintf(stderr, "[DEBUG] Server running on port %d, waiting for client...\n", port);
-    now = time(NULL);
-    t = localtime(&now);
-    strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", t);
-    if (logfile) fprintf(logfile, "[%s] [LOG] Server running on port %d, waiting for client...\n", timestr, port);
+    log_write(LOG_LEVEL_INFO, "Server running on port %d, waiting for client...\n", port);
+    if (unix_fd >= 0) {
+        if (verbose) fprintf(stderr, "[DEBUG] Also listening on Unix socket %s\n", cfg->unix_path);
+        log_write(LOG_LEVEL_INFO, "Also listening on Unix socket %s\n", cfg->unix_path);
+    }
 
     // Handle termination signal
     struct sigaction sa;
@@ -92,129 +407,76 @@ void run_server(int port, int timeout_seconds, int verbose, FILE *logfile) {
     sa.sa_flags = 0; // Disable SA_RESTART to allow breaking from accept()
     sigaction(SIGTERM, &sa, NULL);
 
+    // Event-driven modes: reactors serve the clients
+    if (workers > 0 || cfg->event_mode) {
+        if (workers > 0) {
+            run_workers(cfg, worker_fds, workers, unix_fd);
+            for (int i = 0; i < workers; i++) close(worker_fds[i]);
+        } else {
+            run_reactor(cfg, server_fd, unix_fd);
+            close(server_fd);
+        }
+        server_close_unix(cfg, unix_fd);
+
+        if (verbose) fprintf(stderr, "[DEBUG] Server stopped.\n");
+        log_write(LOG_LEVEL_INFO, "Server stopped.\n");
+        return;
+    }
+
+    // SIGUSR1 wakes a session up when another client aborts it
+    sa.sa_handler = handle_sigusr1;
+    sigaction(SIGUSR1, &sa, NULL);
 
     // <===> Main server loop <===>
     while (running) {
-        // Accept new client
-        client_fd = accept(server_fd, (struct sockaddr *)&address, &addrlen);
-        if (client_fd < 0) {
+        // Reap finished session processes; a crashed one leaves its slot behind
+        pid_t done_pid;
+        while ((done_pid = waitpid(-1, NULL, WNOHANG)) > 0)
+            client_table_release_pid(done_pid);
+
+        // Wait for a client on either listener; queued clients are retried
+        // every ADMISSION_RETRY_MS
+        struct pollfd pfd[2] = { { .fd = server_fd, .events = POLLIN }, { .fd = unix_fd, .events = POLLIN } };
+        int ready = poll(pfd, unix_fd >= 0 ? 2 : 1, admission_waiting() ? ADMISSION_RETRY_MS : -1);
+        if (ready < 0) {
             if (!running && errno == EINTR) break; // interrupted by signal
-            perror("accept");
             continue;
         }
-    
-        if (verbose) fprintf(stderr, "[DEBUG] New client connected!\n");
-        now = time(NULL);
-        t = localtime(&now);
-        strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", t);
-        if (logfile) fprintf(logfile, "[%s] [LOG] New client connected!\n", timestr);
-    
-        // Find free slot in client table
-        int index = -1;
-        for (int i = 0; i < MAX_CLIENTS; i++) {
-            if (!clients[i].active) {
-                index = i;
-                break;
+
+        // Accept new client
+        if (ready > 0) {
+            uint64_t accept_start = trace_begin();
+            client_fd = server_accept(pfd[0].revents & POLLIN ? server_fd : unix_fd, &address);
+            if (client_fd < 0) {
+                if (!running && errno == EINTR) break;
+                perror("accept");
+                continue;
             }
-        }
+            trace_end(NULL, "accept", accept_start, NULL);
 
-        // Fill client entry
-        if (index >= 0) {
-            clients[index].fd = client_fd;
-            clients[index].pid = -1; // set later
-            clients[index].addr = address;
-            clients[index].active = 1;
-        }
+            uint64_t dispatch_start = trace_begin();
+            client_socket_setup(client_fd);
 
-        // <===> Handle client in child process <===>
-        pid_t pid = fork();
-        if (pid == 0) {
-            // Child process
-            pid_t my_pid = getpid();
-            close(server_fd); // Child does not accept new connections
-    
-            char buffer[1024] = {0};
-            fd_set set;
-            struct timeval timeout;
-
-            // <===> Per-client loop with timeout <===>
-            while (1) {
-                FD_ZERO(&set);
-                FD_SET(client_fd, &set);
-
-                timeout.tv_sec = timeout_seconds;
-                timeout.tv_usec = 0;
-
-                int activity = select(client_fd + 1, &set, NULL, NULL, &timeout);
-                if (activity == -1) {
-                    perror("select");
-                    break;
-                } else if (activity == 0) {
-                    // Timeout occurred
-                    const char *msg = "You have been disconnected due to inactivity\n";
-                    write(client_fd, msg, strlen(msg));
-                    break;
-                }
-
-                // Read client input
-                memset(buffer, 0, sizeof(buffer));
-                int bytes = read(client_fd, buffer, sizeof(buffer) - 1);
-                if (bytes <= 0) break;
-    
-                buffer[strcspn(buffer, "\n")] = '\0'; // Remove trailing newline
+            if (verbose) fprintf(stderr, "[DEBUG] New client connected!\n");
+            log_write(LOG_LEVEL_INFO, "New client connected!\n");
 
-                if (verbose) fprintf(stderr, "[DEBUG] Command from the client: %s\n", buffer);
-                now = time(NULL);
-                t = localtime(&now);
-                strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", t);
-                if (logfile) fprintf(logfile, "[%s] [LOG] Command from the client: %s\n", timestr, buffer);
-    
-                // Dispatch command
-                int result = handle_command(buffer, client_fd, verbose);
-                if (result == 1) break; // client requested quit
-                if (result == 2) {
-                    // Server halt requested
-                    sleep(1);
-                    exit(0);
-                }
-            }
-    
-            if (verbose) fprintf(stderr, "[DEBUG] Klient sa odpojil\n");
-            now = time(NULL);
-            t = localtime(&now);
-            strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", t);
-            if (logfile) fprintf(logfile, "[%s] [LOG] Klient sa odpojil\n", timestr);
-
-            // Mark client as inactive
-            for (int i = 0; i < MAX_CLIENTS; i++) {
-                if (clients[i].pid == my_pid) {
-                    clients[i].active = 0;
-                    clients[i].pid = -1;
-                    clients[i].fd = -1;
-                    memset(&clients[i].addr, 0, sizeof(clients[i].addr));
-                    break;
-                }
-            }
-
-            close(client_fd);
-            exit(0); // Child exits
-        } else {
-            // Parent process
-            for (int i = 0; i < MAX_CLIENTS; i++) {
-                if (clients[i].fd == client_fd && clients[i].pid == -1 && clients[i].active) {
-                    clients[i].pid = pid;
-                    break;
-                }
-            }
-            close(client_fd); // Parent doesn't handle this client directly
+            // Claim a slot in the client table, or wait in the queue for one
+            uint64_t session_id = 0;
+            int index = admission_accept(client_fd, &address, -1, &session_id); // pid set later
+            if (index >= 0) start_session(cfg, server_fd, unix_fd, client_fd, index, session_id);
+            trace_end(NULL, "dispatch", dispatch_start, index >= 0 ? NULL : "queued");
         }
+
+        // Sessions that ended made room for queued clients
+        uint64_t session_id;
+        int index;
+        while ((index = admission_next(-1, &client_fd, &session_id)) >= 0)
+            start_session(cfg, server_fd, unix_fd, client_fd, index, session_id);
     }
 
     // Cleanup
     close(server_fd);
+    server_close_unix(cfg, unix_fd);
     if (verbose) fprintf(stderr, "[DEBUG] Server stopped.\n");
-    now = time(NULL);
-    t = localtime(&now);
-    strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", t);
-    if (logfile) fprintf(logfile, "[%s] [LOG] Server stopped.\n", timestr);
+    log_write(LOG_LEVEL_INFO, "Server stopped.\n");
 }
\ No newline at end of file
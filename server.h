@@ -0,0 +1,49 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdio.h>
+#include <signal.h>     // For sig_atomic_t
+
+#define MAX_WORKERS 64      // Upper limit for the -w worker pool
+#define DEFAULT_BACKLOG 128 // Listen queue length unless -q is given
+
+// Server settings collected from the command line
+typedef struct {
+    int port;               // TCP port to listen on
+    int timeout_seconds;    // Client inactivity timeout
+    int command_timeout;    // Seconds a command line may run (-T), 0 = no limit
+    int verbose;            // Verbose (debug) output to stderr
+    int event_mode;         // Serve all clients from one epoll reactor (-e)
+    int workers;            // Number of pre-forked reactor workers (-w), 0 = none
+    int backlog;            // Listen queue length (-q)
+    const char *cache_commands; // Programs whose output may be cached (-C), NULL = no cache
+    int cache_ttl;          // Seconds a cached output stays valid (-a)
+    int output_policy;      // What to do with clients that stop reading (-o), see output.h
+    int slow_seconds;       // Grace before the policy applies (-o POLICY:SECONDS)
+    size_t output_buffer;   // Bytes of output queued per session (-B)
+    int max_sessions;       // Concurrent sessions (-m), 0 = the table capacity
+    int max_per_ip;         // Concurrent sessions per client address (-I), 0 = no limit
+    int admission_queue;    // Connections that may wait for a session (-Q), 0 = turn them away
+    const char *unix_path;  // Unix domain socket to listen on as well (-u), "@name" = abstract, NULL = none
+} ServerConfig;
+
+// Global flag to indicate if the server should continue running
+extern volatile sig_atomic_t running;
+
+// Starts the server and handles client connections until halted
+void run_server(const ServerConfig *cfg);
+
+struct sockaddr_in;
+
+// Accepts a connection from a TCP or Unix listener; a Unix client's address
+// is stored with sin_family AF_UNIX. Returns the socket, or -1 with errno set.
+int server_accept(int listen_fd, struct sockaddr_in *address);
+
+// Prepares an accepted client socket (non-blocking, TCP_NODELAY)
+void client_socket_setup(int fd);
+
+// Event-driven server loop: one process owns every client socket.
+// unix_fd is the Unix domain listener, -1 if there is none.
+void run_reactor(const ServerConfig *cfg, int server_fd, int unix_fd);
+
+#endif
@@ -1,4 +1,15 @@
+#define _GNU_SOURCE
+
 #include "shell.h"
+#include "spawn.h"
+#include "output.h"
+#include "protocol.h"
+#include "table.h"
+#include "parser.h"
+#include "cache.h"
+#include "quota.h"
+#include "jobs.h"
+#include "trace.h"
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
@@ -8,231 +19,897 @@
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <arpa/inet.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define SPAWN_FAILED_STATUS 127 // Exit status reported when a command can't be started
+#define TIMEOUT_STATUS 124      // Exit status reported when the deadline passed, like timeout(1)
+
+// Arena for parsing one command line; reused for every command
+static char parse_arena[PARSE_ARENA_SIZE(PROTO_MAX_COMMAND)];
+
+// Process group of the pipeline being run, 0 = none (read by the handlers)
+static volatile sig_atomic_t command_pgid = 0;
+
+// Set once the deadline of the current command line passed
+static volatile sig_atomic_t command_expired = 0;
+
+
+// SIGALRM: the deadline passed, the pipeline is killed and the rest of the
+// line is not started
+static void command_deadline(int sig) {
+    command_expired = 1;
+    if (command_pgid > 0) killpg(command_pgid, SIGKILL);
+}
 
-// Handles input redirection (command < file)
+// SIGTERM: the command does not outlive the process that waits for it
+static void command_terminate(int sig) {
+    if (command_pgid > 0) killpg(command_pgid, SIGTERM);
+    trace_flush_all();
+    _exit(1);
+}
 
-// Executes the command with the given file as its standard input,
-// captures the output and sends it to the client
-void handle_input_redirect(const char *cmd, int client_fd) {
-    char *cmd_copy_full = strdup(cmd);
-    char *redirect_in = strchr(cmd_copy_full, '<');
+// Installs the handlers of a process that runs commands
+void command_signals_setup(void) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
 
-    if (!redirect_in) return;
+    sa.sa_handler = command_deadline;
+    sigaction(SIGALRM, &sa, NULL);
+    sa.sa_handler = command_terminate;
+    sigaction(SIGTERM, &sa, NULL);
+}
 
-    *redirect_in = '\0';  // split command and filename
-    redirect_in++;
 
-    // trim leading spaces
-    while (*redirect_in == ' ') redirect_in++;
+// Setup hook of a command's launch: applies the limits of -R/-G to it
+static void command_limits(void *pgid) {
+    quota_apply(*(pid_t *)pgid);
+}
 
-    // trim trailing spaces and newlines
-    char *end = redirect_in + strlen(redirect_in) - 1;
-    while (end > redirect_in && (*end == ' ' || *end == '\n')) {
-        *end = '\0';
-        end--;
+// Waits for the child and converts its wait status into a shell-style exit status
+static int wait_status(pid_t pid) {
+    int status;
+    while (spawn_wait(pid, &status) < 0) {
+        if (errno != EINTR) return 1;
     }
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return 1;
+}
 
-    int fd = open(redirect_in, O_RDONLY);
-    if (fd < 0) {
-        perror("open");
-        free(cmd_copy_full);
-        return;
+
+// Resolves a relative path against the session's working directory
+static const char *session_path(const Session *s, const char *path, char *buf, size_t size) {
+    if (!s->cwd || path[0] == '/') return path;
+    snprintf(buf, size, "%s/%s", s->cwd, path);
+    return buf;
+}
+
+// Opens the `<` and `>`/`>>` files of a pipeline, -1 where there is none.
+// Returns -1 after telling the client if one of them can't be opened.
+static int open_redirects(Session *s, const AstPipeline *p, int *in_fd, int *out_fd) {
+    char path[PATH_MAX];
+    *in_fd = *out_fd = -1;
+
+    if (p->input) {
+        *in_fd = open(session_path(s, p->input, path, sizeof(path)), O_RDONLY | O_CLOEXEC);
+        if (*in_fd < 0) {
+            session_printf(s, "Error: %s: %s\n", p->input, strerror(errno));
+            return -1;
+        }
+    }
+
+    if (p->output) {
+        int mode = p->append ? O_APPEND : O_TRUNC;
+        *out_fd = open(session_path(s, p->output, path, sizeof(path)),
+                       O_WRONLY | O_CREAT | mode | O_CLOEXEC, 0644);
+        if (*out_fd < 0) {
+            session_printf(s, "Error: %s: %s\n", p->output, strerror(errno));
+            if (*in_fd >= 0) close(*in_fd);
+            *in_fd = -1;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+// Runs a parsed pipeline as one job
+
+// Every command is started up front, joined by pipes, so the data streams
+// through without temporary files. Only the last command's output (or the
+// output file) is the result; error messages of all commands go there too.
+// The commands share a process group led by the first one, so a deadline
+// or a stop reaches everything the pipeline started.
+// If copy is given, the first cap bytes of the client's output are kept there
+// and *copied tells how many (cap + 1 if the output was longer).
+// Returns the exit status of the last command.
+static int run_pipeline(Session *s, const AstPipeline *p, Arena *arena,
+                        char *copy, size_t cap, size_t *copied) {
+    int in_fd;
+    int result[2] = { -1, -1 };
+    if (open_redirects(s, p, &in_fd, &result[1]) < 0) return 1;
+
+    // Where the result goes: the output file, or a pipe forwarded to the client
+    if (!p->output) {
+        if (pipe2(result, O_CLOEXEC) == -1) {
+            perror("pipe");
+            if (in_fd >= 0) close(in_fd);
+            return 1;
+        }
+        output_pipe_setup(result[0]);
+    }
+
+    // The arena was sized for the line; the pids are a small extra
+    pid_t *pids = arena_alloc(arena, p->count * sizeof(pid_t));
+    if (!pids) {
+        session_printf(s, "Error: too many commands in pipeline\n");
+        if (in_fd >= 0) close(in_fd);
+        if (result[0] >= 0) close(result[0]);
+        close(result[1]);
+        return 1;
     }
 
-    int pipefd[2];
-    if (pipe(pipefd) == -1) {
-        perror("pipe");
-        close(fd);
-        free(cmd_copy_full);
+    int prev = in_fd; // Read end feeding the next command
+    pid_t pgid = 0;   // Group of the pipeline, 0 until its first command runs
+    int i = 0;
+    for (const AstCommand *cmd = p->commands; cmd; cmd = cmd->next, i++) {
+        int next[2] = { -1, -1 };
+        int last = cmd->next == NULL;
+        if (!last) {
+            if (pipe2(next, O_CLOEXEC) == -1) {
+                perror("pipe");
+                for (int j = i; j < p->count; j++) pids[j] = -1;
+                break;
+            }
+            output_pipe_setup(next[0]);
+        }
+
+        // `command NAME` runs the program even where a builtin exists
+        char *const *argv = cmd->argv;
+        if (strcmp(argv[0], "command") == 0 && argv[1]) argv++;
+
+        uint64_t spawn_start = trace_begin();
+        SpawnFileActions fa;
+        spawn_actions_init(&fa);
+        spawn_set_cwd(&fa, s->cwd);
+        spawn_set_environ(&fa, s->env);
+        if (prev >= 0) spawn_add_dup2(&fa, prev, STDIN_FILENO);
+        spawn_add_dup2(&fa, last ? result[1] : next[1], STDOUT_FILENO);
+        spawn_add_dup2(&fa, result[1], STDERR_FILENO);
+        spawn_set_pgroup(&fa, pgid);
+        if (quota_enabled()) spawn_set_setup(&fa, command_limits, &pgid);
+
+        pids[i] = spawn_command(argv, &fa);
+        trace_end(s, "spawn", spawn_start, argv[0]);
+        if (pids[i] > 0 && pgid == 0) {
+            pgid = pids[i];
+            command_pgid = pgid;
+            if (command_expired) killpg(pgid, SIGKILL); // deadline passed while it started
+        }
+        if (pids[i] < 0) {
+            // The next command just sees end of input
+            stats_spawn_failure(s->index);
+            dprintf(result[1], "execvp: %s: %s\n", argv[0], strerror(errno));
+        }
+
+        if (prev >= 0) close(prev);
+        if (!last) close(next[1]);
+        prev = next[0];
+    }
+    if (prev >= 0) close(prev);
+
+    // Our copy of the write end must go, or the forwarding never sees EOF
+    close(result[1]);
+    if (result[0] >= 0) {
+        uint64_t stream_start = trace_begin();
+        if (copy)
+            session_forward_copy(s, result[0], copy, cap, copied);
+        else
+            session_forward(s, result[0]);
+        close(result[0]);
+        trace_end(s, "stream", stream_start, NULL);
+    }
+
+    uint64_t wait_start = trace_begin();
+    int status = SPAWN_FAILED_STATUS;
+    i = 0;
+    for (const AstCommand *cmd = p->commands; cmd; cmd = cmd->next, i++) {
+        int st = pids[i] > 0 ? wait_status(pids[i]) : SPAWN_FAILED_STATUS;
+        if (!cmd->next) status = st;
+
+        const char *why = pids[i] > 0 ? quota_breach(st) : NULL;
+        if (why) {
+            session_printf(s, "Error: %s: %s\n", cmd->argv[0], why);
+            stats_limit(s->index);
+        }
+    }
+    command_pgid = 0;
+    trace_end(s, "wait", wait_start, NULL);
+
+    if (quota_pipeline_done(pgid)) {
+        session_printf(s, "Error: memory limit exceeded\n");
+        stats_limit(s->index);
+    }
+    return status;
+}
+
+
+// Builtins
+
+// echo, pwd, cd, env, export, true, false, cat and ls run inside the process
+// that handles the command, without fork and exec. They only stand in for a
+// pipeline of one command; what they don't implement (an unknown option) is
+// left to the program. Output and error messages go where the program's
+// would: to the `>` file, otherwise to the client, and -C caches them the
+// same way. `command NAME ...` runs the program instead, to compare the two.
+// cd and export change the session. The reactor runs lines made only of quick
+// builtins itself; in a line that also starts programs they happen in the
+// runner and only last until the end of that line.
+
+// Where a builtin reads and writes
+typedef struct {
+    Session *s;
+    int in;     // The `<` file, -1 = no input
+    int out;    // The `>` file, -1 = the client
+    char *copy;         // If set, the client's output is also kept here, as
+    size_t cap;         // run_pipeline() does for the cache
+    size_t *copied;
+} BuiltinIO;
+
+typedef struct {
+    const char *name;
+    int (*run)(Session *s, char **argv, BuiltinIO *io);  // Returns the exit status
+    int (*accepts)(char **argv);    // 0 = leave these arguments to the program, NULL = all
+    int quick;  // No file access, no waiting: the reactor runs it in place
+} Builtin;
+
+// Buffer for the data cat copies
+static char builtin_buffer[64 * 1024];
+
+
+static void builtin_write(BuiltinIO *io, const void *buf, size_t len) {
+    if (io->out < 0) {
+        if (io->copy && *io->copied <= io->cap) {
+            if (len > io->cap - *io->copied) {
+                *io->copied = io->cap + 1;
+            } else {
+                memcpy(io->copy + *io->copied, buf, len);
+                *io->copied += len;
+            }
+        }
+        session_write(io->s, buf, len);
         return;
     }
 
-    pid_t pid = fork();
-    if (pid == 0) {
-        // Child process
-
-        dup2(fd, STDIN_FILENO);       // Redirect input from file
-        dup2(pipefd[1], STDOUT_FILENO); // Output → pipe
-        dup2(pipefd[1], STDERR_FILENO);
-        close(fd);
-        close(pipefd[0]);
-        close(pipefd[1]);
-
-        // Parse command into arguments
-        char *args[64];
-        char *token = strtok(cmd_copy_full, " ");
-        int i = 0;
-        while (token && i < 63) {
-            args[i++] = token;
-            token = strtok(NULL, " ");
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(io->out, p, len);
+        if (n < 0) {
+            if (errno == EINTR && !command_expired) continue;
+            return;
         }
-        args[i] = NULL;
-
-        execvp(args[0], args);
-        perror("execvp");
-        exit(1);
-    } else {
-        // Parent process
-
-        close(fd);
-        close(pipefd[1]);
-
-        // Read output and send to client
-        char buffer[1024];
-        int bytes;
-        while ((bytes = read(pipefd[0], buffer, sizeof(buffer))) > 0) {
-            write(client_fd, buffer, bytes);
+        p += n;
+        len -= n;
+    }
+}
+
+static void builtin_printf(BuiltinIO *io, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void builtin_printf(BuiltinIO *io, const char *fmt, ...) {
+    char *text;
+    va_list ap;
+
+    va_start(ap, fmt);
+    int len = vasprintf(&text, fmt, ap);
+    va_end(ap);
+
+    if (len < 0) return;
+    builtin_write(io, text, len);
+    free(text);
+}
+
+// Value of a variable in the session's environment, NULL if it isn't set
+static const char *session_getenv(const Session *s, const char *name) {
+    if (!s->env) return getenv(name);
+
+    size_t len = strlen(name);
+    for (char **e = s->env; *e; e++)
+        if (strncmp(*e, name, len) == 0 && (*e)[len] == '=') return *e + len + 1;
+    return NULL;
+}
+
+// Sets "NAME=VALUE" in the session's environment; the first change copies
+// the server's, so the other sessions don't see it
+static int session_setenv(Session *s, const char *assignment) {
+    size_t name_len = strchr(assignment, '=') - assignment;
+
+    if (!s->env) {
+        size_t n = 0;
+        while (environ[n]) n++;
+        s->env = calloc(n + 1, sizeof(char *));
+        if (!s->env) return -1;
+        for (size_t i = 0; i < n && (s->env[i] = strdup(environ[i])); i++);
+    }
+
+    char *copy = strdup(assignment);
+    if (!copy) return -1;
+
+    size_t i;
+    for (i = 0; s->env[i]; i++) {
+        if (strncmp(s->env[i], assignment, name_len + 1) == 0) {
+            free(s->env[i]);
+            s->env[i] = copy;
+            return 0;
         }
+    }
 
-        close(pipefd[0]);
-        waitpid(pid, NULL, 0);
+    char **grown = realloc(s->env, (i + 2) * sizeof(char *));
+    if (!grown) {
+        free(copy);
+        return -1;
     }
+    grown[i] = copy;
+    grown[i + 1] = NULL;
+    s->env = grown;
+    return 0;
+}
 
-    free(cmd_copy_full);
+void session_context_free(Session *s) {
+    free(s->cwd);
+    s->cwd = NULL;
+    if (s->env) {
+        for (char **e = s->env; *e; e++) free(*e);
+        free(s->env);
+        s->env = NULL;
+    }
+}
+
+void session_fork_copy(Session *dst, const Session *src, int fd) {
+    *dst = *src;
+    dst->fd = fd;
+    dst->framed = 1;
+    dst->compress = 0;
+    dst->channels = 0;
+    dst->deflater = NULL;
+    dst->request_id = 0;
+    dst->inbuf = NULL;
+    dst->inpos = dst->inlen = dst->incap = 0;
+    dst->outbuf = NULL;
+    dst->outpos = dst->outlen = dst->outcap = 0;
+    dst->deferred = 0;
+    dst->failed = 0;
 }
 
 
-// Handles output redirection (command > file)
+static int no_arguments(char **argv) {
+    return argv[1] == NULL;
+}
 
-// Executes the command and writes its output to the given file
-void handle_output_redirect(const char *cmd, int client_fd) {
-    char *cmd_copy_full = strdup(cmd);
-    char *redirect_out = strchr(cmd_copy_full, '>');
+// Arguments like "-n" or "-neE" are options of GNU echo
+static int echo_option(const char *arg) {
+    return arg[0] == '-' && arg[1] && strspn(arg + 1, "neE") == strlen(arg + 1);
+}
 
-    if (!redirect_out) return;
+// Escapes (-e) are left to the program
+static int echo_accepts(char **argv) {
+    for (int i = 1; argv[i] && echo_option(argv[i]); i++)
+        if (strpbrk(argv[i], "eE")) return 0;
+    return 1;
+}
 
-    *redirect_out = '\0';        // trim command
-    redirect_out++;         // move to filename
+static int builtin_echo(Session *s, char **argv, BuiltinIO *io) {
+    int newline = 1, i = 1;
+    for (; argv[i] && echo_option(argv[i]); i++) newline = 0;
 
-    // trim leading spaces
-    while (*redirect_out == ' ') redirect_out++; // убрать пробелы
+    // One write, so the line isn't split into several frames
+    size_t len = 1;
+    for (int j = i; argv[j]; j++) len += strlen(argv[j]) + 1;
+    char *line = malloc(len);
+    if (!line) return 1;
 
-    // trim trailing spaces/newlines
-    char *end = redirect_out + strlen(redirect_out) - 1;
-    while (end > redirect_out && (*end == ' ' || *end == '\n')) {
-        *end = '\0';
-        end--;
+    size_t pos = 0;
+    for (int j = i; argv[j]; j++) {
+        if (j > i) line[pos++] = ' ';
+        size_t n = strlen(argv[j]);
+        memcpy(line + pos, argv[j], n);
+        pos += n;
     }
+    if (newline) line[pos++] = '\n';
 
-    int fd = open(redirect_out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (fd < 0) {
-        perror("open");
-        free(cmd_copy_full);
-        return;
+    builtin_write(io, line, pos);
+    free(line);
+    return 0;
+}
+
+static int builtin_pwd(Session *s, char **argv, BuiltinIO *io) {
+    char path[PATH_MAX];
+    const char *cwd = s->cwd ? s->cwd : getcwd(path, sizeof(path));
+    if (!cwd) {
+        builtin_printf(io, "pwd: %s\n", strerror(errno));
+        return 1;
+    }
+    builtin_printf(io, "%s\n", cwd);
+    return 0;
+}
+
+// Changes the session's working directory (not the process's, the reactor
+// serves other sessions too); commands started later begin there
+static int builtin_cd(Session *s, char **argv, BuiltinIO *io) {
+    if (argv[1] && argv[2]) {
+        builtin_printf(io, "cd: too many arguments\n");
+        return 1;
     }
 
-    pid_t pid = fork();
-    if (pid == 0) {
-        // Child: redirect output to file
-        dup2(fd, STDOUT_FILENO);
-        dup2(fd, STDERR_FILENO);
-        close(fd);
-
-        // Parse arguments
-        char *args[64];
-        char *token = strtok(cmd_copy_full, " ");
-        int i = 0;
-        while (token && i < 63) {
-            args[i++] = token;
-            token = strtok(NULL, " ");
+    const char *dir = argv[1] ? argv[1] : session_getenv(s, "HOME");
+    if (!dir) dir = "/";
+
+    char path[PATH_MAX], real[PATH_MAX];
+    struct stat st;
+    int err = 0;
+    if (!realpath(session_path(s, dir, path, sizeof(path)), real) || stat(real, &st) < 0)
+        err = errno;
+    else if (!S_ISDIR(st.st_mode))
+        err = ENOTDIR;
+    else if (access(real, X_OK) < 0)
+        err = errno;
+    if (err) {
+        builtin_printf(io, "cd: %s: %s\n", dir, strerror(err));
+        return 1;
+    }
+
+    char *copy = strdup(real);
+    if (!copy) return 1;
+    free(s->cwd);
+    s->cwd = copy;
+    return 0;
+}
+
+// Lists the session's environment, one NAME=VALUE per line
+static int builtin_env(Session *s, char **argv, BuiltinIO *io) {
+    char *text = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&text, &len);
+    if (!out) return 1;
+
+    for (char **e = s->env ? s->env : environ; *e; e++) fprintf(out, "%s\n", *e);
+    fclose(out);
+    builtin_write(io, text, len);
+    free(text);
+    return 0;
+}
+
+// export NAME=VALUE ... sets variables for the session's later commands;
+// without arguments it lists the environment like env
+static int builtin_export(Session *s, char **argv, BuiltinIO *io) {
+    if (!argv[1]) return builtin_env(s, argv, io);
+
+    int status = 0;
+    for (int i = 1; argv[i]; i++) {
+        const char *name = argv[i];
+        size_t len = strcspn(name, "=");
+        int valid = len > 0 && !(name[0] >= '0' && name[0] <= '9') &&
+                    strspn(name, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_") == len;
+        if (!valid) {
+            builtin_printf(io, "export: '%s': not a valid identifier\n", name);
+            status = 1;
+        } else if (name[len] == '=' && session_setenv(s, name) < 0) {
+            builtin_printf(io, "export: %s\n", strerror(errno));
+            status = 1;
         }
-        args[i] = NULL;
+    }
+    return status;
+}
 
-        execvp(args[0], args);
-        perror("execvp");
-        exit(1);
-    } else {
-        close(fd);
-        waitpid(pid, NULL, 0);
+static int builtin_true(Session *s, char **argv, BuiltinIO *io) {
+    return 0;
+}
+
+static int builtin_false(Session *s, char **argv, BuiltinIO *io) {
+    return 1;
+}
+
+// Options of cat are left to the program; "-" is the input
+static int cat_accepts(char **argv) {
+    for (int i = 1; argv[i]; i++)
+        if (argv[i][0] == '-' && argv[i][1]) return 0;
+    return 1;
+}
+
+// Copies fd to the output until end of file or the deadline
+static int cat_copy(BuiltinIO *io, int fd) {
+    for (;;) {
+        ssize_t n = read(fd, builtin_buffer, sizeof(builtin_buffer));
+        if (n < 0) {
+            if (errno == EINTR && !command_expired) continue;
+            return -1;
+        }
+        if (n == 0) return 0;
+        builtin_write(io, builtin_buffer, n);
+        if (io->s->failed || command_expired) return 0;
     }
+}
+
+// Without a `<` file there is no input (the program would read the server's)
+static int builtin_cat(Session *s, char **argv, BuiltinIO *io) {
+    int status = 0;
+    char *stdin_only[] = { "-", NULL };
+    char **files = argv[1] ? argv + 1 : stdin_only;
 
-    free(cmd_copy_full);
+    for (int i = 0; files[i] && !command_expired; i++) {
+        if (strcmp(files[i], "-") == 0) {
+            if (io->in >= 0 && cat_copy(io, io->in) < 0) {
+                builtin_printf(io, "cat: -: %s\n", strerror(errno));
+                status = 1;
+            }
+            continue;
+        }
+
+        char path[PATH_MAX];
+        int fd = open(session_path(s, files[i], path, sizeof(path)), O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || cat_copy(io, fd) < 0) {
+            builtin_printf(io, "cat: %s: %s\n", files[i], strerror(errno));
+            status = 1;
+        }
+        if (fd >= 0) close(fd);
+    }
+    return status;
 }
 
+// Only -a and -1 (the default for a pipe) are implemented
+static int ls_accepts(char **argv) {
+    for (int i = 1; argv[i]; i++) {
+        const char *arg = argv[i];
+        if (arg[0] == '-' && arg[1] && strspn(arg + 1, "a1") != strlen(arg + 1)) return 0;
+    }
+    return 1;
+}
 
-// Executes a simple command without redirection
+static int compare_names(const void *a, const void *b) {
+    return strcoll(*(char *const *)a, *(char *const *)b);
+}
 
-// Uses fork-exec model and sends output back to client
-void execute_command(const char *cmd, int client_fd) {
+static int hidden_entry(const struct dirent *d) {
+    return d->d_name[0] != '.';
+}
 
-    // Handle redirection
-    if (strchr(cmd, '>')) {
-        handle_output_redirect(cmd, client_fd);
-        return;
+// Lists like ls writing to a pipe: one name per line, files named on the
+// command line first, then each directory (with a heading if there are
+// several operands). Error messages come before the listing.
+static int builtin_ls(Session *s, char **argv, BuiltinIO *io) {
+    int all = 0, count = 0;
+    for (int i = 1; argv[i]; i++) {
+        if (argv[i][0] == '-' && argv[i][1]) all |= strchr(argv[i], 'a') != NULL;
+        else count++;
+    }
+
+    char *dot[] = { ".", NULL };
+    char **names = calloc(count ? count : 1, sizeof(char *));
+    char **dirs = calloc(count ? count : 1, sizeof(char *));
+    char *text = NULL;
+    size_t len = 0;
+    FILE *out = names && dirs ? open_memstream(&text, &len) : NULL;
+    if (!out) {
+        free(names);
+        free(dirs);
+        return 2;
+    }
+
+    // Operands that exist, split into plain files and directories
+    char **operands = count ? argv + 1 : dot;
+    int files = 0, ndirs = 0, status = 0;
+    char path[PATH_MAX];
+    for (int i = 0; operands[i]; i++) {
+        if (operands[i][0] == '-' && operands[i][1]) continue;
+        struct stat st;
+        if (stat(session_path(s, operands[i], path, sizeof(path)), &st) < 0) {
+            builtin_printf(io, "ls: cannot access '%s': %s\n", operands[i], strerror(errno));
+            status = 2;
+        } else if (S_ISDIR(st.st_mode)) {
+            dirs[ndirs++] = operands[i];
+        } else {
+            names[files++] = operands[i];
+        }
+    }
+    qsort(names, files, sizeof(char *), compare_names);
+    qsort(dirs, ndirs, sizeof(char *), compare_names);
+
+    for (int i = 0; i < files; i++) fprintf(out, "%s\n", names[i]);
+
+    for (int i = 0; i < ndirs && !command_expired; i++) {
+        struct dirent **list;
+        int n = scandir(session_path(s, dirs[i], path, sizeof(path)), &list,
+                        all ? NULL : hidden_entry, alphasort);
+        if (n < 0) {
+            builtin_printf(io, "ls: cannot open directory '%s': %s\n", dirs[i], strerror(errno));
+            status = 2;
+            continue;
+        }
+
+        if (files || i > 0) fprintf(out, "\n");
+        if (count > 1) fprintf(out, "%s:\n", dirs[i]);
+        for (int j = 0; j < n; j++) {
+            fprintf(out, "%s\n", list[j]->d_name);
+            free(list[j]);
+        }
+        free(list);
+    }
+
+    fclose(out);
+    builtin_write(io, text, len);
+    free(text);
+    free(names);
+    free(dirs);
+    return status;
+}
+
+static const Builtin builtins[] = {
+    { "echo",   builtin_echo,   echo_accepts,   1 },
+    { "pwd",    builtin_pwd,    no_arguments,   1 },
+    { "cd",     builtin_cd,     NULL,           1 },
+    { "env",    builtin_env,    no_arguments,   1 },
+    { "export", builtin_export, NULL,           1 },
+    { "true",   builtin_true,   NULL,           1 },
+    { "false",  builtin_false,  NULL,           1 },
+    { "cat",    builtin_cat,    cat_accepts,    0 },
+    { "ls",     builtin_ls,     ls_accepts,     0 },
+};
+
+// Returns the builtin that runs argv, NULL if it takes the program
+static const Builtin *builtin_find(char **argv) {
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        const Builtin *b = &builtins[i];
+        if (strcmp(argv[0], b->name) == 0) return !b->accepts || b->accepts(argv) ? b : NULL;
+    }
+    return NULL;
+}
+
+// Runs a pipeline of one builtin command with its redirections. copy, cap
+// and copied as for run_pipeline(). Returns the exit status.
+static int run_builtin(Session *s, const Builtin *b, const AstPipeline *p,
+                       char *copy, size_t cap, size_t *copied) {
+    BuiltinIO io = { .s = s, .copy = copy, .cap = cap, .copied = copied };
+    if (copy) *copied = 0;
+    if (open_redirects(s, p, &io.in, &io.out) < 0) return 1;
+
+    if (s->verbose) fprintf(stderr, "[DEBUG] %s runs as a builtin\n", b->name);
+    uint64_t start = trace_begin();
+    int status = b->run(s, p->commands->argv, &io);
+    trace_end(s, "builtin", start, b->name);
+
+    if (io.in >= 0) close(io.in);
+    if (io.out >= 0) close(io.out);
+    return status;
+}
+
+// Answers a command from the output cache, or runs it (as the builtin b if
+// not NULL) and stores its output for the next time. Returns the exit status.
+static int run_cached(Session *s, const AstPipeline *p, const Builtin *b, Arena *arena,
+                      const CacheKey *key) {
+    static char output[CACHE_MAX_OUTPUT];
+    size_t len;
+
+    uint64_t start = trace_begin();
+    if (cache_lookup(key, output, &len)) {
+        trace_end(s, "cache hit", start, p->commands->argv[0]);
+        if (s->verbose) fprintf(stderr, "[DEBUG] Output of %s served from the cache\n", p->commands->argv[0]);
+        stats_cache(s->index, 1);
+        session_write(s, output, len);
+        return 0;
+    }
+
+    stats_cache(s->index, 0);
+    len = sizeof(output) + 1; // stays "too long" if the output never reaches us
+    int status = b ? run_builtin(s, b, p, output, sizeof(output), &len)
+                   : run_pipeline(s, p, arena, output, sizeof(output), &len);
+    if (status == 0 && len <= sizeof(output)) cache_store(key, output, len);
+    return status;
+}
+
+// Returns 1 if the line consists only of quick builtins without redirections
+// and background pipelines
+static int quick_line(const AstSequence *seq) {
+    if (seq->count == 0) return 0;
+    for (const AstPipeline *pl = seq->pipelines; pl; pl = pl->next) {
+        if (pl->background) continue; // only forks the job process
+        if (pl->count != 1 || pl->input || pl->output) return 0;
+        const Builtin *b = builtin_find(pl->commands->argv);
+        if (!b || !b->quick) return 0;
     }
+    return 1;
+}
+
+
+// Returns the arguments of a line that is one internal command, NULL if the
+// line has to run as external commands
+static char **internal_argv(const AstSequence *seq) {
+    static const char *names[] = { "help", "quit", "halt", "stat", "abort", "jobs", "wait", "trace" };
+
+    if (seq->count != 1) return NULL;
+    const AstPipeline *pl = seq->pipelines;
+    if (pl->count != 1 || pl->input || pl->output || pl->background) return NULL;
+
+    char **argv = pl->commands->argv;
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+        if (strcmp(argv[0], names[i]) == 0) return argv;
 
-    if (strchr(cmd, '<')) {
-        handle_input_redirect(cmd, client_fd);
+    // kill is ours only for job numbers, anything else is kill(1)
+    if (strcmp(argv[0], "kill") != 0 || !argv[1]) return NULL;
+    for (int i = 1; argv[i]; i++)
+        if (argv[i][0] != '%') return NULL;
+    return argv;
+}
+
+// Returns the job number of "%n", 0 if arg is not one
+static int job_number(const char *arg) {
+    if (arg[0] != '%') return 0;
+    char *end;
+    long id = strtol(arg + 1, &end, 10);
+    return *end == '\0' && id > 0 && id <= MAX_JOBS ? (int)id : 0;
+}
+
+// Returns 1 for internal commands and for lines made only of quick builtins
+// and background pipelines (see quick_line()), which the dispatcher answers
+// without waiting for a process
+int is_internal_command(const char *cmd) {
+    Arena arena;
+    AstSequence seq;
+    arena_init(&arena, parse_arena, sizeof(parse_arena));
+    if (parse_command_line(cmd, &arena, &seq) != NULL) return 0;
+    return internal_argv(&seq) != NULL || quick_line(&seq);
+}
+
+
+// Lists the connected clients. "-v" adds each session's counters and the
+// server totals, "--json" gives the same data for monitoring.
+// The answer is built in memory and sent with one write.
+static void stat_command(Session *s, char **argv) {
+    const char *arg = argv[1] ? argv[1] : "";
+    int verbose = strcmp(arg, "-v") == 0;
+    int json = strcmp(arg, "--json") == 0;
+    if ((*arg && !verbose && !json) || (argv[1] && argv[2])) {
+        session_printf(s, "Use: stat [-v|--json]\n");
+        session_end(s, 1);
         return;
-    }    
+    }
 
-    int pipefd[2];
-    if (pipe(pipefd) == -1) {
-        perror("pipe");
+    char *text = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&text, &len);
+    if (!out) {
+        session_printf(s, "Error: %s\n", strerror(errno));
+        session_end(s, 1);
         return;
     }
 
-    pid_t pid = fork();
-    if (pid == 0) {
-        // Child: redirect output to pipe
-        close(pipefd[0]);
-        dup2(pipefd[1], STDOUT_FILENO);
-        dup2(pipefd[1], STDERR_FILENO);
-        close(pipefd[1]);
-
-        // Split command into arguments
-        char *args[64];
-        char *cmd_copy = strdup(cmd);
-        char *token = strtok(cmd_copy, " ");
-        int i = 0;
-        while (token != NULL && i < 63) {
-            args[i++] = token;
-            token = strtok(NULL, " ");
-        }
-        args[i] = NULL;
+    uint64_t now = stats_now_ms();
+    int first = 1;
+    if (json) fprintf(out, "{\"sessions\": [");
+
+    // Each slot is copied consistently; slots claimed meanwhile may be missed
+    int size = client_table_size();
+    for (int i = 0; i < size; i++) {
+        ClientInfo info;
+        if (!client_slot_read(i, &info) || info.pid <= 0) continue;
+        const char *ip = info.addr.sin_family == AF_UNIX ? "local" : inet_ntoa(info.addr.sin_addr);
 
-        if (execvp(args[0], args) == -1) {
-            perror("execvp");
-            exit(1);
+        if (!verbose && !json) {
+            ClientStats cs;
+            client_stats_read(i, &cs);
+            fprintf(out, "#%d | PID: %d | FD: %d | IP: %s", i, info.pid, info.fd, ip);
+            if (cs.channels > 0) fprintf(out, " | channels: %llu", (unsigned long long)cs.channels);
+            fprintf(out, "\n");
+            continue;
         }
-    } else if (pid > 0) {
-        // Parent: read child's output and forward to client
-        close(pipefd[1]);
-
-        char buffer[1024];
-        int bytes;
-        while ((bytes = read(pipefd[0], buffer, sizeof(buffer))) > 0) {
-            write(client_fd, buffer, bytes);   // send output to client
+
+        ClientStats cs;
+        client_stats_read(i, &cs);
+        uint64_t idle = now > cs.last_active_ms ? now - cs.last_active_ms : 0;
+        uint64_t up = now > cs.connected_ms ? now - cs.connected_ms : 0;
+
+        if (json) {
+            fprintf(out, "%s\n  {\"index\": %d, \"session_id\": %llu, \"pid\": %d, \"fd\": %d, "
+                         "\"ip\": \"%s\", \"port\": %d, \"commands\": %llu, \"bytes_in\": %llu, "
+                         "\"bytes_out\": %llu, \"spawn_failures\": %llu, \"busy_us\": %llu, "
+                         "\"max_us\": %llu, \"cache_hits\": %llu, \"cache_misses\": %llu, "
+                         "\"limit_breaches\": %llu, \"channels\": %llu, \"idle_ms\": %llu, \"connected_ms\": %llu}",
+                    first ? "" : ",", i, (unsigned long long)info.session_id, info.pid, info.fd,
+                    ip, ntohs(info.addr.sin_port), (unsigned long long)cs.commands,
+                    (unsigned long long)cs.bytes_in, (unsigned long long)cs.bytes_out,
+                    (unsigned long long)cs.spawn_failures, (unsigned long long)cs.busy_us,
+                    (unsigned long long)cs.max_us, (unsigned long long)cs.cache_hits,
+                    (unsigned long long)cs.cache_misses, (unsigned long long)cs.limit_breaches,
+                    (unsigned long long)cs.channels, (unsigned long long)idle, (unsigned long long)up);
+            first = 0;
+        } else {
+            fprintf(out, "#%d | PID: %d | FD: %d | IP: %s\n"
+                         "    commands: %llu | in: %llu B | out: %llu B | spawn failures: %llu | "
+                         "limit breaches: %llu | busy: %.1f ms (max %.1f ms) | idle: %.1f s | "
+                         "connected: %.1f s | channels: %llu\n",
+                    i, info.pid, info.fd, ip, (unsigned long long)cs.commands,
+                    (unsigned long long)cs.bytes_in, (unsigned long long)cs.bytes_out,
+                    (unsigned long long)cs.spawn_failures, (unsigned long long)cs.limit_breaches, cs.busy_us / 1000.0, cs.max_us / 1000.0,
+                    idle / 1000.0, up / 1000.0, (unsigned long long)cs.channels);
+            if (cache_enabled())
+                fprintf(out, "    cache hits: %llu | cache misses: %llu\n",
+                        (unsigned long long)cs.cache_hits, (unsigned long long)cs.cache_misses);
         }
+    }
 
-        close(pipefd[0]);
-        waitpid(pid, NULL, 0);  // wait for child process to finish
-    } else {
-        perror("fork");
+    ServerStats ss;
+    server_stats_read(&ss);
+    if (verbose || json) {
+        if (json) {
+            fprintf(out, "%s],\n \"server\": {\"uptime_ms\": %llu, \"sessions\": %llu, \"active\": %llu, "
+                         "\"max_sessions\": %llu, \"waiting\": %llu, \"rejected\": %llu, "
+                         "\"rejected_per_address\": %llu, \"commands\": %llu, \"bytes_in\": %llu, \"bytes_out\": %llu, "
+                         "\"spawn_failures\": %llu, \"limit_breaches\": %llu, \"busy_us\": %llu, "
+                         "\"max_us\": %llu, \"channels\": %llu, \"cache_entries\": %d, \"cache_hits\": %llu, \"cache_misses\": %llu}}\n",
+                    first ? "" : "\n", (unsigned long long)ss.uptime_ms, (unsigned long long)ss.sessions,
+                    (unsigned long long)ss.active, (unsigned long long)ss.max_sessions,
+                    (unsigned long long)ss.waiting, (unsigned long long)ss.rejected,
+                    (unsigned long long)ss.rejected_ip,
+                    (unsigned long long)ss.commands, (unsigned long long)ss.bytes_in,
+                    (unsigned long long)ss.bytes_out, (unsigned long long)ss.spawn_failures,
+                    (unsigned long long)ss.limit_breaches, (unsigned long long)ss.busy_us,
+                    (unsigned long long)ss.max_us, (unsigned long long)ss.channels, cache_used(),
+                    (unsigned long long)ss.cache_hits, (unsigned long long)ss.cache_misses);
+        } else {
+            fprintf(out, "Server | up: %.1f s | sessions: %llu (active %llu of %llu) | waiting: %llu | "
+                         "rejected: %llu (%llu per address)\n"
+                         "    commands: %llu | in: %llu B | out: %llu B | spawn failures: %llu | "
+                         "limit breaches: %llu | busy: %.1f ms (max %.1f ms) | channels: %llu\n",
+                    ss.uptime_ms / 1000.0, (unsigned long long)ss.sessions,
+                    (unsigned long long)ss.active, (unsigned long long)ss.max_sessions,
+                    (unsigned long long)ss.waiting, (unsigned long long)ss.rejected,
+                    (unsigned long long)ss.rejected_ip,
+                    (unsigned long long)ss.commands, (unsigned long long)ss.bytes_in,
+                    (unsigned long long)ss.bytes_out, (unsigned long long)ss.spawn_failures,
+                    (unsigned long long)ss.limit_breaches, ss.busy_us / 1000.0, ss.max_us / 1000.0,
+                    (unsigned long long)ss.channels);
+        }
     }
+    if (!json && cache_enabled()) {
+        fprintf(out, "Cache | entries: %d of %d | hits: %llu | misses: %llu\n", cache_used(),
+                CACHE_ENTRIES, (unsigned long long)ss.cache_hits, (unsigned long long)ss.cache_misses);
+    }
+
+    fclose(out);
+    session_write(s, text, len);
+    free(text);
+    session_end(s, 0);
 }
 
 
-// Handles internal and external commands
+// Handles internal commands
 
-// Recognizes internal commands like `help`, `halt`, `quit`, `abort`, `stat`
-// and delegates others to the shell
-// Returns:
-// 0 - continue processing
-// 1 - terminate the current connection (quit)
-// 2 - stop the server (halt)
+// Answers `help`, `halt`, `quit`, `abort`, `stat`, `jobs`, `wait`, `trace`
+// and `kill %n`; argv comes from
+// internal_argv(). Returns the same values as handle_command().
+static int internal_command(Session *s, char **argv) {
+    const char *cmd = argv[0];
 
-int handle_command(const char *cmd, int client_fd, int verbose) {
-    // Handle internal commands
     if (strcmp(cmd, "help") == 0) {
         const char *msg =
         "Internal commands:\n"
         "  help                 - shows this help message\n"
         "  quit                 - closes this connection\n"
         "  halt                 - stops the server and all clients\n"
-        "  stat                 - lists all active clients\n"
-        "  abort <index>        - disconnects a specific client\n"
+        "  stat [-v|--json]     - lists all active clients (-v: with counters)\n"
+        "  abort <index> [ch]   - disconnects a specific client (or closes one of its channels)\n"
         "  prompt <field> <val> - change prompt (time, username, devicename, end)\n"
+        "  jobs                 - lists the background jobs of this session\n"
+        "  wait [%<job>]        - waits for a background job (default: all of them)\n"
+        "  kill %<job> ...      - stops background jobs\n"
+        "  trace                - writes the spans recorded so far to the -X trace file\n"
+        "\n"
+        "Builtins (run without starting a process):\n"
+        "  echo, pwd, cd, env, export NAME=VALUE, true, false, cat, ls\n"
+        "  command <name> ...   - runs the program <name> instead of the builtin\n"
         "\n"
         "Prompt customization examples:\n"
         "  prompt username gh0st\n"
@@ -242,113 +919,255 @@ int handle_command(const char *cmd, int client_fd, int verbose) {
         "\n"
         "Special characters supported:\n"
         "  ;   - separate multiple commands\n"
+        "  &   - run the command in the background, output tagged [n]\n"
         "  #   - comment (ignored)\n"
-        "  >   - redirect stdout to file\n"
-        "  <   - redirect stdin from file\n";
-        write(client_fd, msg, strlen(msg));
-        const char *done_marker = "__END__\n";
-        write(client_fd, done_marker, strlen(done_marker));
+        "  >   - redirect stdout to file (>> appends)\n"
+        "  <   - redirect stdin from file\n"
+        "  |   - pipe output into the next command\n"
+        "  ' \"  - quote arguments, \\ escapes one character\n";
+        session_write(s, msg, strlen(msg));
+        session_end(s, 0);
         return 0;
     }
 
     if (strcmp(cmd, "quit") == 0) {
-        const char *msg = "I'm closing the connection...\n";
-        write(client_fd, msg, strlen(msg));
+        session_notice(s, "I'm closing the connection...\n");
         return 1;
     }
 
     if (strcmp(cmd, "halt") == 0) {
-        const char *msg = "I'm stopping the server...\n";
-        write(client_fd, msg, strlen(msg));
+        session_notice(s, "I'm stopping the server...\n");
         killpg(0, SIGTERM);
         return 2;
     }
 
     if (strcmp(cmd, "stat") == 0) {
-        char line[256];
-        for (int i = 0; i < MAX_CLIENTS; i++) {
-            if (clients[i].active && clients[i].pid > 0) {
-                char *ip = inet_ntoa(clients[i].addr.sin_addr);
-                snprintf(line, sizeof(line),
-                         "#%d | PID: %d | FD: %d | IP: %s\n",
-                         i, clients[i].pid, clients[i].fd, ip);
-                write(client_fd, line, strlen(line));
-            }
-        }
-        const char *done = "__END__\n";
-        write(client_fd, done, strlen(done));
+        stat_command(s, argv);
         return 0;
     }
 
     // Handle abort n
-    char cmd_copy[1024];
-    strncpy(cmd_copy, cmd, sizeof(cmd_copy));
-    cmd_copy[sizeof(cmd_copy) - 1] = '\0';
-
-    char *cmd1 = strtok(cmd_copy, " ");
-    if (cmd1 && strcmp(cmd1, "abort") == 0) {
+    if (strcmp(cmd, "abort") == 0) {
 
-        if (verbose) fprintf(stderr, "[DEBUG] abort command received\n");
+        if (s->verbose) fprintf(stderr, "[DEBUG] abort command received\n");
 
-        char *cmd2 = strtok(NULL, " ");
-        if (cmd2) {
+        int status = 1;
+        char *cmd2 = argv[1];
+        int channel = argv[1] && argv[2] ? atoi(argv[2]) : 0;
+        if (cmd2 && argv[2] && (channel < 1 || channel > PROTO_MAX_CHANNELS)) {
+            session_printf(s, "Error: Invalid channel (1 to %d)\n", PROTO_MAX_CHANNELS);
+        } else if (cmd2) {
             int index = atoi(cmd2);
-            if (index >= 0 && index < MAX_CLIENTS && clients[index].active) {
-                pid_t victim = clients[index].pid;
-                if (victim > 0) {
-                    kill(victim, SIGTERM);
-                    if (victim == getpid()) {
-                        const char *msg = "I'm quitting based on 'abort'\n";
-                        write(client_fd, msg, strlen(msg));
-                        for (int i = 0; i < MAX_CLIENTS; i++) {
-                            if (clients[i].pid == getpid()) {
-                                clients[i].active = 0;
-                                clients[i].pid = -1;
-                                clients[i].fd = -1;
-                                memset(&clients[i].addr, 0, sizeof(clients[i].addr));
-                                break;
-                            }
-                        }
-                        close(client_fd);
-                        exit(0);
+            ClientInfo info;
+            if (client_slot_read(index, &info)) {
+                pid_t victim = info.pid;
+                if (victim > 0 && channel > 0) {
+                    // Only that channel goes; the session and its other channels stay
+                    if (client_slot_request_channel_abort(index, info.session_id, channel)) kill(victim, SIGUSR1);
+                    session_printf(s, "Command 'abort %d %d' - channel %d of client %d has been aborted\n",
+                                   index, channel, channel, index);
+                    status = 0;
+                } else if (victim > 0) {
+                    if (info.session_id == s->session_id) {
+                        // Aborting ourselves is the same as quit
+                        session_notice(s, "I'm quitting based on 'abort'\n");
+                        return 1;
                     }
-                    char msg[128];
-                    snprintf(msg, sizeof(msg), "Command 'abort %d' - client %d has been aborted\n", index, index);
-                    write(client_fd, msg, strlen(msg));
+                    // The owning process notices the flag once SIGUSR1 wakes it up
+                    if (client_slot_request_abort(index, info.session_id)) kill(victim, SIGUSR1);
+                    session_printf(s, "Command 'abort %d' - client %d has been aborted\n", index, index);
+                    status = 0;
                 } else {
-                    write(client_fd, "Error: The specified PID is not valid\n", 30);
+                    session_printf(s, "Error: The specified PID is not valid\n");
                 }
             } else {
-                write(client_fd, "Error: Invalid client index\n", 27);
+                session_printf(s, "Error: Invalid client index\n");
             }
         } else {
-            write(client_fd, "Use: abort <index>\n", 20);
+            session_printf(s, "Use: abort <index> [channel]\n");
         }
     
-        const char *done = "__END__\n";
-        write(client_fd, done, strlen(done));
+        session_end(s, status);
+        return 0;
+    }
+
+    if (strcmp(cmd, "trace") == 0) {
+        if (!trace_enabled()) {
+            session_printf(s, "Tracing is off (start the server with -X FILE)\n");
+            session_end(s, 1);
+            return 0;
+        }
+        trace_flush_all();
+        session_printf(s, "Spans written to %s\n", trace_path());
+        session_end(s, 0);
+        return 0;
+    }
+
+    if (strcmp(cmd, "jobs") == 0) {
+        jobs_list(s);
+        session_end(s, 0);
         return 0;
     }
-    
 
-    // Strip comments (marked with #)
-    char *cleaned = strdup(cmd);
-    char *comment = strchr(cleaned, '#');
-    if (comment) *comment = '\0';
-
-    // Split and execute multiple commands separated by ';'
-    char *token = strtok(cleaned, ";");
-    while (token != NULL) {
-        while (*token == ' ') token++; // skip leading spaces
-        if (strlen(token) > 0) {
-            execute_command(token, client_fd);
+    if (strcmp(cmd, "wait") == 0) {
+        int id = 0;
+        if (argv[1] && (argv[2] || (id = job_number(argv[1])) == 0)) {
+            session_printf(s, "Use: wait [%%<job>]\n");
+            session_end(s, 1);
+            return 0;
         }
-        token = strtok(NULL, ";");
+        if (!jobs_running(s, id)) {
+            if (id) session_printf(s, "Error: no such job: %s\n", argv[1]);
+            session_end(s, id ? SPAWN_FAILED_STATUS : 0);
+            return 0;
+        }
+
+        // The reactor must not block: the response ends once the job does
+        if (s->deferred) {
+            jobs_wait_begin(s, id);
+            return 0;
+        }
+        s->status = jobs_wait(s, id);
+        session_end(s, s->status);
+        return 0;
+    }
+
+    if (strcmp(cmd, "kill") == 0) {
+        int status = 0;
+        for (int i = 1; argv[i]; i++) {
+            if (jobs_kill(s, job_number(argv[i]), SIGTERM) == 0) continue;
+            session_printf(s, "Error: no such job: %s\n", argv[i]);
+            status = 1;
+        }
+        session_end(s, status);
+        return 0;
+    }
+
+    return 0;
+}
+
+
+// Runs one pipeline in the foreground and returns its exit status
+static int run_one(Session *s, const AstPipeline *pl, Arena *arena) {
+    static CacheKey key;
+
+    const Builtin *b = pl->count == 1 ? builtin_find(pl->commands->argv) : NULL;
+    // Allowlisted read-only commands may be answered from the cache, whether
+    // a builtin or the program runs them
+    if (pl->count == 1 && !pl->input && !pl->output && cache_key(s->cwd, pl->commands->argv, &key))
+        return run_cached(s, pl, b, arena, &key);
+    if (b) return run_builtin(s, b, pl, NULL, 0, NULL);
+    return run_pipeline(s, pl, arena, NULL, 0, NULL);
+}
+
+// Pipeline handed to a job process
+typedef struct {
+    const AstPipeline *pipeline;
+    Arena *arena;
+} JobRun;
+
+static int run_job(Session *s, void *arg) {
+    JobRun *run = arg;
+    return run_one(s, run->pipeline, run->arena);
+}
+
+// Appends to a job name, cut at the end of the buffer
+static void name_append(char *buf, size_t size, size_t *len, const char *fmt, ...) {
+    if (*len >= size - 1) return;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf + *len, size - *len, fmt, ap);
+    va_end(ap);
+    if (n > 0) *len += (size_t)n < size - *len ? (size_t)n : size - 1 - *len;
+}
+
+// Describes a pipeline for `jobs` and the job notices
+static void pipeline_name(const AstPipeline *p, char *buf, size_t size) {
+    size_t len = 0;
+    buf[0] = '\0';
+    for (const AstCommand *c = p->commands; c; c = c->next) {
+        if (c != p->commands) name_append(buf, size, &len, " | ");
+        for (int i = 0; i < c->argc; i++) name_append(buf, size, &len, i ? " %s" : "%s", c->argv[i]);
+        if (c == p->commands && p->input) name_append(buf, size, &len, " < %s", p->input);
     }
+    if (p->output) name_append(buf, size, &len, " %s %s", p->append ? ">>" : ">", p->output);
+}
 
-    const char *done_marker = "__END__\n";
-    write(client_fd, done_marker, strlen(done_marker));
+// Sends a pipeline to the background and reports its job number and pid
+static int start_job(Session *s, const AstPipeline *pl, Arena *arena) {
+    JobRun run = { pl, arena };
+    char name[JOB_NAME_SIZE];
+    pipeline_name(pl, name, sizeof(name));
 
-    free(cleaned);
+    int id = job_start(s, name, run_job, &run);
+    if (id < 0) {
+        if (errno == EAGAIN) session_printf(s, "Error: too many jobs (at most %d)\n", MAX_JOBS);
+        else session_printf(s, "Error: cannot start the job: %s\n", strerror(errno));
+        return 1;
+    }
+    session_printf(s, "[%d] %d\n", id, (int)s->jobs->jobs[id - 1].relay.pid);
     return 0;
-}
\ No newline at end of file
+}
+
+
+// Handles internal and external commands
+
+// Parses the line once, answers internal commands and runs everything else
+// as pipelines
+// Returns:
+// 0 - continue processing
+// 1 - terminate the current connection (quit)
+// 2 - stop the server (halt)
+
+static int dispatch_command(Session *s, const char *cmd) {
+    Arena arena;
+    AstSequence seq;
+    arena_init(&arena, parse_arena, sizeof(parse_arena));
+
+    uint64_t start = trace_begin();
+    const char *error = parse_command_line(cmd, &arena, &seq);
+    trace_end(s, "parse", start, NULL);
+    if (error) {
+        session_printf(s, "%s", error);
+        s->status = 2;
+        session_end(s, 2);
+        return 0;
+    }
+
+    char **argv = internal_argv(&seq);
+    if (argv) return internal_command(s, argv);
+
+    // Pipelines separated by ';' run one after another, the ones ended by
+    // '&' start as jobs. The exit status of the last one is reported.
+    int status = 0;
+    command_expired = 0;
+    for (const AstPipeline *pl = seq.pipelines; pl && !command_expired; pl = pl->next) {
+        if (pl->background) status = start_job(s, pl, &arena);
+        else status = run_one(s, pl, &arena);
+    }
+
+    if (command_expired) {
+        session_printf(s, "Error: command timed out\n");
+        stats_limit(s->index);
+        status = TIMEOUT_STATUS;
+    }
+
+    s->status = status;
+    session_end(s, status);
+    return 0;
+}
+
+// Runs one command line and records it in the session's counters
+int handle_command(Session *s, const char *cmd) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t span = trace_begin();
+
+    int result = dispatch_command(s, cmd);
+
+    trace_end(s, "command", span, cmd);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t us = (end.tv_sec - start.tv_sec) * 1000000ULL + (end.tv_nsec - start.tv_nsec) / 1000;
+    stats_command(s->index, us);
+    return result;
+}
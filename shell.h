@@ -1,23 +1,56 @@
 #ifndef SHELL_H
 #define SHELL_H
 
-#include <netinet/in.h> // For struct sockaddr_in
 #include <sys/types.h>  // For pid_t
+#include <stdint.h>     // For uint32_t, uint64_t
 
-#define MAX_CLIENTS 128 // Maximum number of simultaneous clients supported
+// State of one client connection, passed to the command dispatcher
+typedef struct Session {
+    int fd;         // Client socket
+    int index;      // Slot in the client table (-1 if the table was full)
+    uint64_t session_id;    // Id of the session in the client table
+    int verbose;    // Verbose (debug) output enabled
+    int framed;     // Framed protocol negotiated (see protocol.h)
+    int compress;   // Client accepted compressed output (framed mode)
+    int channels;   // Client uses logical channels (framed mode, channel.h)
+    struct z_stream_s *deflater;    // Compressor of the current response, NULL until needed
+    uint32_t request_id;    // Request currently being answered (framed mode)
+    int status;     // Exit status of the last command
+    int lines;      // Text mode: client terminates commands with newlines
+    char *inbuf;    // Received bytes not yet turned into commands
+    size_t inpos, inlen, incap; // inbuf[inpos..inlen) is still unprocessed
+    char *outbuf;   // Output the socket did not take yet
+    size_t outpos, outlen, outcap;  // outbuf[outpos..outlen) still has to be sent
+    int deferred;   // Output is only queued, the owner waits for room (reactor)
+    int failed;     // Client gone or too slow, nothing more is sent
+    char *cwd;      // Working directory set by cd (absolute), NULL = the server's
+    char **env;     // Environment changed by export (NULL-terminated), NULL = the server's
+    struct JobTable *jobs;  // Background jobs (jobs.h), NULL until the first one
+    struct ChannelTable *chans; // Open logical channels (channel.h), NULL until the first one
+    struct TraceBuffer *trace;  // Spans not written yet (trace.h), NULL until the first one
+} Session;
 
-// Structure to hold information about a connected client
-typedef struct {
-    pid_t pid;
-    int fd;
-    struct sockaddr_in addr;
-    int active;
-} ClientInfo;
+// Signal handling of a process that runs commands (session process or
+// reactor runner). Every pipeline gets its own process group; SIGALRM means
+// the command's deadline passed and kills that group, SIGTERM stops it too
+// before the process exits.
+void command_signals_setup(void);
 
-// Shared memory pointer to client connection table
-extern ClientInfo *clients;
+// Returns 1 if the command is handled by the dispatcher itself (help, stat,
+// ...) without touching files or blocking: internal commands and lines made
+// only of the quick builtins (echo, pwd, cd, env, export, true, false) and
+// pipelines sent to the background
+int is_internal_command(const char *cmd);
+
+// Releases the working directory and environment of a session
+void session_context_free(Session *s);
+
+// Copy of a session for a forked helper (relay.h) that answers in frames
+// over fd: same client slot, directory, environment and jobs, but empty
+// queues and no compressor
+void session_fork_copy(Session *dst, const Session *src, int fd);
 
 // Main command dispatcher
-int handle_command(const char *cmd, int client_fd, int verbose);
+int handle_command(Session *s, const char *cmd);
 
 #endif
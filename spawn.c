@@ -0,0 +1,257 @@
+#define _GNU_SOURCE
+
+#include "spawn.h"
+#include "zygote.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sched.h>
+#include <sys/wait.h>
+
+#define VFORK_STACK_SIZE (64 * 1024)   // Child stack for the clone() launcher
+
+// Launcher used by spawn_command()
+SpawnMethod spawn_method = SPAWN_POSIX;
+
+// Signals the server installs handlers for or ignores; children get defaults
+static const int reset_signals[] = { SIGTERM, SIGUSR1, SIGCHLD, SIGPIPE, SIGALRM };
+#define RESET_SIGNAL_COUNT (int)(sizeof(reset_signals) / sizeof(reset_signals[0]))
+
+// Arguments shared with the clone() child (same address space)
+typedef struct {
+    char *const *argv;
+    const SpawnFileActions *fa;
+    sigset_t mask;      // Signal mask for the new program
+    volatile int err;   // errno from a failed exec
+} VforkArgs;
+
+static char vfork_stack[VFORK_STACK_SIZE] __attribute__((aligned(16)));
+
+
+void spawn_actions_init(SpawnFileActions *fa) {
+    fa->count = 0;
+    fa->pgroup = -1;
+    fa->setup = NULL;
+    fa->setup_arg = NULL;
+    fa->cwd = NULL;
+    fa->envp = NULL;
+}
+
+void spawn_add_dup2(SpawnFileActions *fa, int fd, int newfd) {
+    if (fa->count >= SPAWN_MAX_ACTIONS) return;
+    fa->actions[fa->count].fd = fd;
+    fa->actions[fa->count].newfd = newfd;
+    fa->count++;
+}
+
+void spawn_add_close(SpawnFileActions *fa, int fd) {
+    spawn_add_dup2(fa, fd, -1);
+}
+
+void spawn_set_pgroup(SpawnFileActions *fa, pid_t pgroup) {
+    fa->pgroup = pgroup;
+}
+
+void spawn_set_setup(SpawnFileActions *fa, void (*setup)(void *arg), void *arg) {
+    fa->setup = setup;
+    fa->setup_arg = arg;
+}
+
+void spawn_set_cwd(SpawnFileActions *fa, const char *dir) {
+    fa->cwd = dir;
+}
+
+void spawn_set_environ(SpawnFileActions *fa, char *const *envp) {
+    fa->envp = envp;
+}
+
+// Environment of the new program
+static char *const *child_environ(const SpawnFileActions *fa) {
+    return fa->envp ? fa->envp : environ;
+}
+
+
+// Performs the file actions in the child (async-signal-safe calls only).
+// Returns -1 with errno set if the working directory can't be entered.
+static int apply_actions(const SpawnFileActions *fa) {
+    if (fa->pgroup >= 0) setpgid(0, fa->pgroup);
+    if (fa->cwd && chdir(fa->cwd) < 0) return -1;
+    for (int i = 0; i < fa->count; i++) {
+        const SpawnAction *a = &fa->actions[i];
+        if (a->newfd < 0)
+            close(a->fd);
+        else if (a->fd == a->newfd)
+            fcntl(a->fd, F_SETFD, 0); // keep it open across exec
+        else
+            dup2(a->fd, a->newfd);
+    }
+    if (fa->setup) fa->setup(fa->setup_arg);
+    return 0;
+}
+
+// Gives the child default signal handling and an empty signal mask
+static void reset_child_signals(const sigset_t *mask) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_DFL;
+    for (int i = 0; i < RESET_SIGNAL_COUNT; i++)
+        sigaction(reset_signals[i], &sa, NULL);
+    sigprocmask(SIG_SETMASK, mask, NULL);
+}
+
+
+// posix_spawnp(): glibc creates the child with CLONE_VM | CLONE_VFORK
+static pid_t spawn_posix(char *const argv[], const SpawnFileActions *fa) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t mask, defaults;
+    pid_t pid;
+
+    posix_spawn_file_actions_init(&actions);
+    if (fa->cwd) posix_spawn_file_actions_addchdir_np(&actions, fa->cwd);
+    for (int i = 0; i < fa->count; i++) {
+        const SpawnAction *a = &fa->actions[i];
+        if (a->newfd < 0)
+            posix_spawn_file_actions_addclose(&actions, a->fd);
+        else
+            posix_spawn_file_actions_adddup2(&actions, a->fd, a->newfd);
+    }
+
+    sigemptyset(&mask);
+    sigemptyset(&defaults);
+    for (int i = 0; i < RESET_SIGNAL_COUNT; i++)
+        sigaddset(&defaults, reset_signals[i]);
+
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    if (fa->pgroup >= 0) {
+        posix_spawnattr_setpgroup(&attr, fa->pgroup);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    int err = posix_spawnp(&pid, argv[0], &actions, &attr, argv, child_environ(fa));
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return pid;
+}
+
+// Child side of the clone() launcher: runs on vfork_stack in the parent's memory
+static int vfork_child(void *arg) {
+    VforkArgs *va = arg;
+
+    reset_child_signals(&va->mask);
+    if (apply_actions(va->fa) == 0) execvpe(va->argv[0], va->argv, child_environ(va->fa));
+
+    va->err = errno; // the parent reads it once we are gone
+    _exit(127);
+}
+
+// clone(CLONE_VM | CLONE_VFORK): no page tables are copied, the parent sleeps
+// until the child has exec'd or exited
+static pid_t spawn_vfork(char *const argv[], const SpawnFileActions *fa) {
+    VforkArgs va;
+    sigset_t all, old;
+
+    va.argv = argv;
+    va.fa = fa;
+    va.err = 0;
+    sigemptyset(&va.mask);
+
+    // No handler may run on the shared stack before the child resets them
+    sigfillset(&all);
+    sigprocmask(SIG_BLOCK, &all, &old);
+
+    pid_t pid = clone(vfork_child, vfork_stack + VFORK_STACK_SIZE,
+                      CLONE_VM | CLONE_VFORK | SIGCHLD, &va);
+    int clone_errno = errno;
+
+    sigprocmask(SIG_SETMASK, &old, NULL);
+
+    if (pid < 0) {
+        errno = clone_errno;
+        return -1;
+    }
+    if (va.err) {
+        waitpid(pid, NULL, 0);
+        errno = va.err;
+        return -1;
+    }
+    return pid;
+}
+
+// fork() + execvp(); exec errors come back through a close-on-exec pipe
+static pid_t spawn_fork(char *const argv[], const SpawnFileActions *fa) {
+    int errpipe[2];
+    if (pipe2(errpipe, O_CLOEXEC) == -1) return -1;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        sigset_t mask;
+        sigemptyset(&mask);
+
+        close(errpipe[0]);
+        reset_child_signals(&mask);
+        if (apply_actions(fa) == 0) execvpe(argv[0], argv, child_environ(fa));
+
+        int err = errno;
+        write(errpipe[1], &err, sizeof(err));
+        _exit(127);
+    }
+
+    close(errpipe[1]);
+    if (pid < 0) {
+        close(errpipe[0]);
+        return -1;
+    }
+
+    int err;
+    ssize_t n = read(errpipe[0], &err, sizeof(err));
+    close(errpipe[0]);
+    if (n == sizeof(err)) {
+        waitpid(pid, NULL, 0);
+        errno = err;
+        return -1;
+    }
+    return pid;
+}
+
+
+// Starts argv[0] with the given file actions using the selected launcher
+pid_t spawn_command(char *const argv[], const SpawnFileActions *fa) {
+    if (!argv[0]) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    switch (spawn_method) {
+    case SPAWN_VFORK:
+        return spawn_vfork(argv, fa);
+    case SPAWN_FORK:
+        return spawn_fork(argv, fa);
+    case SPAWN_ZYGOTE:
+        return zygote_spawn(argv, fa);
+    default:
+        if (fa->setup) return spawn_vfork(argv, fa); // needs a hook before exec
+        return spawn_posix(argv, fa);
+    }
+}
+
+// Zygote children are not ours to wait for
+pid_t spawn_wait(pid_t pid, int *status) {
+    if (spawn_method == SPAWN_ZYGOTE) return zygote_wait(pid, status);
+    return waitpid(pid, status, 0);
+}
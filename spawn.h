@@ -0,0 +1,60 @@
+#ifndef SPAWN_H
+#define SPAWN_H
+
+#include <sys/types.h>  // For pid_t
+
+#define SPAWN_MAX_ACTIONS 8 // File actions per launch
+
+// How new processes are created
+typedef enum {
+    SPAWN_POSIX,    // posix_spawnp() (default)
+    SPAWN_VFORK,    // clone(CLONE_VM | CLONE_VFORK) with our own child stack
+    SPAWN_FORK,     // classic fork() + execvp(), kept for comparison
+    SPAWN_ZYGOTE    // handed to the zygote process (zygote.h)
+} SpawnMethod;
+
+// One descriptor operation performed in the child before exec
+typedef struct {
+    int fd;         // Source descriptor
+    int newfd;      // Target descriptor for dup2, -1 to close fd
+} SpawnAction;
+
+// Ordered list of descriptor operations for the child
+typedef struct {
+    SpawnAction actions[SPAWN_MAX_ACTIONS];
+    int count;
+    pid_t pgroup;   // Process group of the child: -1 = ours, 0 = a new one it leads, > 0 = join it
+    void (*setup)(void *arg);   // Runs in the child after the file actions, NULL = none
+    void *setup_arg;
+    const char *cwd;    // Directory the child starts in, NULL = ours
+    char *const *envp;  // Environment of the new program, NULL = ours
+} SpawnFileActions;
+
+// Launcher used by spawn_command()
+extern SpawnMethod spawn_method;
+
+void spawn_actions_init(SpawnFileActions *fa);
+void spawn_add_dup2(SpawnFileActions *fa, int fd, int newfd);
+void spawn_add_close(SpawnFileActions *fa, int fd);
+void spawn_set_pgroup(SpawnFileActions *fa, pid_t pgroup);
+
+// Has the child call setup(arg) right before exec. posix_spawn() has no such
+// hook, so launches with a setup function use the clone() launcher instead.
+// setup may run in the parent's memory: no allocation, no locks.
+void spawn_set_setup(SpawnFileActions *fa, void (*setup)(void *arg), void *arg);
+
+// Starts the child in dir instead of our working directory
+void spawn_set_cwd(SpawnFileActions *fa, const char *dir);
+
+// Gives the new program envp instead of our environment
+void spawn_set_environ(SpawnFileActions *fa, char *const *envp);
+
+// Starts argv[0] (looked up in PATH) with the given file actions.
+// Returns the child's pid, or -1 with errno set if it could not be executed.
+pid_t spawn_command(char *const argv[], const SpawnFileActions *fa);
+
+// Waits for a child started by spawn_command() and stores its wait status.
+// Returns pid, or -1 with errno set (EINTR included, like waitpid()).
+pid_t spawn_wait(pid_t pid, int *status);
+
+#endif
@@ -0,0 +1,526 @@
+#define _DEFAULT_SOURCE
+
+#include "table.h"
+#include "protocol.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#define PID_INDEX_SIZE (CLIENT_TABLE_CAPACITY * 2) // Power of two, at most half full
+#define PID_EMPTY 0ULL                  // Index entry never used
+#define PID_TOMB (~0ULL)                // Index entry of a released slot
+#define FREE_NONE 0xffffffffu           // Free stack is empty
+#define IP_INDEX_SIZE (CLIENT_TABLE_CAPACITY * 2) // Power of two, at most half full
+
+// One client slot in shared memory
+typedef struct {
+    uint32_t seq;           // Odd while a writer changes the slot
+    uint32_t generation;    // Bumped on every claim, upper half of the session id
+    uint32_t next_free;     // Link in the free stack
+    uint64_t abort_session; // Session id another client asked to abort
+    uint32_t abort_channels; // Channels another client asked to close, bit c - 1
+    ClientInfo info;
+    ClientStats stats;      // Counters, not covered by seq
+} ClientSlot;
+
+typedef struct {
+    uint64_t free_head;     // Top of the free stack: ABA tag << 32 | slot index
+    uint32_t used;          // High-water mark of slots ever handed out
+    uint64_t started_ms;    // When the table was created
+    uint64_t sessions;      // Sessions ever claimed a slot
+    uint32_t admitted;      // Live sessions, bounded by max_sessions
+    uint32_t max_sessions;  // Admission limits, see client_table_limits()
+    uint32_t max_per_ip;
+    uint32_t waiting;       // Connections waiting in admission queues
+    uint64_t rejected;      // Connections turned away
+    uint64_t rejected_ip;   // Of those, because of the per-address limit
+    ClientStats closed;     // Counters of released sessions, summed up
+    uint64_t ip_index[IP_INDEX_SIZE]; // IPv4 address << 32 | its live sessions
+    uint64_t pid_index[PID_INDEX_SIZE]; // pid << 32 | slot index, open addressing
+    ClientSlot slots[CLIENT_TABLE_CAPACITY];
+} ClientTable;
+
+// Shared memory client table, mapped before the first fork
+static ClientTable *table;
+
+
+int client_table_init(void) {
+    table = mmap(NULL, sizeof(ClientTable), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (table == MAP_FAILED) {
+        table = NULL;
+        return -1;
+    }
+    table->free_head = FREE_NONE;
+    table->started_ms = stats_now_ms();
+    table->max_sessions = CLIENT_TABLE_CAPACITY;
+    return 0;
+}
+
+void client_table_limits(int max_sessions, int max_per_ip) {
+    if (!table) return;
+    table->max_sessions = max_sessions > 0 && max_sessions < CLIENT_TABLE_CAPACITY ? max_sessions : CLIENT_TABLE_CAPACITY;
+    table->max_per_ip = max_per_ip > 0 ? max_per_ip : 0;
+}
+
+int client_table_size(void) {
+    if (!table) return 0;
+    return (int)__atomic_load_n(&table->used, __ATOMIC_ACQUIRE);
+}
+
+
+uint64_t stats_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts); // no syscall, ~4 ms resolution
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Raises *max to value
+static void stats_max(uint64_t *max, uint64_t value) {
+    uint64_t cur = __atomic_load_n(max, __ATOMIC_RELAXED);
+    while (value > cur &&
+           !__atomic_compare_exchange_n(max, &cur, value, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+// Counters of a live slot, NULL for sessions without one
+static ClientStats *slot_stats(int index) {
+    if (!table || index < 0 || index >= CLIENT_TABLE_CAPACITY) return NULL;
+    return &table->slots[index].stats;
+}
+
+// Writers serialize on the odd sequence value; readers never wait for this
+static void slot_lock(ClientSlot *sl) {
+    uint32_t seq;
+    do {
+        seq = __atomic_load_n(&sl->seq, __ATOMIC_RELAXED);
+    } while ((seq & 1) || !__atomic_compare_exchange_n(&sl->seq, &seq, seq + 1, 0,
+                                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void slot_unlock(ClientSlot *sl) {
+    __atomic_fetch_add(&sl->seq, 1, __ATOMIC_RELEASE);
+}
+
+// Takes a released slot, or a never-used one above the high-water mark
+static int slot_alloc(void) {
+    uint64_t head = __atomic_load_n(&table->free_head, __ATOMIC_ACQUIRE);
+    while ((uint32_t)head != FREE_NONE) {
+        uint32_t index = (uint32_t)head;
+        uint32_t next = __atomic_load_n(&table->slots[index].next_free, __ATOMIC_RELAXED);
+        // The tag changes on every pop, so a stale head cannot win the CAS
+        uint64_t new_head = (((head >> 32) + 1) << 32) | next;
+        if (__atomic_compare_exchange_n(&table->free_head, &head, new_head, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return (int)index;
+    }
+
+    uint32_t used = __atomic_load_n(&table->used, __ATOMIC_RELAXED);
+    while (used < CLIENT_TABLE_CAPACITY) {
+        if (__atomic_compare_exchange_n(&table->used, &used, used + 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            return (int)used;
+    }
+    return -1;
+}
+
+// Puts a slot back on the free stack
+static void slot_free(int index) {
+    uint64_t head = __atomic_load_n(&table->free_head, __ATOMIC_RELAXED);
+    uint64_t new_head;
+    do {
+        __atomic_store_n(&table->slots[index].next_free, (uint32_t)head, __ATOMIC_RELAXED);
+        new_head = (((head >> 32) + 1) << 32) | (uint32_t)index;
+    } while (!__atomic_compare_exchange_n(&table->free_head, &head, new_head, 0,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+
+static uint32_t pid_hash(pid_t pid) {
+    return ((uint32_t)pid * 2654435761u) & (PID_INDEX_SIZE - 1);
+}
+
+static uint64_t pid_entry(pid_t pid, int index) {
+    return ((uint64_t)(uint32_t)pid << 32) | (uint32_t)index;
+}
+
+// Adds pid -> index; several slots may share a pid (reactor workers)
+static void pid_index_add(pid_t pid, int index) {
+    uint64_t entry = pid_entry(pid, index);
+    uint32_t h = pid_hash(pid);
+
+    for (uint32_t probe = 0; probe < PID_INDEX_SIZE; probe++) {
+        uint64_t *e = &table->pid_index[(h + probe) & (PID_INDEX_SIZE - 1)];
+        uint64_t cur = __atomic_load_n(e, __ATOMIC_ACQUIRE);
+        while (cur == PID_EMPTY || cur == PID_TOMB) {
+            if (__atomic_compare_exchange_n(e, &cur, entry, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+                return;
+        }
+    }
+}
+
+// Removes pid -> index. Entries become tombstones so probe chains stay intact.
+static void pid_index_remove(pid_t pid, int index) {
+    uint64_t entry = pid_entry(pid, index);
+    uint32_t h = pid_hash(pid);
+
+    for (uint32_t probe = 0; probe < PID_INDEX_SIZE; probe++) {
+        uint64_t *e = &table->pid_index[(h + probe) & (PID_INDEX_SIZE - 1)];
+        uint64_t cur = __atomic_load_n(e, __ATOMIC_ACQUIRE);
+        if (cur == PID_EMPTY) return;
+        if (cur == entry &&
+            __atomic_compare_exchange_n(e, &cur, PID_TOMB, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            return;
+    }
+}
+
+
+// Adds a released session's counters to the server totals
+static void stats_fold(ClientStats *cs) {
+    ClientStats *t = &table->closed;
+    __atomic_fetch_add(&t->commands, __atomic_exchange_n(&cs->commands, 0, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_fetch_add(&t->bytes_in, __atomic_exchange_n(&cs->bytes_in, 0, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_fetch_add(&t->bytes_out, __atomic_exchange_n(&cs->bytes_out, 0, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_fetch_add(&t->spawn_failures, __atomic_exchange_n(&cs->spawn_failures, 0, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_fetch_add(&t->busy_us, __atomic_exchange_n(&cs->busy_us, 0, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    stats_max(&t->max_us, __atomic_exchange_n(&cs->max_us, 0, __ATOMIC_RELAXED));
+    __atomic_fetch_add(&t->cache_hits, __atomic_exchange_n(&cs->cache_hits, 0, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_fetch_add(&t->cache_misses, __atomic_exchange_n(&cs->cache_misses, 0, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_fetch_add(&t->limit_breaches, __atomic_exchange_n(&cs->limit_breaches, 0, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+}
+
+// Sessions per client address. An entry keeps its address once used; one
+// whose count dropped to 0 may be taken over by another address. Two first
+// connections from one address racing in different processes may each take
+// an entry, which only makes the limit a little loose for that address.
+static uint32_t ip_hash(uint32_t ip) {
+    return (ip * 2654435761u) & (IP_INDEX_SIZE - 1);
+}
+
+// Adds a session for ip. Returns 0, or -1 if ip already has max sessions.
+static int ip_index_add(uint32_t ip, uint32_t max) {
+    uint32_t h = ip_hash(ip);
+    uint64_t *spare = NULL;
+
+    for (uint32_t probe = 0; probe < IP_INDEX_SIZE; probe++) {
+        uint64_t *e = &table->ip_index[(h + probe) & (IP_INDEX_SIZE - 1)];
+        uint64_t cur = __atomic_load_n(e, __ATOMIC_ACQUIRE);
+
+        if (cur != 0 && (uint32_t)(cur >> 32) == ip) {
+            while ((uint32_t)(cur >> 32) == ip) {
+                if ((uint32_t)cur >= max) return -1;
+                if (__atomic_compare_exchange_n(e, &cur, cur + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                    return 0;
+            }
+            continue; // the entry was taken over meanwhile
+        }
+        if (!spare && (uint32_t)cur == 0) spare = e;
+        if (cur == 0) break; // end of the probe chain: ip has no entry
+    }
+
+    // ip has no entry yet: take the first unused one of its chain
+    if (!spare) return 0; // index full: don't hold the client back for it
+    uint64_t cur = __atomic_load_n(spare, __ATOMIC_ACQUIRE);
+    if ((uint32_t)cur == 0 &&
+        __atomic_compare_exchange_n(spare, &cur, ((uint64_t)ip << 32) | 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return 0;
+    return ip_index_add(ip, max); // another address took it first, look again
+}
+
+static void ip_index_remove(uint32_t ip) {
+    uint32_t h = ip_hash(ip);
+
+    for (uint32_t probe = 0; probe < IP_INDEX_SIZE; probe++) {
+        uint64_t *e = &table->ip_index[(h + probe) & (IP_INDEX_SIZE - 1)];
+        uint64_t cur = __atomic_load_n(e, __ATOMIC_ACQUIRE);
+        if (cur == 0) return;
+        while ((uint32_t)(cur >> 32) == ip && (uint32_t)cur > 0) {
+            if (__atomic_compare_exchange_n(e, &cur, cur - 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                return;
+        }
+    }
+}
+
+// IPv4 address counted against the per-address limit, 0 for Unix clients
+static uint32_t limited_ip(const struct sockaddr_in *addr) {
+    if (!table->max_per_ip || addr->sin_family != AF_INET) return 0;
+    return ntohl(addr->sin_addr.s_addr);
+}
+
+int client_slot_claim(int fd, const struct sockaddr_in *addr, pid_t pid, uint64_t *session_id) {
+    if (!table) return CLAIM_FULL;
+
+    // Admission: a session below max_sessions, then one below max_per_ip
+    uint32_t admitted = __atomic_load_n(&table->admitted, __ATOMIC_RELAXED);
+    do {
+        if (admitted >= table->max_sessions) return CLAIM_FULL;
+    } while (!__atomic_compare_exchange_n(&table->admitted, &admitted, admitted + 1, 0,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    uint32_t ip = limited_ip(addr);
+    if (ip && ip_index_add(ip, table->max_per_ip) < 0) {
+        __atomic_fetch_sub(&table->admitted, 1, __ATOMIC_RELAXED);
+        return CLAIM_IP_LIMIT;
+    }
+
+    int index = slot_alloc();
+    if (index < 0) {
+        if (ip) ip_index_remove(ip);
+        __atomic_fetch_sub(&table->admitted, 1, __ATOMIC_RELAXED);
+        return CLAIM_FULL;
+    }
+    __atomic_fetch_add(&table->sessions, 1, __ATOMIC_RELAXED);
+
+    ClientSlot *sl = &table->slots[index];
+    slot_lock(sl);
+    if (++sl->generation == 0) sl->generation = 1; // 0 marks a free slot
+    sl->info.session_id = ((uint64_t)sl->generation << 32) | (uint32_t)index;
+    sl->info.pid = pid;
+    sl->info.fd = fd;
+    sl->info.addr = *addr;
+    __atomic_store_n(&sl->abort_session, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&sl->abort_channels, 0, __ATOMIC_RELAXED);
+    memset(&sl->stats, 0, sizeof(sl->stats));
+    sl->stats.connected_ms = sl->stats.last_active_ms = stats_now_ms();
+    if (pid > 0) pid_index_add(pid, index);
+    *session_id = sl->info.session_id;
+    slot_unlock(sl);
+    return index;
+}
+
+void client_slot_set_pid(int index, uint64_t session_id, pid_t pid) {
+    if (!table || index < 0 || index >= CLIENT_TABLE_CAPACITY) return;
+
+    ClientSlot *sl = &table->slots[index];
+    slot_lock(sl);
+    // The session may already be gone (and the slot reused) by now
+    if (sl->info.session_id == session_id && sl->info.pid <= 0) {
+        sl->info.pid = pid;
+        pid_index_add(pid, index);
+    }
+    slot_unlock(sl);
+}
+
+void client_slot_release(int index) {
+    if (!table || index < 0 || index >= CLIENT_TABLE_CAPACITY) return;
+
+    ClientSlot *sl = &table->slots[index];
+    slot_lock(sl);
+    if (sl->info.session_id == 0) {
+        slot_unlock(sl); // already released
+        return;
+    }
+    if (sl->info.pid > 0) pid_index_remove(sl->info.pid, index);
+    uint32_t ip = limited_ip(&sl->info.addr);
+    if (ip) ip_index_remove(ip);
+    __atomic_fetch_sub(&table->admitted, 1, __ATOMIC_RELAXED);
+    stats_fold(&sl->stats);
+    sl->info.session_id = 0;
+    sl->info.pid = -1;
+    sl->info.fd = -1;
+    memset(&sl->info.addr, 0, sizeof(sl->info.addr));
+    slot_unlock(sl);
+
+    slot_free(index);
+}
+
+int client_table_release_pid(pid_t pid) {
+    int indexes[64];
+    int released = 0, n;
+
+    // Releasing removes the entries, so repeat until none are left
+    while ((n = client_slot_find_pid(pid, indexes, 64)) > 0) {
+        for (int i = 0; i < n; i++) client_slot_release(indexes[i]);
+        released += n;
+    }
+    return released;
+}
+
+
+int client_slot_read(int index, ClientInfo *info) {
+    if (!table || index < 0 || index >= CLIENT_TABLE_CAPACITY) return 0;
+
+    ClientSlot *sl = &table->slots[index];
+    uint32_t before, after;
+    do {
+        before = __atomic_load_n(&sl->seq, __ATOMIC_ACQUIRE);
+        memcpy(info, &sl->info, sizeof(*info));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&sl->seq, __ATOMIC_RELAXED);
+    } while ((before & 1) || before != after);
+
+    return info->session_id != 0;
+}
+
+int client_slot_find_session(uint64_t session_id) {
+    int index = (int)(uint32_t)session_id;
+    ClientInfo info;
+
+    if (client_slot_read(index, &info) && info.session_id == session_id) return index;
+    return -1;
+}
+
+int client_slot_find_pid(pid_t pid, int *indexes, int max) {
+    if (!table || pid <= 0) return 0;
+
+    uint32_t h = pid_hash(pid);
+    int found = 0;
+
+    for (uint32_t probe = 0; probe < PID_INDEX_SIZE && found < max; probe++) {
+        uint64_t cur = __atomic_load_n(&table->pid_index[(h + probe) & (PID_INDEX_SIZE - 1)],
+                                       __ATOMIC_ACQUIRE);
+        if (cur == PID_EMPTY) break;
+        if (cur != PID_TOMB && (pid_t)(cur >> 32) == pid) indexes[found++] = (int)(uint32_t)cur;
+    }
+    return found;
+}
+
+int client_slot_request_abort(int index, uint64_t session_id) {
+    ClientInfo info;
+    if (!client_slot_read(index, &info) || info.session_id != session_id) return 0;
+
+    __atomic_store_n(&table->slots[index].abort_session, session_id, __ATOMIC_RELEASE);
+    return 1;
+}
+
+int client_slot_abort_requested(int index, uint64_t session_id) {
+    if (!table || index < 0 || index >= CLIENT_TABLE_CAPACITY) return 0;
+    return __atomic_load_n(&table->slots[index].abort_session, __ATOMIC_ACQUIRE) == session_id;
+}
+
+int client_slot_request_channel_abort(int index, uint64_t session_id, int channel) {
+    ClientInfo info;
+    if (channel < 1 || channel > PROTO_MAX_CHANNELS) return 0;
+    if (!client_slot_read(index, &info) || info.session_id != session_id) return 0;
+
+    __atomic_fetch_or(&table->slots[index].abort_channels, 1u << (channel - 1), __ATOMIC_RELEASE);
+    return 1;
+}
+
+uint32_t client_slot_take_channel_aborts(int index) {
+    if (!table || index < 0 || index >= CLIENT_TABLE_CAPACITY) return 0;
+    return __atomic_exchange_n(&table->slots[index].abort_channels, 0, __ATOMIC_ACQUIRE);
+}
+
+
+void stats_input(int index, size_t bytes) {
+    ClientStats *cs = slot_stats(index);
+    if (!cs) return;
+    __atomic_fetch_add(&cs->bytes_in, bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&cs->last_active_ms, stats_now_ms(), __ATOMIC_RELAXED);
+}
+
+void stats_output(int index, size_t bytes) {
+    ClientStats *cs = slot_stats(index);
+    if (!cs) return;
+    __atomic_fetch_add(&cs->bytes_out, bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&cs->last_active_ms, stats_now_ms(), __ATOMIC_RELAXED);
+}
+
+void stats_command(int index, uint64_t us) {
+    ClientStats *cs = slot_stats(index);
+    if (!cs) return;
+    __atomic_fetch_add(&cs->commands, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&cs->busy_us, us, __ATOMIC_RELAXED);
+    stats_max(&cs->max_us, us);
+}
+
+void stats_spawn_failure(int index) {
+    ClientStats *cs = slot_stats(index);
+    if (cs) __atomic_fetch_add(&cs->spawn_failures, 1, __ATOMIC_RELAXED);
+}
+
+void stats_cache(int index, int hit) {
+    ClientStats *cs = slot_stats(index);
+    if (cs) __atomic_fetch_add(hit ? &cs->cache_hits : &cs->cache_misses, 1, __ATOMIC_RELAXED);
+}
+
+void stats_limit(int index) {
+    ClientStats *cs = slot_stats(index);
+    if (cs) __atomic_fetch_add(&cs->limit_breaches, 1, __ATOMIC_RELAXED);
+}
+
+void stats_channels(int index, int delta) {
+    ClientStats *cs = slot_stats(index);
+    if (cs) __atomic_fetch_add(&cs->channels, (uint64_t)(int64_t)delta, __ATOMIC_RELAXED);
+}
+
+void server_stats_reject(int per_ip) {
+    if (!table) return;
+    __atomic_fetch_add(&table->rejected, 1, __ATOMIC_RELAXED);
+    if (per_ip) __atomic_fetch_add(&table->rejected_ip, 1, __ATOMIC_RELAXED);
+}
+
+void server_stats_waiting(int delta) {
+    if (table) __atomic_fetch_add(&table->waiting, delta, __ATOMIC_RELAXED);
+}
+
+// Copies counters that other processes keep changing
+static void stats_load(ClientStats *cs, ClientStats *stats) {
+    stats->commands = __atomic_load_n(&cs->commands, __ATOMIC_RELAXED);
+    stats->bytes_in = __atomic_load_n(&cs->bytes_in, __ATOMIC_RELAXED);
+    stats->bytes_out = __atomic_load_n(&cs->bytes_out, __ATOMIC_RELAXED);
+    stats->spawn_failures = __atomic_load_n(&cs->spawn_failures, __ATOMIC_RELAXED);
+    stats->busy_us = __atomic_load_n(&cs->busy_us, __ATOMIC_RELAXED);
+    stats->max_us = __atomic_load_n(&cs->max_us, __ATOMIC_RELAXED);
+    stats->cache_hits = __atomic_load_n(&cs->cache_hits, __ATOMIC_RELAXED);
+    stats->cache_misses = __atomic_load_n(&cs->cache_misses, __ATOMIC_RELAXED);
+    stats->limit_breaches = __atomic_load_n(&cs->limit_breaches, __ATOMIC_RELAXED);
+    stats->channels = __atomic_load_n(&cs->channels, __ATOMIC_RELAXED);
+    stats->connected_ms = __atomic_load_n(&cs->connected_ms, __ATOMIC_RELAXED);
+    stats->last_active_ms = __atomic_load_n(&cs->last_active_ms, __ATOMIC_RELAXED);
+}
+
+void client_stats_read(int index, ClientStats *stats) {
+    ClientStats *cs = slot_stats(index);
+    if (cs)
+        stats_load(cs, stats);
+    else
+        memset(stats, 0, sizeof(*stats));
+}
+
+void server_stats_read(ServerStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (!table) return;
+
+    ClientStats sum;
+    stats_load(&table->closed, &sum);
+
+    int size = client_table_size();
+    for (int i = 0; i < size; i++) {
+        ClientInfo info;
+        if (!client_slot_read(i, &info)) continue;
+
+        ClientStats cs;
+        client_stats_read(i, &cs);
+        sum.commands += cs.commands;
+        sum.bytes_in += cs.bytes_in;
+        sum.bytes_out += cs.bytes_out;
+        sum.spawn_failures += cs.spawn_failures;
+        sum.busy_us += cs.busy_us;
+        if (cs.max_us > sum.max_us) sum.max_us = cs.max_us;
+        sum.cache_hits += cs.cache_hits;
+        sum.cache_misses += cs.cache_misses;
+        sum.limit_breaches += cs.limit_breaches;
+        stats->channels += cs.channels;
+        stats->active++;
+    }
+
+    stats->sessions = __atomic_load_n(&table->sessions, __ATOMIC_RELAXED);
+    stats->rejected = __atomic_load_n(&table->rejected, __ATOMIC_RELAXED);
+    stats->rejected_ip = __atomic_load_n(&table->rejected_ip, __ATOMIC_RELAXED);
+    stats->waiting = __atomic_load_n(&table->waiting, __ATOMIC_RELAXED);
+    stats->max_sessions = table->max_sessions;
+    stats->commands = sum.commands;
+    stats->bytes_in = sum.bytes_in;
+    stats->bytes_out = sum.bytes_out;
+    stats->spawn_failures = sum.spawn_failures;
+    stats->busy_us = sum.busy_us;
+    stats->max_us = sum.max_us;
+    stats->cache_hits = sum.cache_hits;
+    stats->cache_misses = sum.cache_misses;
+    stats->limit_breaches = sum.limit_breaches;
+    stats->uptime_ms = stats_now_ms() - table->started_ms;
+}
@@ -0,0 +1,149 @@
+#ifndef TABLE_H
+#define TABLE_H
+
+#include <netinet/in.h> // For struct sockaddr_in
+#include <sys/types.h>  // For pid_t
+#include <stdint.h>
+#include <stddef.h>     // For size_t
+
+// Shared client table
+//
+// One table is mapped MAP_SHARED before the server forks, so the parent,
+// every session process and every worker see the same slots. Address space
+// for CLIENT_TABLE_CAPACITY slots is reserved up front with MAP_NORESERVE;
+// pages are only touched as the high-water mark grows.
+//
+// No locks are taken on the hot path:
+//  - free slots are kept on a lock-free stack (Treiber stack with an ABA tag),
+//    never-used slots come from an atomically bumped high-water mark
+//  - each slot is guarded by a sequence counter, readers (stat, abort) retry
+//    until they copied the slot without a writer in between
+//  - a slot is found by session id in O(1) (the id embeds the slot index) and
+//    by pid through a lock-free open-addressing index
+
+#define CLIENT_TABLE_CAPACITY 16384 // Most simultaneous clients
+
+// Why client_slot_claim() turned a client away
+#define CLAIM_FULL -1       // max_sessions sessions are running
+#define CLAIM_IP_LIMIT -2   // The client's address has max_per_ip sessions
+
+// Copy of one slot as seen by a reader
+typedef struct {
+    uint64_t session_id;    // Unique for the lifetime of the server, 0 = none
+    pid_t pid;              // Process owning the session (-1 until known)
+    int fd;                 // Socket in the owning process
+    struct sockaddr_in addr;
+} ClientInfo;
+
+// Per-session counters. They live next to the slot but outside its sequence
+// counter: whichever process serves the session (session process, reactor,
+// command runner) bumps them with relaxed atomic adds.
+typedef struct {
+    uint64_t commands;          // Command lines executed
+    uint64_t bytes_in;          // Bytes received from the client
+    uint64_t bytes_out;         // Bytes sent to the client
+    uint64_t spawn_failures;    // Commands that could not be started
+    uint64_t busy_us;           // Cumulative command wall time
+    uint64_t max_us;            // Longest command
+    uint64_t cache_hits;        // Commands answered from the output cache
+    uint64_t cache_misses;      // Cacheable commands that had to run
+    uint64_t limit_breaches;    // Commands stopped by a resource limit or the deadline
+    uint64_t channels;          // Logical channels open right now (channel.h)
+    uint64_t connected_ms;      // Monotonic time the session started
+    uint64_t last_active_ms;    // Monotonic time of the last input or output
+} ClientStats;
+
+// Server-wide counters: closed sessions are folded in when their slot is
+// released, live ones are summed when read, so no counter is shared on the
+// hot path
+typedef struct {
+    uint64_t sessions;          // Sessions accepted
+    uint64_t rejected;          // Connections turned away by admission control
+    uint64_t rejected_ip;       // Of those, because of the per-address limit
+    uint64_t waiting;           // Connections queued for a session right now
+    uint64_t max_sessions;      // Admission limit on concurrent sessions
+    uint64_t active;            // Sessions open right now
+    uint64_t channels;          // Logical channels open in them
+    uint64_t commands, bytes_in, bytes_out, spawn_failures, busy_us, max_us;
+    uint64_t cache_hits, cache_misses, limit_breaches;
+    uint64_t uptime_ms;
+} ServerStats;
+
+// Maps the table. Must be called once before any process is forked.
+// Returns 0, or -1 if the memory cannot be mapped.
+int client_table_init(void);
+
+// Number of slots ever used; every live index is below it
+int client_table_size(void);
+
+// Sets the admission limits checked by client_slot_claim(): concurrent
+// sessions (0 = the table capacity) and sessions per IPv4 address (0 = no
+// limit; Unix socket clients only count as sessions). Call after
+// client_table_init(), before any process is forked.
+void client_table_limits(int max_sessions, int max_per_ip);
+
+// Claims a free slot, returns its index, or CLAIM_FULL / CLAIM_IP_LIMIT if
+// the session can't be admitted now. The new session id is stored in
+// *session_id.
+int client_slot_claim(int fd, const struct sockaddr_in *addr, pid_t pid, uint64_t *session_id);
+
+// Records the owning process of a slot claimed with pid -1
+void client_slot_set_pid(int index, uint64_t session_id, pid_t pid);
+
+// Marks a client table slot as free again
+void client_slot_release(int index);
+
+// Releases every slot owned by a process that died without doing it.
+// Returns the number of slots released.
+int client_table_release_pid(pid_t pid);
+
+// Copies a slot consistently. Returns 1 if it holds a live session.
+int client_slot_read(int index, ClientInfo *info);
+
+// Finds the slot of a session id, returns its index or -1
+int client_slot_find_session(uint64_t session_id);
+
+// Stores the indexes of up to max slots owned by pid, returns how many
+int client_slot_find_pid(pid_t pid, int *indexes, int max);
+
+// Asks the owner of a session to close it. The request is tied to the session
+// id, so it never hits a client that reused the slot later.
+// Returns 1 if the session was still live.
+int client_slot_request_abort(int index, uint64_t session_id);
+
+// Returns 1 if another client asked to abort this session
+int client_slot_abort_requested(int index, uint64_t session_id);
+
+// Asks the owner of a session to close one of its logical channels (1 to
+// PROTO_MAX_CHANNELS).
+// Returns 1 if the session was still live.
+int client_slot_request_channel_abort(int index, uint64_t session_id, int channel);
+
+// Takes the channels other clients asked to close since the last call, as
+// a mask with bit c - 1 set for channel c
+uint32_t client_slot_take_channel_aborts(int index);
+
+// Counter updates; index may be -1 for a session without a slot
+void stats_input(int index, size_t bytes);
+void stats_output(int index, size_t bytes);
+void stats_command(int index, uint64_t us);
+void stats_spawn_failure(int index);
+void stats_cache(int index, int hit);
+void stats_limit(int index);
+void stats_channels(int index, int delta);
+
+// Admission counters: a connection turned away, and the change in the
+// number of connections waiting for a session
+void server_stats_reject(int per_ip);
+void server_stats_waiting(int delta);
+
+// Copies the counters of a slot
+void client_stats_read(int index, ClientStats *stats);
+
+// Adds up the server-wide counters
+void server_stats_read(ServerStats *stats);
+
+// Monotonic clock in milliseconds, as used by the counters
+uint64_t stats_now_ms(void);
+
+#endif
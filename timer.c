@@ -0,0 +1,159 @@
+#include "timer.h"
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/timerfd.h>
+
+#define TIMER_MASK (TIMER_SLOTS - 1)
+// Longest delay in ticks; one top-level slot less than the whole span, so a
+// timer never lands in the top slot that is being passed right now
+#define TIMER_MAX_DELAY ((1ULL << (TIMER_BITS * TIMER_LEVELS)) - (1ULL << (TIMER_BITS * (TIMER_LEVELS - 1))))
+
+static Timer *wheel[TIMER_LEVELS][TIMER_SLOTS];
+static uint64_t current;    // Next tick to process
+static int armed;           // Timers in the wheel
+static int running;         // timer_run() is firing timers, current must not move
+static int tfd = -1;
+
+
+// Current monotonic time in ticks
+static uint64_t now_ticks(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / TIMER_TICK_MS;
+}
+
+// Starts or stops the periodic tick of the timerfd
+static void set_tick(int running) {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (running) {
+        its.it_interval.tv_nsec = TIMER_TICK_MS * 1000000L;
+        its.it_value = its.it_interval;
+    }
+    if (tfd >= 0) timerfd_settime(tfd, 0, &its, NULL);
+}
+
+int timer_init(void) {
+    tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    current = now_ticks();
+    return tfd;
+}
+
+int timer_fd(void) {
+    return tfd;
+}
+
+void timer_close(void) {
+    if (tfd >= 0) close(tfd);
+    tfd = -1;
+}
+
+
+static void link_timer(Timer **head, Timer *t) {
+    t->next = *head;
+    if (*head) (*head)->pprev = &t->next;
+    *head = t;
+    t->pprev = head;
+}
+
+static void unlink_timer(Timer *t) {
+    *t->pprev = t->next;
+    if (t->next) t->next->pprev = t->pprev;
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+// Puts an armed timer into the slot that covers its expiry
+static void place_timer(Timer *t) {
+    uint64_t delta = t->expires > current ? t->expires - current : 0;
+    if (delta > TIMER_MAX_DELAY) {
+        delta = TIMER_MAX_DELAY;
+        t->expires = current + delta;
+    }
+    uint64_t when = delta ? t->expires : current; // due or overdue: the slot processed next
+
+    int level = 0;
+    while (level < TIMER_LEVELS - 1 && delta >= (1ULL << (TIMER_BITS * (level + 1)))) level++;
+    link_timer(&wheel[level][(when >> (TIMER_BITS * level)) & TIMER_MASK], t);
+}
+
+
+void timer_setup(Timer *t, void (*fire)(void *data), void *data) {
+    memset(t, 0, sizeof(*t));
+    t->fire = fire;
+    t->data = data;
+}
+
+int timer_pending(const Timer *t) {
+    return t->pprev != NULL;
+}
+
+void timer_cancel(Timer *t) {
+    if (!t->pprev) return;
+    unlink_timer(t);
+    if (--armed == 0) set_tick(0);
+}
+
+void timer_set(Timer *t, uint64_t ms) {
+    timer_cancel(t);
+
+    // With nothing armed the wheel may be far behind; skip the empty ticks.
+    // Not from a callback: the tick being run would be skipped with it.
+    uint64_t now = now_ticks();
+    if (armed == 0 && !running && current < now) current = now;
+
+    // At least one tick, so a timer set by a callback never lands in the
+    // slot being run
+    uint64_t ticks = (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    t->expires = now + (ticks ? ticks : 1);
+    place_timer(t);
+    if (armed++ == 0) set_tick(1);
+}
+
+// Moves the timers of one slot of a higher level down to where they belong
+// now. Returns the slot's index, 0 means the level above wrapped as well.
+static int cascade(int level) {
+    int index = (current >> (TIMER_BITS * level)) & TIMER_MASK;
+    Timer *list = wheel[level][index];
+    wheel[level][index] = NULL;
+
+    while (list) {
+        Timer *t = list;
+        list = t->next;
+        place_timer(t);
+    }
+    return index;
+}
+
+// Processes one tick: spreads higher levels down when level 0 wraps, then
+// fires the timers of the slot
+static void run_tick(void) {
+    int index = current & TIMER_MASK;
+    for (int level = 1; index == 0 && level < TIMER_LEVELS; level++) index = cascade(level);
+
+    // One at a time from the head: callbacks may set or cancel any timer
+    Timer **slot = &wheel[0][current & TIMER_MASK];
+    while (*slot) {
+        Timer *t = *slot;
+        unlink_timer(t);
+        if (--armed == 0) set_tick(0);
+        t->fire(t->data);
+    }
+    current++;
+}
+
+void timer_run(void) {
+    uint64_t expirations;
+    if (tfd >= 0 && read(tfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        perror("read timerfd");
+
+    // The clock, not the tick count, says how far to go; late wakeups catch up
+    uint64_t now = now_ticks();
+    running = 1;
+    while (armed > 0 && current <= now) run_tick();
+    running = 0;
+    if (armed == 0 && current < now) current = now;
+}
@@ -0,0 +1,58 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+// Timer wheel
+//
+// Deadlines of one process (session idle timeouts, command deadlines) are
+// kept in a hierarchical timing wheel: TIMER_LEVELS wheels of TIMER_SLOTS
+// slots, level 0 has one slot per tick and every level above covers
+// TIMER_SLOTS times the span of the one below. A timer is a node in the list
+// of its slot, so setting, resetting and cancelling it is O(1) no matter how
+// many sessions there are. When a lower level wraps around, the next slot of
+// the level above is spread down, so a timer moves at most TIMER_LEVELS - 1
+// times before it fires.
+//
+// A timerfd ticks while any timer is armed. The owner polls timer_fd() with
+// its other descriptors and calls timer_run() when it is readable.
+
+#define TIMER_TICK_MS 100   // Resolution of every timer
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_LEVELS 4      // 64^4 ticks, about 19 days; longer delays are cut to that
+
+// One deadline, usually embedded in the object it belongs to
+typedef struct Timer {
+    void (*fire)(void *data);   // Called once when the timer expires
+    void *data;
+    uint64_t expires;           // Tick at which it fires
+    struct Timer *next, **pprev; // Links in its slot, pprev == NULL while not armed
+} Timer;
+
+// Creates the timerfd. Returns it, or -1 if it cannot be created.
+int timer_init(void);
+
+// The descriptor to poll for readability, -1 before timer_init()
+int timer_fd(void);
+
+// Sets the callback of a timer that is not armed yet
+void timer_setup(Timer *t, void (*fire)(void *data), void *data);
+
+// Arms t to fire after ms milliseconds (rounded up to whole ticks, at least
+// one), replacing its previous deadline
+void timer_set(Timer *t, uint64_t ms);
+
+// Disarms t; does nothing if it is not armed
+void timer_cancel(Timer *t);
+
+// Returns 1 if t is armed
+int timer_pending(const Timer *t);
+
+// Consumes the timerfd and fires every timer that is due
+void timer_run(void);
+
+// Closes the timerfd (the timers themselves belong to their owners)
+void timer_close(void);
+
+#endif
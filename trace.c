@@ -0,0 +1,181 @@
+#include "trace.h"
+#include "shell.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+// Spans of one lane not written to the file yet
+typedef struct TraceBuffer {
+    pid_t pid;          // Process that recorded them; a forked copy starts empty
+    int tid;            // Lane: 0 = listener, index + 1 = session
+    size_t len;
+    char text[TRACE_BUFFER_SIZE];
+    struct TraceBuffer *next;   // Every buffer of this process (trace_flush_all)
+} TraceBuffer;
+
+static int trace_fd = -1;
+static char *file_path;
+static pid_t server_pid;            // "pid" of every event, so all lanes show as one server
+static TraceBuffer *listener;       // Accept and dispatch spans
+static TraceBuffer *buffers;
+
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// Copies text into out as the inside of a JSON string, cut at TRACE_DETAIL_MAX
+static void json_escape(char *out, size_t size, const char *text) {
+    size_t n = 0;
+    for (const unsigned char *p = (const unsigned char *)text;
+         *p && n + 7 < size && p - (const unsigned char *)text < TRACE_DETAIL_MAX; p++) {
+        if (*p == '"' || *p == '\\') {
+            out[n++] = '\\';
+            out[n++] = *p;
+        } else if (*p < 0x20) {
+            n += snprintf(out + n, size - n, "\\u%04x", *p);
+        } else {
+            out[n++] = *p;
+        }
+    }
+    out[n] = '\0';
+}
+
+// Writes a buffer recorded by this process; async-signal-safe
+static void buffer_write(TraceBuffer *b) {
+    if (b->pid != getpid()) {
+        b->pid = getpid();
+        b->len = 0;
+        return;
+    }
+
+    size_t off = 0;
+    while (off < b->len) {
+        ssize_t n = write(trace_fd, b->text + off, b->len - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        off += n;
+    }
+    b->len = 0;
+}
+
+// Appends one event to the buffer, writing the buffer out first if it is full
+static void buffer_append(TraceBuffer *b, const char *event, size_t len) {
+    if (b->pid != getpid()) {
+        // Inherited over fork(): the parent writes these itself
+        b->pid = getpid();
+        b->len = 0;
+    }
+    if (b->len + len > sizeof(b->text)) buffer_write(b);
+    if (len > sizeof(b->text)) return;
+    memcpy(b->text + b->len, event, len);
+    b->len += len;
+}
+
+// Creates the buffer of a lane, named in the viewer by a metadata event
+static TraceBuffer *buffer_new(int tid, const char *lane) {
+    TraceBuffer *b = malloc(sizeof(*b));
+    if (!b) return NULL;
+    b->pid = getpid();
+    b->tid = tid;
+    b->len = 0;
+    b->next = buffers;
+    buffers = b;
+
+    char event[256];
+    int n = snprintf(event, sizeof(event),
+                     "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, "
+                     "\"args\": {\"name\": \"%s\"}},\n", server_pid, tid, lane);
+    buffer_append(b, event, n);
+    return b;
+}
+
+
+int trace_open(const char *path) {
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (trace_fd < 0) return -1;
+
+    file_path = strdup(path);
+    server_pid = getpid();
+    if (write(trace_fd, "[\n", 2) != 2 || !(listener = buffer_new(0, "listener"))) {
+        close(trace_fd);
+        trace_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+int trace_enabled(void) {
+    return trace_fd >= 0;
+}
+
+const char *trace_path(void) {
+    return trace_fd >= 0 ? file_path : NULL;
+}
+
+uint64_t trace_begin(void) {
+    return trace_fd >= 0 ? now_us() : 0;
+}
+
+void trace_end(Session *s, const char *name, uint64_t start, const char *detail) {
+    if (!start) return;
+    uint64_t end = now_us();
+
+    TraceBuffer *b = s ? s->trace : listener;
+    if (!b) {
+        char lane[32];
+        snprintf(lane, sizeof(lane), "session #%d", s->index);
+        if (!(b = s->trace = buffer_new(s->index + 1, lane))) return;
+    }
+
+    char args[TRACE_DETAIL_MAX * 6 + 32] = "";
+    if (detail) {
+        char escaped[TRACE_DETAIL_MAX * 6];
+        json_escape(escaped, sizeof(escaped), detail);
+        snprintf(args, sizeof(args), ", \"args\": {\"detail\": \"%s\"}", escaped);
+    }
+
+    char event[sizeof(args) + 256];
+    int n = snprintf(event, sizeof(event),
+                     "{\"name\": \"%s\", \"cat\": \"spaasm\", \"ph\": \"X\", \"ts\": %llu, \"dur\": %llu, "
+                     "\"pid\": %d, \"tid\": %d%s},\n",
+                     name, (unsigned long long)start, (unsigned long long)(end - start),
+                     server_pid, b->tid, args);
+    buffer_append(b, event, n);
+}
+
+void trace_flush(Session *s) {
+    if (trace_fd >= 0 && s->trace) buffer_write(s->trace);
+}
+
+void trace_free(Session *s) {
+    TraceBuffer *b = s->trace;
+    if (!b) return;
+    if (trace_fd >= 0) buffer_write(b);
+
+    for (TraceBuffer **p = &buffers; *p; p = &(*p)->next) {
+        if (*p != b) continue;
+        *p = b->next;
+        break;
+    }
+    free(b);
+    s->trace = NULL;
+}
+
+void trace_flush_all(void) {
+    if (trace_fd < 0) return;
+    for (TraceBuffer *b = buffers; b; b = b->next) buffer_write(b);
+}
+
+void trace_close(void) {
+    if (trace_fd < 0) return;
+    trace_flush_all();
+    close(trace_fd);
+    trace_fd = -1;
+}
@@ -0,0 +1,61 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+// Span tracing (-X)
+//
+// Opt-in: records how long the phases of every command took (parse, spawn,
+// first output byte, streaming, wait) and the accept and dispatch of every
+// connection, as Chrome trace events ("ph": "X", microseconds). Load the
+// file in chrome://tracing or Perfetto; every session is one thread lane.
+//
+// Each session keeps its spans as JSON text in a buffer of the process that
+// recorded them (session process, reactor, runner, job or channel). The
+// buffer is appended to the file with one write when it fills up, when the
+// process is done with the session, on `trace`, and at shutdown, so
+// processes never mix their lines. The file is the JSON array format without
+// its closing bracket, which the viewers accept, so writers can go on
+// appending until the very end.
+//
+// Off, trace_begin() returns 0 without reading the clock and trace_end()
+// returns at once.
+
+#define TRACE_BUFFER_SIZE (16 * 1024)   // JSON text of one session kept before a write
+#define TRACE_DETAIL_MAX 96             // Longest command text kept with a span
+
+struct Session;
+
+// Starts tracing into path (truncated). Called once, before the server
+// forks anything that records spans.
+// Returns 0, or -1 if the file cannot be opened.
+int trace_open(const char *path);
+
+// Returns 1 if the server records spans
+int trace_enabled(void);
+
+// File the spans go to, NULL when off
+const char *trace_path(void);
+
+// Start of a span: the current time in microseconds, 0 when off
+uint64_t trace_begin(void);
+
+// Records the span from start to now in the session's lane (s = NULL: the
+// listener's). detail, if not NULL, is shown with it. Does nothing if start
+// is 0.
+void trace_end(struct Session *s, const char *name, uint64_t start, const char *detail);
+
+// Writes the spans recorded for the session in this process to the file
+void trace_flush(struct Session *s);
+
+// Writes the session's spans and drops its buffer
+void trace_free(struct Session *s);
+
+// Writes every buffer of this process, the listener's included. Uses only
+// write(), so a SIGTERM handler may call it.
+void trace_flush_all(void);
+
+// Writes what is left at shutdown and closes the file
+void trace_close(void);
+
+#endif
@@ -0,0 +1,421 @@
+#define _GNU_SOURCE
+
+#include "zygote.h"
+#include "quota.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+#define ZYGOTE_MAX_EVENTS 32
+
+// Message types
+enum { ZYGOTE_SPAWN, ZYGOTE_SPAWNED, ZYGOTE_EXITED };
+
+// What the request carries besides argv
+#define ZYGOTE_LIMITS 1 // Apply the -R/-G limits (the file actions had a setup hook)
+#define ZYGOTE_CWD    2 // A working directory follows argv
+#define ZYGOTE_ENV    4 // An environment follows
+
+// Start of a launch request; argc + envc strings (and the directory) follow,
+// each with its terminating NUL
+typedef struct {
+    int32_t type;
+    int32_t pgroup;     // As in SpawnFileActions
+    int32_t flags;
+    int32_t argc;
+    int32_t envc;
+    int32_t fd_count;   // Descriptors passed with SCM_RIGHTS
+    int32_t newfd[SPAWN_MAX_ACTIONS];   // Where each of them goes in the child
+} ZygoteRequest;
+
+// ZYGOTE_SPAWNED: value is 0, or the errno if pid is -1.
+// ZYGOTE_EXITED: value is the wait status of pid.
+typedef struct {
+    int32_t type;
+    int32_t pid;
+    int32_t value;
+} ZygoteReply;
+
+// A command the zygote started and the channel waiting for it (-1 = gone)
+typedef struct {
+    pid_t pid;
+    int channel;
+} ZygoteChild;
+
+// Client side: the zygote's control socket, shared by every process, and the
+// channel of this process (a forked child opens its own)
+static int control_fd = -1;
+static int channel_fd = -1;
+static pid_t channel_owner;
+
+// Exit statuses that arrived while waiting for another command
+static struct { pid_t pid; int status; } *finished;
+static int finished_len, finished_cap;
+
+static char request_buffer[ZYGOTE_MAX_REQUEST];
+
+
+// Sends one message with up to SPAWN_MAX_ACTIONS descriptors
+static int send_message(int fd, const void *buf, size_t len, const int *fds, int count) {
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * SPAWN_MAX_ACTIONS)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { (void *)buf, len };
+    struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+    if (count > 0) {
+        mh.msg_control = control.buf;
+        mh.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+        struct cmsghdr *c = CMSG_FIRSTHDR(&mh);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int) * count);
+        memcpy(CMSG_DATA(c), fds, sizeof(int) * count);
+    }
+
+    ssize_t n;
+    while ((n = sendmsg(fd, &mh, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+    return n == (ssize_t)len ? 0 : -1;
+}
+
+// Receives one message; the descriptors that came with it are stored in fds
+// (close-on-exec) and counted in *count. Returns the length, 0 at end of file.
+static ssize_t recv_message(int fd, void *buf, size_t len, int *fds, int *count) {
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * SPAWN_MAX_ACTIONS)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { buf, len };
+    struct msghdr mh = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control.buf, .msg_controllen = sizeof(control.buf),
+    };
+
+    ssize_t n;
+    while ((n = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+
+    *count = 0;
+    if (n < 0) return -1;
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&mh); c; c = CMSG_NXTHDR(&mh, c)) {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+        int received = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds + *count, CMSG_DATA(c), received * sizeof(int));
+        *count += received;
+    }
+    return n;
+}
+
+
+// <===> Zygote process <===>
+
+static ZygoteChild *children;
+static int child_count, child_cap;
+
+// Setup hook of a launch with limits, see quota_apply()
+static void zygote_limits(void *pgroup) {
+    quota_apply(*(pid_t *)pgroup);
+}
+
+// Splits the strings after the request header into list (NULL-terminated).
+// Returns the position after them, NULL if the message ends early.
+static char *take_strings(char *pos, char *end, char **list, int count) {
+    for (int i = 0; i < count; i++) {
+        char *nul = memchr(pos, '\0', end - pos);
+        if (!nul) return NULL;
+        list[i] = pos;
+        pos = nul + 1;
+    }
+    list[count] = NULL;
+    return pos;
+}
+
+// Starts the command of one request and answers with its pid
+static void zygote_launch(int channel, char *buf, ssize_t len, const int *fds, int count) {
+    ZygoteRequest *r = (ZygoteRequest *)buf;
+    ZygoteReply reply = { .type = ZYGOTE_SPAWNED, .pid = -1, .value = EINVAL };
+    char **argv = NULL, **envp = NULL;
+    char *cwd[2] = { NULL, NULL };
+    char *pos = buf + sizeof(*r), *end = buf + len;
+
+    int valid = len >= (ssize_t)sizeof(*r) && r->type == ZYGOTE_SPAWN && r->fd_count == count &&
+                r->argc >= 1 && r->envc >= 0 && r->argc + r->envc <= len;
+    if (valid) {
+        argv = malloc((r->argc + 1) * sizeof(char *));
+        envp = malloc((r->envc + 1) * sizeof(char *));
+        valid = argv && envp && (pos = take_strings(pos, end, argv, r->argc)) &&
+                (!(r->flags & ZYGOTE_CWD) || (pos = take_strings(pos, end, cwd, 1))) &&
+                (!(r->flags & ZYGOTE_ENV) || take_strings(pos, end, envp, r->envc));
+    }
+
+    if (valid) {
+        pid_t pgroup = r->pgroup > 0 ? r->pgroup : 0;
+        SpawnFileActions fa;
+        spawn_actions_init(&fa);
+        for (int i = 0; i < count && i < SPAWN_MAX_ACTIONS; i++) spawn_add_dup2(&fa, fds[i], r->newfd[i]);
+        spawn_set_pgroup(&fa, r->pgroup);
+        spawn_set_cwd(&fa, cwd[0]);
+        if (r->flags & ZYGOTE_ENV) spawn_set_environ(&fa, envp);
+        if (r->flags & ZYGOTE_LIMITS) spawn_set_setup(&fa, zygote_limits, &pgroup);
+
+        reply.pid = spawn_command(argv, &fa);
+        reply.value = reply.pid < 0 ? errno : 0;
+    }
+
+    // Remembered before its SIGCHLD is read, so the exit goes to this channel
+    if (reply.pid > 0) {
+        if (child_count == child_cap) {
+            int cap = child_cap ? child_cap * 2 : 64;
+            ZygoteChild *grown = realloc(children, cap * sizeof(*children));
+            if (grown) {
+                children = grown;
+                child_cap = cap;
+            }
+        }
+        if (child_count < child_cap) children[child_count++] = (ZygoteChild){ reply.pid, channel };
+    }
+
+    free(argv);
+    free(envp);
+    send_message(channel, &reply, sizeof(reply), NULL, 0);
+}
+
+// Reaps the finished commands and tells their channels
+static void zygote_reap(void) {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (int i = 0; i < child_count; i++) {
+            if (children[i].pid != pid) continue;
+            ZygoteReply reply = { .type = ZYGOTE_EXITED, .pid = pid, .value = status };
+            if (children[i].channel >= 0) send_message(children[i].channel, &reply, sizeof(reply), NULL, 0);
+            children[i] = children[--child_count];
+            break;
+        }
+    }
+}
+
+// Drops a channel whose process is gone; its commands still get reaped
+static void zygote_close_channel(int epoll_fd, int channel) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, channel, NULL);
+    close(channel);
+    for (int i = 0; i < child_count; i++)
+        if (children[i].channel == channel) children[i].channel = -1;
+}
+
+// Serves launch requests until the server is gone; never returns
+static void zygote_main(int control, pid_t server) {
+    // Dies with the server, even if it was killed
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != server) _exit(0);
+    spawn_method = SPAWN_POSIX;
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    int signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (signal_fd < 0 || epoll_fd < 0) {
+        perror("zygote");
+        _exit(1);
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = control };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, control, &ev);
+    ev.data.fd = signal_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &ev);
+
+    struct epoll_event events[ZYGOTE_MAX_EVENTS];
+    int fds[SPAWN_MAX_ACTIONS], count;
+    for (;;) {
+        int n = epoll_wait(epoll_fd, events, ZYGOTE_MAX_EVENTS, -1);
+        if (n < 0 && errno != EINTR) _exit(1);
+
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+
+            if (fd == signal_fd) {
+                struct signalfd_siginfo info;
+                while (read(signal_fd, &info, sizeof(info)) < 0 && errno == EINTR);
+                zygote_reap();
+            } else if (fd == control) {
+                // A process opens its channel; end of file: every server process is gone
+                char byte;
+                ssize_t len = recv_message(control, &byte, 1, fds, &count);
+                if (len <= 0) _exit(0);
+                for (int j = 0; j < count; j++) {
+                    struct epoll_event cev = { .events = EPOLLIN, .data.fd = fds[j] };
+                    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fds[j], &cev);
+                }
+            } else {
+                ssize_t len = recv_message(fd, request_buffer, sizeof(request_buffer), fds, &count);
+                if (len <= 0) {
+                    for (int j = 0; j < count; j++) close(fds[j]);
+                    zygote_close_channel(epoll_fd, fd);
+                    continue;
+                }
+                zygote_launch(fd, request_buffer, len, fds, count);
+                for (int j = 0; j < count; j++) close(fds[j]);
+            }
+        }
+    }
+}
+
+int zygote_start(void) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) return -1;
+
+    pid_t server = getpid();
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(sv[1]);
+        zygote_main(sv[0], server);
+    }
+
+    close(sv[0]);
+    control_fd = sv[1];
+    return 0;
+}
+
+
+// <===> Server side <===>
+
+// Returns the channel of this process, opening it on first use
+static int zygote_channel(void) {
+    if (channel_fd >= 0 && channel_owner == getpid()) return channel_fd;
+
+    // A forked child must not read the answers meant for its parent
+    if (channel_fd >= 0) close(channel_fd);
+    channel_fd = -1;
+    finished_len = 0;
+    if (control_fd < 0) {
+        errno = ECHILD;
+        return -1;
+    }
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) return -1;
+    int sent = send_message(control_fd, "", 1, &sv[1], 1);
+    close(sv[1]);
+    if (sent < 0) {
+        close(sv[0]);
+        return -1;
+    }
+
+    channel_fd = sv[0];
+    channel_owner = getpid();
+    return channel_fd;
+}
+
+// Reads the next answer of the zygote; exits of other commands are kept
+// for zygote_wait(). Returns -1 with errno set if the zygote is gone.
+static int read_reply(ZygoteReply *reply) {
+    ssize_t n;
+    while ((n = recv(channel_fd, reply, sizeof(*reply), 0)) < 0 && errno == EINTR);
+    if (n != sizeof(*reply)) {
+        if (n >= 0) errno = ECHILD;
+        return -1;
+    }
+    if (reply->type != ZYGOTE_EXITED) return 0;
+
+    if (finished_len == finished_cap) {
+        int cap = finished_cap ? finished_cap * 2 : 16;
+        void *grown = realloc(finished, cap * sizeof(*finished));
+        if (!grown) return 0; // out of memory, the status is lost
+        finished = grown;
+        finished_cap = cap;
+    }
+    finished[finished_len].pid = reply->pid;
+    finished[finished_len].status = reply->value;
+    finished_len++;
+    return 0;
+}
+
+// Appends a string to the request; -1 if it doesn't fit
+static int put_string(size_t *pos, const char *text) {
+    size_t n = strlen(text) + 1;
+    if (*pos + n > sizeof(request_buffer)) return -1;
+    memcpy(request_buffer + *pos, text, n);
+    *pos += n;
+    return 0;
+}
+
+pid_t zygote_spawn(char *const argv[], const SpawnFileActions *fa) {
+    if (zygote_channel() < 0) return -1;
+
+    ZygoteRequest *r = (ZygoteRequest *)request_buffer;
+    memset(r, 0, sizeof(*r));
+    r->type = ZYGOTE_SPAWN;
+    r->pgroup = fa->pgroup;
+    if (fa->setup) r->flags |= ZYGOTE_LIMITS;
+
+    // Our descriptors; closing one of them is up to close-on-exec in the zygote
+    int fds[SPAWN_MAX_ACTIONS];
+    for (int i = 0; i < fa->count; i++) {
+        if (fa->actions[i].newfd < 0) continue;
+        fds[r->fd_count] = fa->actions[i].fd;
+        r->newfd[r->fd_count++] = fa->actions[i].newfd;
+    }
+
+    size_t pos = sizeof(*r);
+    int fits = 1;
+    for (; argv[r->argc]; r->argc++) fits &= put_string(&pos, argv[r->argc]) == 0;
+    if (fa->cwd) {
+        r->flags |= ZYGOTE_CWD;
+        fits &= put_string(&pos, fa->cwd) == 0;
+    }
+    if (fa->envp) {
+        r->flags |= ZYGOTE_ENV;
+        for (; fa->envp[r->envc]; r->envc++) fits &= put_string(&pos, fa->envp[r->envc]) == 0;
+    }
+    if (!fits) {
+        errno = E2BIG;
+        return -1;
+    }
+
+    if (send_message(channel_fd, request_buffer, pos, fds, r->fd_count) < 0) return -1;
+
+    ZygoteReply reply;
+    do {
+        if (read_reply(&reply) < 0) return -1;
+    } while (reply.type != ZYGOTE_SPAWNED);
+
+    if (reply.pid < 0) {
+        errno = reply.value;
+        return -1;
+    }
+    return reply.pid;
+}
+
+pid_t zygote_wait(pid_t pid, int *status) {
+    for (;;) {
+        for (int i = 0; i < finished_len; i++) {
+            if (finished[i].pid != pid) continue;
+            *status = finished[i].status;
+            finished[i] = finished[--finished_len];
+            return pid;
+        }
+
+        if (channel_fd < 0 || channel_owner != getpid()) {
+            errno = ECHILD;
+            return -1;
+        }
+        ZygoteReply reply;
+        if (read_reply(&reply) < 0) return -1;
+    }
+}
@@ -0,0 +1,35 @@
+#ifndef ZYGOTE_H
+#define ZYGOTE_H
+
+#include <sys/types.h>  // For pid_t
+#include "spawn.h"
+
+// Zygote launcher
+//
+// A small helper process forked by main() before the server builds up any
+// state (log writer, client table, cache, session buffers). With -Z every
+// command is started by it instead of by the process that runs the command
+// line, so a launch costs the same however big that process has grown.
+// Each process talks to the zygote over its own SOCK_SEQPACKET channel: it
+// sends argv, working directory, environment and the descriptors of the file
+// actions (SCM_RIGHTS) and gets back the pid, later the wait status. The
+// commands are the zygote's children, so they are waited for with
+// zygote_wait(), not waitpid().
+// The setup hook of the file actions can't cross the process boundary; if
+// one is set the zygote applies the -R/-G limits (quota.h) instead, the only
+// hook the server uses.
+
+#define ZYGOTE_MAX_REQUEST (64 * 1024)  // argv, directory and environment of one launch
+
+// Forks the zygote; quota_init() must have run. Returns 0, or -1 with errno set.
+int zygote_start(void);
+
+// Starts argv[0] through the zygote with the given file actions.
+// Returns the child's pid, or -1 with errno set if it could not be executed.
+pid_t zygote_spawn(char *const argv[], const SpawnFileActions *fa);
+
+// Waits for a command started by zygote_spawn() and stores its wait status.
+// Returns pid, or -1 with errno set.
+pid_t zygote_wait(pid_t pid, int *status);
+
+#endif